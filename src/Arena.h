@@ -0,0 +1,164 @@
+// Arena.h
+
+// Region allocation.  An Arena hands out memory by bumping a pointer through
+// large blocks and gives it all back at once, so a structure built from many
+// small pieces costs a few big allocations instead of one per piece, and
+// nothing is freed piece by piece.  Destructors are not run for what is put
+// in an arena; whoever puts something there that owns memory elsewhere has to
+// destroy it.
+//
+// Two uses:
+//
+//   map lifetime   things built when a map is loaded and dropped with it,
+//                  released when the arena is destroyed or release()d
+//   scratch        temporaries of a single query on the calling thread, from
+//                  scratchArena(); a ScratchScope rewinds it when it ends, and
+//                  the blocks are kept for the next query
+
+#ifndef ARENA_INCLUDED
+#define ARENA_INCLUDED
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+class Arena
+{
+public:
+    explicit Arena(size_t blockSize = 64 * 1024)
+     : m_blockSize(blockSize), m_current(0), m_used(0)
+    {}
+
+    ~Arena() { release(); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t bytes, size_t align = alignof(std::max_align_t))
+    {
+        // a block left over from before a rewind is used if it's big enough
+        for (; m_current < m_blocks.size(); m_current++, m_used = 0) {
+            size_t start = alignedFrom(m_blocks[m_current].data, m_used, align);
+            if (start + bytes <= m_blocks[m_current].size) {
+                m_used = start + bytes;
+                return m_blocks[m_current].data + start;
+            }
+        }
+        size_t size = bytes + align > m_blockSize ? bytes + align : m_blockSize;
+        char* data = static_cast<char*>(std::malloc(size));
+        if (data == nullptr)
+            throw std::bad_alloc();
+        m_blocks.push_back(Block{ data, size });
+        size_t start = alignedFrom(data, 0, align);
+        m_used = start + bytes;
+        return data + start;
+    }
+
+      // constructs a T in the arena; its destructor is never run
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+      // A point to rewind to.  Everything allocated after it is given back,
+      // but the blocks are kept.
+    struct Mark {
+        size_t block;
+        size_t used;
+    };
+
+    Mark mark() const { return Mark{ m_current, m_used }; }
+    void rewind(const Mark& m) { m_current = m.block; m_used = m.used; }
+
+      // frees every block
+    void release()
+    {
+        for (const Block& b : m_blocks)
+            std::free(b.data);
+        m_blocks.clear();
+        m_current = 0;
+        m_used = 0;
+    }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+      // first offset at or after used that is aligned in data
+    static size_t alignedFrom(const char* data, size_t used, size_t align)
+    {
+        size_t at = reinterpret_cast<size_t>(data) + used;
+        return used + (align - at % align) % align;
+    }
+
+    size_t m_blockSize;
+    std::vector<Block> m_blocks;
+    size_t m_current;       // block being allocated from
+    size_t m_used;          // bytes of it handed out
+};
+
+// Standard allocator over an Arena, for containers.  Deallocation does nothing;
+// the memory comes back when the arena is released or rewound, so such a
+// container must be gone by then.
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena& arena) : m_arena(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.arena()) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    Arena* arena() const { return m_arena; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return m_arena == other.arena(); }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return m_arena != other.arena(); }
+
+private:
+    Arena* m_arena;
+};
+
+// The calling thread's scratch arena.
+inline Arena& scratchArena()
+{
+    thread_local Arena arena(256 * 1024);
+    return arena;
+}
+
+// Gives back everything taken from the scratch arena while it was alive.
+// Declare it before the containers that use the arena, so they go first.
+class ScratchScope
+{
+public:
+    ScratchScope() : m_mark(scratchArena().mark()) {}
+    ~ScratchScope() { scratchArena().rewind(m_mark); }
+
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+
+private:
+    Arena::Mark m_mark;
+};
+
+  // a vector of temporaries in the scratch arena:
+  //     ScratchScope scope;
+  //     ScratchVector<int> v(scratchAllocator<int>());
+template <typename T>
+using ScratchVector = std::vector<T, ArenaAllocator<T>>;
+
+template <typename T>
+ArenaAllocator<T> scratchAllocator() { return ArenaAllocator<T>(scratchArena()); }
+
+#endif // ARENA_INCLUDED
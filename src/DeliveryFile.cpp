@@ -0,0 +1,280 @@
+#include "provided.h"
+#include "Executor.h"
+#include <string>
+#include <vector>
+#include <charconv>
+#include <cstring>
+#include <algorithm>
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+// A file mapped read-only into memory, so it's parsed where it lies instead
+// of being copied out a line at a time.
+class MappedFile
+{
+public:
+    MappedFile(const string& path);
+    ~MappedFile();
+
+    bool ok() const { return m_ok; }
+    const char* begin() const { return m_data; }
+    const char* end() const { return m_data + m_size; }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+private:
+    const char* m_data;
+    size_t m_size;
+    bool m_ok;
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#endif
+};
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const string& path)
+ : m_data(""), m_size(0), m_ok(false), m_mapping(nullptr)
+{
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    LARGE_INTEGER size;
+    if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size))
+        return;
+    m_ok = true;
+    if (size.QuadPart == 0)
+        return;     // an empty file can't be mapped
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    const void* view = m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view == nullptr) {
+        m_ok = false;
+        return;
+    }
+    m_data = static_cast<const char*>(view);
+    m_size = static_cast<size_t>(size.QuadPart);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_size > 0)
+        UnmapViewOfFile(m_data);
+    if (m_mapping != nullptr)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+}
+
+#else
+
+MappedFile::MappedFile(const string& path)
+ : m_data(""), m_size(0), m_ok(false)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        m_ok = true;
+        if (st.st_size > 0) {   // an empty file can't be mapped
+            void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view == MAP_FAILED)
+                m_ok = false;
+            else {
+                madvise(view, st.st_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const char*>(view);
+                m_size = st.st_size;
+            }
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_size > 0)
+        munmap(const_cast<char*>(m_data), m_size);
+}
+
+#endif
+
+// Files at least this big are split across threads, if asked to.
+static const size_t kMinParallelBytes = 1 << 20;
+
+static const char* skipBlanks(const char* p, const char* end)
+{
+    while (p != end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+// Reads a number at p (after any blanks) into value and points text at it,
+// leaving p just past it.  False unless the whole word is a number.
+static bool readNumber(const char*& p, const char* end, const char*& text, size_t& length, double& value)
+{
+    p = skipBlanks(p, end);
+    const char* start = p;
+    while (p != end && *p != ' ' && *p != '\t')
+        p++;
+    if (p == start)
+        return false;
+    from_chars_result r = from_chars(start, p, value);
+    if (r.ec != errc() || r.ptr != p)
+        return false;
+    text = start;
+    length = p - start;
+    return true;
+}
+
+// Reads "latitude longitude" from [p, end) into gc; false if there's anything
+// else there, unless anyAfter.  The texts are kept as they're written, since
+// that's how the map's nodes are looked up.
+static bool readCoord(const char* p, const char* end, GeoCoord& gc, bool anyAfter = false)
+{
+    const char* latText;
+    const char* lonText;
+    size_t latLength, lonLength;
+    double lat, lon;
+    if (!readNumber(p, end, latText, latLength, lat) || !readNumber(p, end, lonText, lonLength, lon))
+        return false;
+    if (!anyAfter && skipBlanks(p, end) != end)
+        return false;
+    gc.latitudeText.assign(latText, latLength);
+    gc.longitudeText.assign(lonText, lonLength);
+    gc.latitude = lat;
+    gc.longitude = lon;
+    return true;
+}
+
+// The deliveries on the lines of [begin, end), which starts at the start of a
+// line.  Errors are numbered from 1 at begin until the pieces are put back
+// together.
+struct FilePiece
+{
+    const char* begin;
+    const char* end;
+    size_t numLines;
+    vector<DeliveryRequest> deliveries;
+    vector<DeliveryFileError> errors;
+};
+
+// lines read between looks at whether the load has been cancelled
+static const size_t kLinesPerCancelCheck = 1 << 14;
+
+static void readDeliveries(FilePiece& piece)
+{
+    size_t line = 0;
+    GeoCoord location;
+    for (const char* p = piece.begin; p != piece.end; ) {
+        if (line % kLinesPerCancelCheck == 0 && CancellationScope::cancelled())
+            return;
+        const char* eol = static_cast<const char*>(memchr(p, '\n', piece.end - p));
+        const char* next = eol ? eol + 1 : piece.end;
+        const char* end = eol ? eol : piece.end;
+        if (end != p && end[-1] == '\r')
+            end--;
+        line++;
+        if (skipBlanks(p, end) == end) {        // blank lines are skipped
+            p = next;
+            continue;
+        }
+
+        const char* colon = static_cast<const char*>(memchr(p, ':', end - p));
+        const char* problem = nullptr;
+        if (colon == nullptr)
+            problem = "Missing colon";
+        else if (!readCoord(p, colon, location))
+            problem = "Bad format";
+        else if (colon + 1 == end)
+            problem = "Missing item";
+
+        if (problem != nullptr)
+            piece.errors.push_back(DeliveryFileError{ line, problem, string(p, end) });
+        else
+            piece.deliveries.emplace_back(string(colon + 1, end), location);
+        p = next;
+    }
+    piece.numLines = line;
+}
+
+bool loadDeliveryFile(string deliveriesFile, GeoCoord& depot,
+    vector<DeliveryRequest>& deliveries, vector<DeliveryFileError>& errors, int threads)
+{
+    MappedFile file(deliveriesFile);
+    if (!file.ok())
+        return false;
+
+    // The depot, on the first line that isn't blank.  Anything after its
+    // latitude and longitude is ignored.
+    const char* begin = file.begin();
+    const char* end = file.end();
+    size_t depotLine = 0;
+    for (;;) {
+        const char* eol = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        const char* depotEnd = eol ? eol : end;
+        if (depotEnd != begin && depotEnd[-1] == '\r')
+            depotEnd--;
+        depotLine++;
+        if (eol != nullptr && skipBlanks(begin, depotEnd) == depotEnd) {
+            begin = eol + 1;
+            continue;
+        }
+        if (!readCoord(begin, depotEnd, depot, true)) {
+            errors.push_back(DeliveryFileError{ depotLine, "Bad depot", string(begin, depotEnd) });
+            return false;
+        }
+        begin = eol ? eol + 1 : end;
+        break;
+    }
+
+    // Cut the rest into pieces at line ends and read them on the shared
+    // executor.
+    Executor& executor = Executor::shared();
+    if (threads <= 0)
+        threads = executor.numWorkers();
+    size_t size = end - begin;
+    int numPieces = size >= kMinParallelBytes ? threads : 1;
+    vector<FilePiece> pieces(numPieces);
+    const char* at = begin;
+    for (int k = 0; k < numPieces; k++) {
+        const char* cut = k + 1 == numPieces ? end : begin + size * (k + 1) / numPieces;
+        if (cut < at)
+            cut = at;
+        if (cut != end) {
+            const char* nl = static_cast<const char*>(memchr(cut, '\n', end - cut));
+            cut = nl ? nl + 1 : end;
+        }
+        pieces[k].begin = at;
+        pieces[k].end = cut;
+        at = cut;
+    }
+
+    executor.parallelFor(numPieces, [&pieces](size_t k) { readDeliveries(pieces[k]); });
+    if (CancellationScope::cancelled())
+        return false;
+
+    // Put them back together in file order.
+    size_t total = 0;
+    for (const FilePiece& piece : pieces)
+        total += piece.deliveries.size();
+    deliveries.reserve(deliveries.size() + total);
+    size_t linesBefore = depotLine;
+    for (FilePiece& piece : pieces) {
+        move(piece.deliveries.begin(), piece.deliveries.end(), back_inserter(deliveries));
+        for (DeliveryFileError& e : piece.errors) {
+            e.line += linesBefore;
+            errors.push_back(move(e));
+        }
+        linesBefore += piece.numLines;
+    }
+    return true;
+}
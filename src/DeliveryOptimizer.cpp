@@ -1,10 +1,15 @@
 #include "provided.h"
+#include "Arena.h"
+#include "Executor.h"
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <limits>
 using namespace std;
 
 
-std::default_random_engine random_engine;
+// one engine per thread, since several routes can be optimized at once
+thread_local std::default_random_engine random_engine;
 
 double randDouble(double min, double max) {
     std::uniform_real_distribution<double> unif(min, max);
@@ -20,6 +25,443 @@ int randInt(int min, int max) {
     return rand;
 }
 
+// Arrival times along a tour, for scoring it against delivery windows.
+// Position 0 is the depot at departure, 1..n are the stops in tour order and
+// n+1 is the return to the depot.  Travel times are crow distance at a
+// constant speed.
+//
+// A swap moves the arrivals at the stops after it all by the same amount,
+// until a stop absorbs it: driving later eats into a stop's waiting time
+// (its forward slack), and driving earlier only helps as far as the driver
+// isn't made to wait (its backward slack).  So the arrivals are kept in a
+// segment tree that shifts a run of stops at once, and that also keeps, for
+// each range, the smallest slack of the stops on time, the smallest lateness
+// of the stops late, the number late and the total lateness.  A shift that
+// makes none of a range's stops late or on time prices the range from those
+// in constant time.  Pricing a swap and making it both look at stops one at
+// a time only where the shift is absorbed or a stop's lateness starts or
+// stops.  Neither replays the tour.
+class WindowedTour
+{
+public:
+    WindowedTour(const GeoCoord& depot, const vector<DeliveryRequest>& stops, double departure, double mph);
+
+      // order[p] is the stop at position p, for p = 1..n
+    void setOrder(const vector<int>& order);
+    const vector<int>& order() const { return m_order; }
+
+    double distance() const { return m_distance; }
+    double lateness() const { return m_tree.empty() ? 0 : m_tree[1].sumLate; }
+
+      // how much swapping the stops at positions i < j changes the distance
+      // and the lateness
+    double swapDistanceDelta(int i, int j) const;
+    double swapLatenessDelta(int i, int j) const;
+
+      // swaps the stops at positions i < j
+    void swap(int i, int j);
+
+private:
+    const GeoCoord& m_depot;
+    const vector<DeliveryRequest>& m_stops;
+    double m_departure;
+    double m_secondsPerMile;
+
+    vector<int> m_order;
+    double m_distance;
+
+      // Node 1 is the root, covering positions 1..n, and node k's children
+      // are 2k and 2k+1.  Each node's fields include its own shift, which it
+      // hasn't yet passed on to its children.  arrival is kept only at leaves.
+    struct Node {
+        double minSlack;    // windowEnd - arrival, over the stops on time
+        double minLate;     // arrival - windowEnd, over the stops late
+        double minEarly;    // arrival - windowStart, over all
+        double sumLate;
+        int numLate;
+        double shift;
+        double arrival;
+    };
+    vector<Node> m_tree;
+    int m_size;
+
+    const GeoCoord& at(int p) const {
+        return (p == 0 || p == static_cast<int>(m_order.size()) - 1) ? m_depot : m_stops[m_order[p]].location;
+    }
+
+    double travel(const GeoCoord& from, const GeoCoord& to) const {
+        return distanceEarthMiles(from, to) * m_secondsPerMile;
+    }
+
+      // leaving time from a stop reached at time arrival
+    double leave(int stop, double arrival) const {
+        return max(arrival, m_stops[stop].windowStart) + m_stops[stop].serviceTime;
+    }
+
+    double leaveAt(int p) const {
+        return p == 0 ? m_departure : leave(m_order[p], arrival(p));
+    }
+
+    double arrival(int p) const;
+
+    void setLeaf(Node& leaf, int stop, double arrival) const;
+    void pull(int node);
+    void shiftNode(int node, double shift);
+    void push(int node);
+    void build(int node, int lo, int hi, const vector<double>& arrivals);
+    void setArrival(int node, int lo, int hi, int p, double arrival);
+    void shiftRange(int node, int lo, int hi, int l, int r, double shift);
+
+      // the change in lateness if the arrivals at positions l..r all move by
+      // shift
+    double shiftedLateness(int node, int lo, int hi, int l, int r, double shift, double above) const;
+
+      // the first position in l..r where arrival - windowStart < bound, or -1
+    int firstEarlierThan(int node, int lo, int hi, int l, int r, double bound, double above) const;
+
+      // a run of positions whose arrivals all move by shift
+    struct Run {
+        int first;
+        int last;
+        double shift;
+    };
+    vector<Run> m_runs;
+
+      // Moves the arrival at position s by shift and carries it on through
+      // position r, as far as it goes.  Returns the change in lateness, and
+      // leaves how much the leaving time from r moves in shift.  The runs
+      // that move go in runs, if it isn't null.
+    double carry(int s, int r, double& shift, vector<Run>* runs) const;
+};
+
+WindowedTour::WindowedTour(const GeoCoord& depot, const vector<DeliveryRequest>& stops, double departure, double mph)
+ : m_depot(depot), m_stops(stops), m_departure(departure), m_secondsPerMile(3600 / mph), m_distance(0), m_size(0)
+{
+}
+
+void WindowedTour::setOrder(const vector<int>& order)
+{
+    int n = order.size() - 2;
+    m_order = order;
+    m_size = n;
+    m_distance = 0;
+    vector<double> arrivals(n + 2, 0);
+    double clock = m_departure;
+    for (int p = 1; p <= n + 1; p++) {
+        double miles = distanceEarthMiles(at(p - 1), at(p));
+        m_distance += miles;
+        arrivals[p] = clock + miles * m_secondsPerMile;
+        if (p <= n)
+            clock = leave(m_order[p], arrivals[p]);
+    }
+    m_tree.assign(n > 0 ? 4 * n : 0, Node());
+    if (n > 0)
+        build(1, 1, n, arrivals);
+}
+
+void WindowedTour::setLeaf(Node& leaf, int stop, double arrival) const
+{
+    const DeliveryRequest& d = m_stops[stop];
+    const double kInfinity = numeric_limits<double>::infinity();
+    bool late = arrival > d.windowEnd;
+    leaf.arrival = arrival;
+    leaf.minSlack = late ? kInfinity : d.windowEnd - arrival;
+    leaf.minLate = late ? arrival - d.windowEnd : kInfinity;
+    leaf.minEarly = arrival - d.windowStart;
+    leaf.sumLate = late ? arrival - d.windowEnd : 0;
+    leaf.numLate = late;
+    leaf.shift = 0;
+}
+
+void WindowedTour::pull(int node)
+{
+    const Node& a = m_tree[2 * node];
+    const Node& b = m_tree[2 * node + 1];
+    Node& n = m_tree[node];
+    n.minSlack = min(a.minSlack, b.minSlack);
+    n.minLate = min(a.minLate, b.minLate);
+    n.minEarly = min(a.minEarly, b.minEarly);
+    n.sumLate = a.sumLate + b.sumLate;
+    n.numLate = a.numLate + b.numLate;
+}
+
+// only for a shift that makes none of the node's stops late or on time
+void WindowedTour::shiftNode(int node, double shift)
+{
+    Node& n = m_tree[node];
+    n.minSlack -= shift;
+    n.minLate += shift;
+    n.minEarly += shift;
+    n.sumLate += shift * n.numLate;
+    n.shift += shift;
+    n.arrival += shift;
+}
+
+void WindowedTour::push(int node)
+{
+    if (m_tree[node].shift != 0) {
+        shiftNode(2 * node, m_tree[node].shift);
+        shiftNode(2 * node + 1, m_tree[node].shift);
+        m_tree[node].shift = 0;
+    }
+}
+
+void WindowedTour::build(int node, int lo, int hi, const vector<double>& arrivals)
+{
+    if (lo == hi) {
+        setLeaf(m_tree[node], m_order[lo], arrivals[lo]);
+        return;
+    }
+    int mid = (lo + hi) / 2;
+    build(2 * node, lo, mid, arrivals);
+    build(2 * node + 1, mid + 1, hi, arrivals);
+    m_tree[node].shift = 0;
+    pull(node);
+}
+
+double WindowedTour::arrival(int p) const
+{
+    double above = 0;
+    int node = 1, lo = 1, hi = m_size;
+    while (lo != hi) {
+        above += m_tree[node].shift;
+        int mid = (lo + hi) / 2;
+        if (p <= mid) {
+            node = 2 * node;
+            hi = mid;
+        }
+        else {
+            node = 2 * node + 1;
+            lo = mid + 1;
+        }
+    }
+    return m_tree[node].arrival + above;
+}
+
+void WindowedTour::setArrival(int node, int lo, int hi, int p, double arrival)
+{
+    if (lo == hi) {
+        setLeaf(m_tree[node], m_order[p], arrival);
+        return;
+    }
+    push(node);
+    int mid = (lo + hi) / 2;
+    if (p <= mid)
+        setArrival(2 * node, lo, mid, p, arrival);
+    else
+        setArrival(2 * node + 1, mid + 1, hi, p, arrival);
+    pull(node);
+}
+
+void WindowedTour::shiftRange(int node, int lo, int hi, int l, int r, double shift)
+{
+    if (r < lo || hi < l)
+        return;
+    const Node& n = m_tree[node];
+    bool unchanged = shift > 0 ? n.minSlack >= shift : n.minLate > -shift;
+    if (l <= lo && hi <= r && unchanged) {
+        shiftNode(node, shift);
+        return;
+    }
+    if (lo == hi) {
+        setLeaf(m_tree[node], m_order[lo], n.arrival + shift);
+        return;
+    }
+    push(node);
+    int mid = (lo + hi) / 2;
+    shiftRange(2 * node, lo, mid, l, r, shift);
+    shiftRange(2 * node + 1, mid + 1, hi, l, r, shift);
+    pull(node);
+}
+
+// above is the shift the node's ancestors haven't passed on to it yet
+double WindowedTour::shiftedLateness(int node, int lo, int hi, int l, int r, double shift, double above) const
+{
+    if (r < lo || hi < l)
+        return 0;
+    const Node& n = m_tree[node];
+    bool unchanged = shift > 0 ? n.minSlack - above >= shift : n.minLate + above > -shift;
+    if (l <= lo && hi <= r && unchanged)
+        return shift * n.numLate;
+    if (lo == hi) {
+        double windowEnd = m_stops[m_order[lo]].windowEnd;
+        double arrival = n.arrival + above;
+        return max(0.0, arrival + shift - windowEnd) - max(0.0, arrival - windowEnd);
+    }
+    int mid = (lo + hi) / 2;
+    above += n.shift;
+    return shiftedLateness(2 * node, lo, mid, l, r, shift, above) +
+           shiftedLateness(2 * node + 1, mid + 1, hi, l, r, shift, above);
+}
+
+int WindowedTour::firstEarlierThan(int node, int lo, int hi, int l, int r, double bound, double above) const
+{
+    if (r < lo || hi < l || m_tree[node].minEarly + above >= bound)
+        return -1;
+    if (lo == hi)
+        return lo;
+    int mid = (lo + hi) / 2;
+    above += m_tree[node].shift;
+    int p = firstEarlierThan(2 * node, lo, mid, l, r, bound, above);
+    return p >= 0 ? p : firstEarlierThan(2 * node + 1, mid + 1, hi, l, r, bound, above);
+}
+
+// Arriving later by shift, the arrivals move together up to the first stop
+// where the driver waits, which takes up as much of it as the wait.
+// Arriving earlier, they move together up to the first stop where the driver
+// would now wait, and what's left is how much earlier the driver leaves it.
+double WindowedTour::carry(int s, int r, double& shift, vector<Run>* runs) const
+{
+    double change = 0;
+    while (s <= r && shift != 0) {
+        int p = firstEarlierThan(1, 1, m_size, s, r, shift > 0 ? 0 : -shift, 0);
+        int last = p >= 0 ? p : r;
+        double next = shift;
+        if (p >= 0) {
+            double early = arrival(p) - m_stops[m_order[p]].windowStart;
+            next = shift > 0 ? max(0.0, shift + early) : -max(0.0, early);
+        }
+        change += shiftedLateness(1, 1, m_size, s, last, shift, 0);
+        if (runs != nullptr)
+            runs->push_back(Run{ s, last, shift });
+        shift = next;
+        s = last + 1;
+    }
+    return change;
+}
+
+double WindowedTour::swapDistanceDelta(int i, int j) const
+{
+    const GeoCoord& a = at(i);
+    const GeoCoord& b = at(j);
+    if (j == i + 1) {
+        return distanceEarthMiles(at(i - 1), b) + distanceEarthMiles(a, at(j + 1))
+             - distanceEarthMiles(at(i - 1), a) - distanceEarthMiles(b, at(j + 1));
+    }
+    return distanceEarthMiles(at(i - 1), b) + distanceEarthMiles(b, at(i + 1))
+         + distanceEarthMiles(at(j - 1), a) + distanceEarthMiles(a, at(j + 1))
+         - distanceEarthMiles(at(i - 1), a) - distanceEarthMiles(a, at(i + 1))
+         - distanceEarthMiles(at(j - 1), b) - distanceEarthMiles(b, at(j + 1));
+}
+
+// The same steps as swap, on a tour that doesn't change: stop j at
+// position i, the stops between shifted, stop i at position j and the
+// stops after shifted.
+double WindowedTour::swapLatenessDelta(int i, int j) const
+{
+    int n = m_size;
+    int stopI = m_order[i], stopJ = m_order[j];
+    const DeliveryRequest& I = m_stops[stopI];
+    const DeliveryRequest& J = m_stops[stopJ];
+
+    double arriveJ = leaveAt(i - 1) + travel(at(i - 1), J.location);
+    double change = max(0.0, arriveJ - J.windowEnd) - max(0.0, arrival(i) - I.windowEnd);
+    double leaveBefore = leave(stopJ, arriveJ);
+    const GeoCoord* before = &J.location;
+    if (j > i + 1) {
+        double shift = leaveBefore + travel(J.location, at(i + 1)) - arrival(i + 1);
+        double left = leaveAt(j - 1);
+        change += carry(i + 1, j - 1, shift, nullptr);
+        leaveBefore = left + shift;
+        before = &at(j - 1);
+    }
+
+    double arriveI = leaveBefore + travel(*before, I.location);
+    change += max(0.0, arriveI - I.windowEnd) - max(0.0, arrival(j) - J.windowEnd);
+    if (j < n) {
+        double shift = leave(stopI, arriveI) + travel(I.location, at(j + 1)) - arrival(j + 1);
+        change += carry(j + 1, n, shift, nullptr);
+    }
+    return change;
+}
+
+// Each run is found before any is moved; a run only moves positions past
+// the ones the next is found from.
+void WindowedTour::swap(int i, int j)
+{
+    int n = m_size;
+    m_distance += swapDistanceDelta(i, j);
+    int stopI = m_order[i], stopJ = m_order[j];
+    const DeliveryRequest& I = m_stops[stopI];
+    const DeliveryRequest& J = m_stops[stopJ];
+
+    m_runs.clear();
+    double arriveJ = leaveAt(i - 1) + travel(at(i - 1), J.location);
+    if (j > i + 1) {
+        double shift = leave(stopJ, arriveJ) + travel(J.location, at(i + 1)) - arrival(i + 1);
+        carry(i + 1, j - 1, shift, &m_runs);
+    }
+    for (const Run& run : m_runs)
+        shiftRange(1, 1, n, run.first, run.last, run.shift);
+
+    std::swap(m_order[i], m_order[j]);
+    setArrival(1, 1, n, i, arriveJ);
+    double arriveI = leaveAt(j - 1) + travel(at(j - 1), I.location);
+    setArrival(1, 1, n, j, arriveI);
+
+    m_runs.clear();
+    if (j < n) {
+        double shift = leave(stopI, arriveI) + travel(I.location, at(j + 1)) - arrival(j + 1);
+        carry(j + 1, n, shift, &m_runs);
+    }
+    for (const Run& run : m_runs)
+        shiftRange(1, 1, n, run.first, run.last, run.shift);
+}
+
+// Miles between the points of an order as the optimizer scores them: point 0
+// is the depot and point i + 1 is delivery i.  Crow distance, unless there are
+// hub labels to give road distances.  The annealer only asks about stops next
+// to each other in the orders it tries, a few per step however many stops
+// there are, so each pair is looked up the first time it's asked about
+// instead of the whole table up front.  Not for sharing between threads.
+class StopMiles
+{
+public:
+    StopMiles(const HubLabels* labels, const GeoCoord& depot, const vector<DeliveryRequest>& deliveries,
+        size_t maxTableStops);
+
+    double operator()(int a, int b) const {
+        if (m_table.empty())
+            return distanceEarthMiles(at(a), at(b));
+        double& miles = m_table[size_t(a) * m_numPoints + b];
+        if (std::isnan(miles))
+            miles = m_labels->distance(at(a), at(b));
+        return miles;
+    }
+
+private:
+    const GeoCoord& m_depot;
+    const vector<DeliveryRequest>& m_deliveries;
+    const HubLabels* m_labels;
+    size_t m_numPoints;
+    mutable vector<double> m_table;     // by a * m_numPoints + b; NaN until looked up
+
+    const GeoCoord& at(int point) const {
+        return point == 0 ? m_depot : m_deliveries[point - 1].location;
+    }
+};
+
+// A point the labels don't know, or can't reach another from, leaves the
+// whole order to crow distance rather than to a mix of the two.  Streets go
+// both ways, so a point that can be reached from the depot can be reached
+// from every other point that can, and only the depot's row is checked.
+StopMiles::StopMiles(const HubLabels* labels, const GeoCoord& depot, const vector<DeliveryRequest>& deliveries,
+    size_t maxTableStops)
+ : m_depot(depot), m_deliveries(deliveries), m_labels(labels), m_numPoints(deliveries.size() + 1)
+{
+    if (labels == nullptr || labels->empty() || !labels->current() || deliveries.size() > maxTableStops)
+        return;
+    m_table.assign(m_numPoints * m_numPoints, numeric_limits<double>::quiet_NaN());
+    for (size_t i = 0; i < m_numPoints; i++) {
+        double miles = labels->distance(depot, at(i));
+        if (miles < 0 || miles == numeric_limits<double>::infinity()) {
+            m_table.clear();
+            return;
+        }
+        m_table[i] = miles;
+    }
+}
+
 class DeliveryOptimizerImpl
 {
 public:
@@ -30,15 +472,44 @@ public:
         vector<DeliveryRequest>& deliveries,
         double& oldCrowDistance,
         double& newCrowDistance) const;
+    void optimizeDeliveryOrder(
+        const GeoCoord& depot,
+        vector<DeliveryRequest>& deliveries,
+        double departureTime,
+        double& oldCrowDistance,
+        double& newCrowDistance) const;
+    void setExactSolverLimit(int maxStops) { m_exactLimit = maxStops; }
+    void setHubLabels(const HubLabels* labels) { m_labels = labels; }
+    future<OrderResult> optimizeDeliveryOrderAsync(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries,
+        const CancellationToken& token) const;
 private:
-    vector<DeliveryRequest> getNeighbor(const vector<DeliveryRequest>& oldState) const;
+      // A state is an order of the deliveries: state[i] is the index of the
+      // i-th stop.
+    void getNeighbor(const ScratchVector<int>& oldState, ScratchVector<int>& newState) const;
 
-    double E(const GeoCoord& depot, const vector<DeliveryRequest>& state) const;
+    double E(const StopMiles& miles, const ScratchVector<int>& state) const;
     double P(double E1, double E2, double Temp) const;
 
     const int kMax = 100;
     const double TMin = 0.0001;
 
+      // speed assumed for crow distance when checking delivery windows
+    const double kCrowMph = 25;
+
+      // Routes with at most m_exactLimit stops are solved exactly.  The DP
+      // table takes 4 * n * 2^n bytes, so the limit is also capped by memory.
+    int m_exactLimit = 16;
+    const size_t kMaxExactBytes = size_t(64) << 20;
+    const int kMinParallelStops = 12;
+
+    bool heldKarp(const StopMiles& miles, vector<DeliveryRequest>& deliveries) const;
+
+      // Road distances to score by, if any, for orders of up to
+      // kMaxRoadTableStops deliveries.  The pairs looked up are kept in a
+      // table of 8 (n + 1)^2 bytes, 32 MB at this many.
+    const HubLabels* m_labels = nullptr;
+    const size_t kMaxRoadTableStops = 2000;
+
 };
 
 DeliveryOptimizerImpl::DeliveryOptimizerImpl(const StreetMap* sm)
@@ -62,17 +533,39 @@ void DeliveryOptimizerImpl::optimizeDeliveryOrder(
     }
     oldCrowDistance += distanceEarthMiles(deliveries.rbegin()->location, depot);
 
-    // Simulated Annealing!!
     vector<DeliveryRequest> state = deliveries;
-    vector<DeliveryRequest> newState;
-    double T = 1;
-    while (T >= TMin) {
-        for (double k = 0; k < kMax; k++) {
-            newState = getNeighbor(state);
-            if (P(E(depot, state), E(depot, newState), T) >= randDouble(0, 1))
-                state = newState;
+    StopMiles miles(m_labels, depot, deliveries, kMaxRoadTableStops);
+    if (!heldKarp(miles, state)) {
+        // Simulated Annealing!!  The states are orders of the deliveries kept
+        // in the scratch arena, so a step copies ints, not requests.  The
+        // best order seen is kept, which is what a cancelled run gives too.
+        ScratchScope scope;
+        ScratchVector<int> order(scratchAllocator<int>());
+        ScratchVector<int> newOrder(scratchAllocator<int>());
+        for (size_t i = 0; i < state.size(); i++)
+            order.push_back(i);
+        newOrder.reserve(order.size());
+        ScratchVector<int> best(order.begin(), order.end(), scratchAllocator<int>());
+        double bestEnergy = E(miles, order);
+        double T = 1;
+        while (T >= TMin && !CancellationScope::cancelled()) {
+            for (double k = 0; k < kMax; k++) {
+                getNeighbor(order, newOrder);
+                double newEnergy = E(miles, newOrder);
+                if (P(E(miles, order), newEnergy, T) >= randDouble(0, 1)) {
+                    order.swap(newOrder);
+                    if (newEnergy < bestEnergy) {
+                        bestEnergy = newEnergy;
+                        best.assign(order.begin(), order.end());
+                    }
+                }
+            }
+            T *= .9;
         }
-        T *= .9;
+        vector<DeliveryRequest> ordered;
+        for (int i : best)
+            ordered.push_back(state[i]);
+        state.swap(ordered);
     }
 
     deliveries = state;
@@ -88,13 +581,214 @@ void DeliveryOptimizerImpl::optimizeDeliveryOrder(
     return;
 }
 
-double DeliveryOptimizerImpl::E(const GeoCoord& depot, const vector<DeliveryRequest>& state) const {
+void DeliveryOptimizerImpl::optimizeDeliveryOrder(
+    const GeoCoord& depot,
+    vector<DeliveryRequest>& deliveries,
+    double departureTime,
+    double& oldCrowDistance,
+    double& newCrowDistance) const
+{
+    oldCrowDistance = newCrowDistance = 0;
+    int n = deliveries.size();
+    if (n == 0)
+        return;
+
+    // with no deadlines nothing can be late, and the order is just the
+    // shortest one
+    bool anyDeadline = false;
+    for (const DeliveryRequest& d : deliveries)
+        if (d.windowEnd != numeric_limits<double>::infinity())
+            anyDeadline = true;
+    if (!anyDeadline && n <= m_exactLimit) {
+        optimizeDeliveryOrder(depot, deliveries, oldCrowDistance, newCrowDistance);
+        return;
+    }
+
+    // Anneal over positions 1..n of an index tour; 0 and n+1 are the depot
+    // and hold no stop.
+    vector<int> order(n + 2, 0);
+    for (int p = 1; p <= n; p++)
+        order[p] = p - 1;
+
+    WindowedTour tour(depot, deliveries, departureTime, kCrowMph);
+    tour.setOrder(order);
+    oldCrowDistance = tour.distance();
+
+    // A swap is priced from the tour's slack without replaying it, and
+    // making one updates only the positions it moves.  The best tour seen is
+    // kept, as in the other annealer.
+    double energy = tour.distance() + DeliveryOptimizer::kLatenessPenalty * tour.lateness();
+    vector<int> best = tour.order();
+    double bestEnergy = energy;
+    double T = 1;
+    while (T >= TMin && !CancellationScope::cancelled()) {
+        for (double k = 0; k < kMax; k++) {
+            int i = randInt(1, n);
+            int j = randInt(1, n);
+            if (i == j)
+                continue;
+            if (i > j)
+                swap(i, j);
+
+            double newEnergy = energy + tour.swapDistanceDelta(i, j)
+                             + DeliveryOptimizer::kLatenessPenalty * tour.swapLatenessDelta(i, j);
+            if (P(energy, newEnergy, T) >= randDouble(0, 1)) {
+                tour.swap(i, j);
+                energy = tour.distance() + DeliveryOptimizer::kLatenessPenalty * tour.lateness();
+                if (energy < bestEnergy) {
+                    bestEnergy = energy;
+                    best = tour.order();
+                }
+            }
+        }
+        T *= .9;
+    }
+
+    // the distance kept up swap by swap has picked up some rounding
+    tour.setOrder(best);
+    newCrowDistance = tour.distance();
+
+    vector<DeliveryRequest> optimized;
+    for (int p = 1; p <= n; p++)
+        optimized.push_back(deliveries[tour.order()[p]]);
+    deliveries = optimized;
+}
+
+// Exact shortest tour by dynamic programming over subsets of stops.
+// best[mask * n + last] is the length of the shortest path that leaves the
+// depot, visits exactly the stops in mask and ends at last.  Each mask's row
+// of n entries is contiguous, and distances are stored so that all the
+// distances into one stop are contiguous too, so the inner loop reads two
+// straight runs of floats.  Masks with c stops depend only on masks with
+// c - 1, so each layer is split across the executor's workers.  The masks
+// are listed layer by layer up front, so a layer's workers go straight to
+// its masks instead of each skipping the rest.  Cancelled between layers,
+// it gives up and leaves the order to annealing, which stops at once too.
+bool DeliveryOptimizerImpl::heldKarp(const StopMiles& miles, vector<DeliveryRequest>& deliveries) const
+{
+    int n = deliveries.size();
+    if (n == 0 || n > m_exactLimit || n > 30)
+        return false;
+    size_t numMasks = size_t(1) << n;
+    if (numMasks * n * sizeof(float) > kMaxExactBytes)
+        return false;
+
+    const float kInfinity = numeric_limits<float>::infinity();
+
+    vector<float> into(n * n);     // into[k * n + j] = distance from j to k
+    vector<float> fromDepot(n), toDepot(n);
+    for (int k = 0; k < n; k++) {
+        fromDepot[k] = miles(0, k + 1);
+        toDepot[k] = miles(k + 1, 0);
+        for (int j = 0; j < n; j++)
+            into[k * n + j] = miles(j + 1, k + 1);
+    }
+
+    vector<float> best(numMasks * n, kInfinity);
+    for (int k = 0; k < n; k++)
+        best[(size_t(1) << k) * n + k] = fromDepot[k];
+
+    // each layer's masks in increasing order, by Gosper's hack: the next
+    // larger number with as many bits set
+    vector<unsigned int> masks;
+    vector<size_t> firstOfLayer(n + 2, 0);
+    masks.reserve(numMasks);
+    for (int layer = 0; layer <= n; layer++) {
+        firstOfLayer[layer] = masks.size();
+        for (size_t mask = (size_t(1) << layer) - 1; mask < numMasks; ) {
+            masks.push_back(static_cast<unsigned int>(mask));
+            if (mask == 0)
+                break;
+            size_t lowest = mask & (~mask + 1);
+            size_t ripple = mask + lowest;
+            mask = (((ripple ^ mask) >> 2) / lowest) | ripple;
+        }
+    }
+    firstOfLayer[n + 1] = masks.size();
+
+    auto fillMasks = [&](size_t first, size_t last) {
+        for (size_t m = first; m < last; m++) {
+            size_t mask = masks[m];
+            float* row = &best[mask * n];
+            for (int k = 0; k < n; k++) {
+                if (!(mask & (size_t(1) << k)))
+                    continue;
+                const float* prev = &best[(mask ^ (size_t(1) << k)) * n];
+                const float* dist = &into[k * n];
+                float shortest = kInfinity;
+                for (int j = 0; j < n; j++) {
+                    float length = prev[j] + dist[j];
+                    if (length < shortest)
+                        shortest = length;
+                }
+                row[k] = shortest;
+            }
+        }
+    };
+
+    Executor& executor = Executor::shared();
+    size_t numChunks = n >= kMinParallelStops ? executor.numWorkers() : 1;
+    for (int layer = 2; layer <= n; layer++) {
+        if (CancellationScope::cancelled())
+            return false;
+        size_t first = firstOfLayer[layer], last = firstOfLayer[layer + 1];
+        size_t chunk = (last - first + numChunks - 1) / numChunks;
+        executor.parallelFor(numChunks, [&](size_t t) {
+            fillMasks(min(last, first + t * chunk), min(last, first + (t + 1) * chunk));
+        });
+    }
+
+    // pick the best last stop, then walk back through the table, each time
+    // taking the stop the entry we're at was reached from
+    size_t mask = numMasks - 1;
+    int last = 0;
+    for (int k = 1; k < n; k++)
+        if (best[mask * n + k] + toDepot[k] < best[mask * n + last] + toDepot[last])
+            last = k;
+
+    vector<int> order(n);
+    for (int pos = n - 1; pos > 0; pos--) {
+        order[pos] = last;
+        size_t prevMask = mask ^ (size_t(1) << last);
+        const float* prev = &best[prevMask * n];
+        const float* dist = &into[last * n];
+        int from = -1;
+        for (int j = 0; j < n; j++)
+            if ((prevMask & (size_t(1) << j)) && (from < 0 || prev[j] + dist[j] < prev[from] + dist[from]))
+                from = j;
+        mask = prevMask;
+        last = from;
+    }
+    order[0] = last;
+
+    vector<DeliveryRequest> optimized;
+    for (int k : order)
+        optimized.push_back(deliveries[k]);
+    deliveries = optimized;
+    return true;
+}
+
+// The task optimizes with a copy of this optimizer, so it keeps the exact
+// solver limit and hub labels this one had when it was started.
+future<OrderResult> DeliveryOptimizerImpl::optimizeDeliveryOrderAsync(const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries, const CancellationToken& token) const
+{
+    DeliveryOptimizerImpl optimizer = *this;
+    return Executor::shared().async<OrderResult>(token, [optimizer, depot, deliveries](OrderResult& r) {
+        r.deliveries = deliveries;
+        if (!r.deliveries.empty())
+            optimizer.optimizeDeliveryOrder(depot, r.deliveries, r.oldCrowDistance, r.newCrowDistance);
+        r.result = CancellationScope::cancelled() ? CANCELLED : DELIVERY_SUCCESS;
+    });
+}
+
+double DeliveryOptimizerImpl::E(const StopMiles& miles, const ScratchVector<int>& state) const {
     double distance = 0;
-    distance += distanceEarthMiles(depot, state[0].location);
+    distance += miles(0, state[0] + 1);
     for (auto it = state.begin(); it != state.end() - 1; it++) {
-        distance += distanceEarthMiles(it->location, (it + 1)->location);
+        distance += miles(*it + 1, *(it + 1) + 1);
     }
-    distance += distanceEarthMiles(state.rbegin()->location, depot);
+    distance += miles(state.back() + 1, 0);
     return distance;
 }
 
@@ -104,8 +798,8 @@ double DeliveryOptimizerImpl::P(double E1, double E2, double Temp) const {
     return P;
 }
 
-vector<DeliveryRequest> DeliveryOptimizerImpl::getNeighbor(const vector<DeliveryRequest>& oldState) const {
-    vector<DeliveryRequest> newState = oldState;
+void DeliveryOptimizerImpl::getNeighbor(const ScratchVector<int>& oldState, ScratchVector<int>& newState) const {
+    newState = oldState;
 
     int indexA = randInt(0, oldState.size() - 1); // get the indexes of nodes to swap
     int indexB = randInt(0, oldState.size() - 1);
@@ -114,8 +808,6 @@ vector<DeliveryRequest> DeliveryOptimizerImpl::getNeighbor(const vector<Delivery
     auto itB = newState.begin() + indexB;
 
     std::iter_swap(itA, itB);
-
-    return newState;
 }
 
 //******************** DeliveryOptimizer functions ****************************
@@ -141,3 +833,31 @@ void DeliveryOptimizer::optimizeDeliveryOrder(
 {
     return m_impl->optimizeDeliveryOrder(depot, deliveries, oldCrowDistance, newCrowDistance);
 }
+
+void DeliveryOptimizer::optimizeDeliveryOrder(
+        const GeoCoord& depot,
+        vector<DeliveryRequest>& deliveries,
+        double departureTime,
+        double& oldCrowDistance,
+        double& newCrowDistance) const
+{
+    return m_impl->optimizeDeliveryOrder(depot, deliveries, departureTime, oldCrowDistance, newCrowDistance);
+}
+
+void DeliveryOptimizer::setExactSolverLimit(int maxStops)
+{
+    m_impl->setExactSolverLimit(maxStops);
+}
+
+void DeliveryOptimizer::setHubLabels(const HubLabels* labels)
+{
+    m_impl->setHubLabels(labels);
+}
+
+future<OrderResult> DeliveryOptimizer::optimizeDeliveryOrderAsync(
+        const GeoCoord& depot,
+        const vector<DeliveryRequest>& deliveries,
+        const CancellationToken& token) const
+{
+    return m_impl->optimizeDeliveryOrderAsync(depot, deliveries, token);
+}
@@ -1,5 +1,7 @@
 #include "provided.h"
+#include "Executor.h"
 #include <vector>
+#include <algorithm>
 using namespace std;
 
 class DeliveryPlannerImpl
@@ -12,10 +14,41 @@ public:
         const vector<DeliveryRequest>& deliveries,
         vector<DeliveryCommand>& commands,
         double& totalDistanceTravelled) const;
+    DeliveryResult generateDeliveryPlan(
+        const GeoCoord& depot,
+        const vector<DeliveryRequest>& deliveries,
+        double departureTime,
+        vector<DeliveryCommand>& commands,
+        double& totalDistanceTravelled,
+        vector<double>& arrivalTimes) const;
+
+      // appends the commands for following route to commands
+    void getCommands(const Route& route, vector<DeliveryCommand>& commands) const;
+
+    future<PlanResult> generateDeliveryPlanAsync(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries,
+        const CancellationToken& token) const;
 private:
     const StreetMap* m_sm;
 
-    void getCommands(list<StreetSegment> route, list<DeliveryCommand>& commands) const;
+      // clock is null when planning by distance alone.  Otherwise it holds the
+      // time the driver leaves, is advanced leg by leg, and the time each leg
+      // ends is appended to arrivalTimes.
+    DeliveryResult plan(
+        const GeoCoord& depot,
+        const vector<DeliveryRequest>& deliveries,
+        double* clock,
+        vector<DeliveryCommand>& commands,
+        double& totalDistanceTravelled,
+        vector<double>* arrivalTimes) const;
+
+    DeliveryResult routeLeg(const PointToPointRouter& router, const GeoCoord& from, const GeoCoord& to,
+        double* clock, Route& route, vector<double>* arrivalTimes) const;
+
+      // waits for the delivery's window to open, then spends its service time
+    void serve(const DeliveryRequest& delivery, double* clock) const {
+        if (clock != nullptr)
+            *clock = max(*clock, delivery.windowStart) + delivery.serviceTime;
+    }
 
     string getDirection(double angle) const {
         if (0 <= angle && angle < 22.5)
@@ -54,6 +87,30 @@ DeliveryResult DeliveryPlannerImpl::generateDeliveryPlan(
     const vector<DeliveryRequest>& deliveries,
     vector<DeliveryCommand>& commands,
     double& totalDistanceTravelled) const
+{
+    return plan(depot, deliveries, nullptr, commands, totalDistanceTravelled, nullptr);
+}
+
+DeliveryResult DeliveryPlannerImpl::generateDeliveryPlan(
+    const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries,
+    double departureTime,
+    vector<DeliveryCommand>& commands,
+    double& totalDistanceTravelled,
+    vector<double>& arrivalTimes) const
+{
+    arrivalTimes.clear();
+    double clock = departureTime;
+    return plan(depot, deliveries, &clock, commands, totalDistanceTravelled, &arrivalTimes);
+}
+
+DeliveryResult DeliveryPlannerImpl::plan(
+    const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries,
+    double* clock,
+    vector<DeliveryCommand>& commands,
+    double& totalDistanceTravelled,
+    vector<double>* arrivalTimes) const
 {
     totalDistanceTravelled = 0;
 
@@ -65,105 +122,134 @@ DeliveryResult DeliveryPlannerImpl::generateDeliveryPlan(
     DeliveryOptimizer optimizer(m_sm);
     double oldCrow, newCrow;
     vector<DeliveryRequest> optimizedDeliveries = deliveries;
-    optimizer.optimizeDeliveryOrder(depot, optimizedDeliveries, oldCrow, newCrow);
-
-    list<StreetSegment> route;
-    double totalDistance;
+    if (clock == nullptr)
+        optimizer.optimizeDeliveryOrder(depot, optimizedDeliveries, oldCrow, newCrow);
+    else
+        optimizer.optimizeDeliveryOrder(depot, optimizedDeliveries, *clock, oldCrow, newCrow);
+
+    // Leg i ends at stop i, or back at the depot for the last one.  By
+    // distance the legs don't depend on one another and are routed at once;
+    // by time each starts when the one before it ends.
+    size_t numLegs = optimizedDeliveries.size() + 1;
+    auto legFrom = [&](size_t i) -> const GeoCoord& {
+        return i == 0 ? depot : optimizedDeliveries[i - 1].location;
+    };
+    auto legTo = [&](size_t i) -> const GeoCoord& {
+        return i + 1 == numLegs ? depot : optimizedDeliveries[i].location;
+    };
+
+    vector<Route> legs(numLegs);
+    if (clock == nullptr) {
+        vector<DeliveryResult> results(numLegs);
+        Executor::shared().parallelFor(numLegs, [&](size_t i) {
+            results[i] = router.generatePointToPointRoute(legFrom(i), legTo(i), legs[i]);
+        });
+        for (DeliveryResult result : results)
+            if (result != DELIVERY_SUCCESS) return result;
+    }
+    else {
+        for (size_t i = 0; i < numLegs; i++) {
+            DeliveryResult result = routeLeg(router, legFrom(i), legTo(i), clock, legs[i], arrivalTimes);
+            if (result != DELIVERY_SUCCESS) return result;
+            if (i + 1 < numLegs)
+                serve(optimizedDeliveries[i], clock);
+        }
+    }
 
     DeliveryCommand deliverCommand;
+    for (size_t i = 0; i < numLegs; i++) {
+        getCommands(legs[i], commands);
+        if (i + 1 < numLegs) {
+            deliverCommand.initAsDeliverCommand(optimizedDeliveries[i].item);
+            commands.push_back(deliverCommand);
+        }
+        totalDistanceTravelled += legs[i].distance();
+    }
 
-    // get route from depot to first delivery
-    list<DeliveryCommand> output;
-
-    DeliveryResult result = 
-        router.generatePointToPointRoute(depot, optimizedDeliveries[0].location, route, totalDistance);
-    if (result != DELIVERY_SUCCESS) return result;
-
-    getCommands(route, output);
-    commands.insert(commands.end(), output.begin(), output.end());
-    deliverCommand.initAsDeliverCommand(optimizedDeliveries[0].item);
-    commands.push_back(deliverCommand);
-    totalDistanceTravelled += totalDistance;
-
-    for (auto from = optimizedDeliveries.begin(); from != optimizedDeliveries.end() - 1; from++) {
-        // get routes between optimizedDeliveries
-
-        auto to = from + 1;
-
-        result =
-            router.generatePointToPointRoute(from->location, to->location, route, totalDistance);
-        if (result != DELIVERY_SUCCESS) return result;
+    return DELIVERY_SUCCESS;
+}
 
-        getCommands(route, output);
-        commands.insert(commands.end(), output.begin(), output.end());
-        deliverCommand.initAsDeliverCommand(to->item);
-        commands.push_back(deliverCommand);
-        totalDistanceTravelled += totalDistance;
-    }
+// The task plans with a copy of this planner, which is only the map.
+future<PlanResult> DeliveryPlannerImpl::generateDeliveryPlanAsync(const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries, const CancellationToken& token) const
+{
+    DeliveryPlannerImpl planner = *this;
+    return Executor::shared().async<PlanResult>(token, [planner, depot, deliveries](PlanResult& r) {
+        r.result = planner.generateDeliveryPlan(depot, deliveries, r.commands, r.totalDistanceTravelled);
+    });
+}
 
-    // get route from last delivery to depot
+DeliveryResult DeliveryPlannerImpl::routeLeg(const PointToPointRouter& router, const GeoCoord& from, const GeoCoord& to,
+    double* clock, Route& route, vector<double>* arrivalTimes) const
+{
+    if (clock == nullptr)
+        return router.generatePointToPointRoute(from, to, route);
 
-    result = 
-        router.generatePointToPointRoute(optimizedDeliveries.rbegin()->location, depot, route, totalDistance);
+    double arrival;
+    DeliveryResult result = router.generatePointToPointRoute(from, to, *clock, route, arrival);
     if (result != DELIVERY_SUCCESS) return result;
 
-    getCommands(route, output);
-    commands.insert(commands.end(), output.begin(), output.end());
-    totalDistanceTravelled += totalDistance;
-
+    *clock = arrival;
+    arrivalTimes->push_back(arrival);
     return DELIVERY_SUCCESS;
 }
 
-void DeliveryPlannerImpl::getCommands(list<StreetSegment> route, list<DeliveryCommand>& commands) const {
-    commands.clear();
-    StreetSegment prevSeg;
+void DeliveryPlannerImpl::getCommands(const Route& route, vector<DeliveryCommand>& commands) const {
+    double prevAngle = 0;
+    string prevName;
 
-    for (auto it = route.begin(); it != route.end(); it++) {
+    // the route's stored lengths, angles and names; no segments are made
+    for (size_t i = 0; i < route.size(); i++) {
         DeliveryCommand command;
+        const string& name = route.streetName(i);
 
-        double angle = angleOfLine(*it);
+        double angle = route.angle(i);
         string dir = getDirection(angle);
 
-        double dist = distanceEarthMiles(it->start, it->end);
+        double dist = route.length(i);
 
         // For the first segment
-        if (it == route.begin()) {
-            command.initAsProceedCommand(dir, it->name, dist);
+        if (i == 0) {
+            command.initAsProceedCommand(dir, name, dist);
             commands.push_back(command);
-            prevSeg = *it;
+            prevAngle = angle;
+            prevName = name;
             continue;
         }
 
         // other segments
 
         // same street! keep proceeding
-        if (it->name == prevSeg.name) {
+        if (name == prevName) {
             commands.rbegin()->increaseDistance(dist);
-            prevSeg = *it;
+            prevAngle = angle;
             continue;
         }
 
         // we have a new street
 
-        double turnAngle = angleBetween2Lines(prevSeg, *it);
+        double turnAngle = angle - prevAngle;
+        if (turnAngle < 0)
+            turnAngle += 360;
 
         // street is a turn
 
         // left
         if (turnAngle < 180) {
-            command.initAsTurnCommand("left", it->name);
+            command.initAsTurnCommand("left", name);
         }
         else {
             // right
-            command.initAsTurnCommand("right", it->name);
+            command.initAsTurnCommand("right", name);
         }
         if (turnAngle > 1 && turnAngle < 359) commands.push_back(command);
 
         // if street is similar angle. Generate proceed with no turn.
 
-        command.initAsProceedCommand(dir, it->name, dist);
+        command.initAsProceedCommand(dir, name, dist);
         commands.push_back(command);
-        prevSeg = *it;
+        prevAngle = angle;
+        prevName = name;
     }
 
     return;
@@ -192,3 +278,27 @@ DeliveryResult DeliveryPlanner::generateDeliveryPlan(
 {
     return m_impl->generateDeliveryPlan(depot, deliveries, commands, totalDistanceTravelled);
 }
+
+DeliveryResult DeliveryPlanner::generateDeliveryPlan(
+    const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries,
+    double departureTime,
+    vector<DeliveryCommand>& commands,
+    double& totalDistanceTravelled,
+    vector<double>& arrivalTimes) const
+{
+    return m_impl->generateDeliveryPlan(depot, deliveries, departureTime, commands, totalDistanceTravelled, arrivalTimes);
+}
+
+void DeliveryPlanner::getCommands(const Route& route, vector<DeliveryCommand>& commands) const
+{
+    m_impl->getCommands(route, commands);
+}
+
+future<PlanResult> DeliveryPlanner::generateDeliveryPlanAsync(
+    const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries,
+    const CancellationToken& token) const
+{
+    return m_impl->generateDeliveryPlanAsync(depot, deliveries, token);
+}
@@ -0,0 +1,279 @@
+// Executor.h
+
+// The thread pool that planning runs on.  Work handed to it from outside
+// (the Async entry points) and the parallel loops inside a plan (legs routed
+// at once, the exact solver's layers, a fleet's vehicles) share one set of
+// workers, instead of each starting threads of its own.
+//
+// Each worker keeps its own queue.  It takes the newest task from its own and,
+// when that is empty, steals the oldest from another's, so a worker that
+// splits its work keeps the pieces nearby and the idle ones take the rest.
+//
+// A parallel loop is run by whoever calls it as well as by the workers it
+// asks to help, and the caller goes on taking items until none are left.
+// So a loop inside a loop never waits on a queue, only on items that some
+// thread is already running.
+//
+// Cancellation is cooperative.  A task run for a CancellationToken installs
+// it for its thread with a CancellationScope, parallel loops pass it on to
+// their helpers, and long loops poll CancellationScope::cancelled() and give
+// up early.
+
+#ifndef EXECUTOR_INCLUDED
+#define EXECUTOR_INCLUDED
+
+#include "provided.h"
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <exception>
+
+  // Makes token the one that work on this thread checks, until it ends.
+class CancellationScope
+{
+public:
+    explicit CancellationScope(const CancellationToken* token)
+     : m_outer(s_current)
+    {
+        s_current = token;
+    }
+
+    ~CancellationScope() { s_current = m_outer; }
+
+    static const CancellationToken* current() { return s_current; }
+
+    static bool cancelled() { return s_current != nullptr && s_current->cancelled(); }
+
+    CancellationScope(const CancellationScope&) = delete;
+    CancellationScope& operator=(const CancellationScope&) = delete;
+
+private:
+    const CancellationToken* m_outer;
+    static inline thread_local const CancellationToken* s_current = nullptr;
+};
+
+class Executor
+{
+public:
+    explicit Executor(unsigned numWorkers)
+    {
+        if (numWorkers == 0)
+            numWorkers = 1;
+        for (unsigned i = 0; i < numWorkers; i++)
+            m_queues.emplace_back(new Queue);
+        for (unsigned i = 0; i < numWorkers; i++)
+            m_threads.emplace_back(&Executor::work, this, i);
+    }
+
+      // finishes what is queued, then stops the workers
+    ~Executor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepLock);
+            m_stopping = true;
+        }
+        m_wake.notify_all();
+        for (std::thread& t : m_threads)
+            t.join();
+    }
+
+      // One worker per core, started the first time it's asked for.  It is
+      // never destroyed, so a program can exit with work still running.
+    static Executor& shared()
+    {
+        static Executor* executor = new Executor(std::thread::hardware_concurrency());
+        return *executor;
+    }
+
+    unsigned numWorkers() const { return m_queues.size(); }
+
+      // Queues task: on the calling worker's own queue, or spread over the
+      // queues from any other thread.
+    void submit(std::function<void()> task)
+    {
+        size_t q = s_self.executor == this ? s_self.index : m_nextQueue++ % m_queues.size();
+        {
+            std::lock_guard<std::mutex> lock(m_sleepLock);
+            m_queued++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_queues[q]->lock);
+            m_queues[q]->tasks.push_back(std::move(task));
+        }
+        m_wake.notify_one();
+    }
+
+      // body(i) for every i in [0, n), on the calling thread and as many
+      // workers as are free to help, returning when all are done.  The
+      // calling thread's CancellationToken goes along to the helpers.  If
+      // any body throws, the rest still run and the first exception caught
+      // is thrown again on the calling thread.
+    template <typename Body>
+    void parallelFor(size_t n, const Body& body)
+    {
+        if (n == 0)
+            return;
+        if (n == 1) {
+            body(0);
+            return;
+        }
+
+        // A helper can start after the loop is over, so what it shares with
+        // the caller is kept alive by the helper itself.  It finds nothing
+        // left to do then and touches neither body nor the token.
+        struct Loop {
+            std::function<void(size_t)> body;
+            const CancellationToken* token;
+            size_t n;
+            std::atomic<size_t> next{ 0 };
+            size_t done = 0;
+            std::exception_ptr error;       // guarded by lock
+            std::mutex lock;
+            std::condition_variable finished;
+
+            void run() {
+                size_t ran = 0;
+                for (size_t i = next++; i < n; i = next++) {
+                    try {
+                        body(i);
+                    }
+                    catch (...) {
+                        std::lock_guard<std::mutex> guard(lock);
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                    ran++;
+                }
+                if (ran > 0) {
+                    std::lock_guard<std::mutex> guard(lock);
+                    done += ran;
+                    if (done == n)
+                        finished.notify_all();
+                }
+            }
+        };
+        std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+        loop->body = std::cref(body);
+        loop->token = CancellationScope::current();
+        loop->n = n;
+
+        size_t helpers = std::min<size_t>(numWorkers(), n) - 1;
+        for (size_t h = 0; h < helpers; h++) {
+            submit([loop]() {
+                CancellationScope scope(loop->token);
+                loop->run();
+            });
+        }
+        loop->run();
+
+        std::unique_lock<std::mutex> guard(loop->lock);
+        loop->finished.wait(guard, [&loop]() { return loop->done == loop->n; });
+        if (loop->error)
+            std::rethrow_exception(loop->error);
+    }
+
+      // Runs work(result) on a worker with token installed, and gives what it
+      // leaves in result through the future.  Result has a DeliveryResult
+      // member, result.  Work that was cancelled before it started isn't run;
+      // work that fails once it's cancelled reports CANCELLED instead.  An
+      // exception work throws is thrown again by the future's get.
+    template <typename Result, typename Work>
+    std::future<Result> async(const CancellationToken& token, Work work)
+    {
+        std::shared_ptr<std::promise<Result>> promise = std::make_shared<std::promise<Result>>();
+        std::future<Result> future = promise->get_future();
+        submit([token, work, promise]() {
+            Result result;
+            if (!token.cancelled()) {
+                CancellationScope scope(&token);
+                try {
+                    work(result);
+                }
+                catch (...) {
+                    promise->set_exception(std::current_exception());
+                    return;
+                }
+            }
+            if (token.cancelled() && result.result != DELIVERY_SUCCESS)
+                result.result = CANCELLED;
+            promise->set_value(std::move(result));
+        });
+        return future;
+    }
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_nextQueue{ 0 };
+
+    std::mutex m_sleepLock;
+    std::condition_variable m_wake;
+      // tasks in all the queues, counted before they go in, so never fewer;
+      // guarded by m_sleepLock
+    size_t m_queued = 0;
+    bool m_stopping = false;
+
+      // which worker of which executor the calling thread is, if any
+    struct Self {
+        Executor* executor;
+        size_t index;
+    };
+    static inline thread_local Self s_self = { nullptr, 0 };
+
+      // the newest task on worker self's queue, else the oldest on another's
+    bool take(size_t self, std::function<void()>& task)
+    {
+        size_t numQueues = m_queues.size();
+        for (size_t k = 0; k < numQueues; k++) {
+            Queue& q = *m_queues[(self + k) % numQueues];
+            std::lock_guard<std::mutex> lock(q.lock);
+            if (q.tasks.empty())
+                continue;
+            if (k == 0) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+            else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            std::lock_guard<std::mutex> sleep(m_sleepLock);
+            m_queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(size_t self)
+    {
+        s_self = Self{ this, self };
+        for (;;) {
+            std::function<void()> task;
+            if (take(self, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleepLock);
+            m_wake.wait(lock, [this]() { return m_stopping || m_queued > 0; });
+            if (m_stopping && m_queued == 0)
+                return;
+        }
+    }
+};
+
+#endif // EXECUTOR_INCLUDED
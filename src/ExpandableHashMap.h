@@ -3,9 +3,11 @@
 // Skeleton for the ExpandableHashMap class template.  You must implement the first six
 // member functions.
 
-#include <list>
+#ifndef EXPANDABLEHASHMAP_INCLUDED
+#define EXPANDABLEHASHMAP_INCLUDED
+
 #include <string>
-#include <iostream>
+#include "Arena.h"
 
 template<typename KeyType, typename ValueType>
 class ExpandableHashMap
@@ -39,12 +41,17 @@ private:
     struct KV {
         KeyType key;
         ValueType value;
+        KV* next;       // in the same bucket
     };
 
-    std::list<KV>* m_map;
+      // The items live in m_items and are never freed one at a time; rehashing
+      // only relinks them, and they all go at once on reset or destruction.
+    KV** m_map;
+    Arena m_items;
 
     unsigned int getBucket(const KeyType& key) const;
     void reallocate();
+    void destroyItems();
 };
 
 template <typename KeyType, typename ValueType>
@@ -55,22 +62,25 @@ ExpandableHashMap<KeyType, ValueType>::ExpandableHashMap(double maximumLoadFacto
 
     m_maxLoad = maximumLoadFactor;
 
-    m_map = new std::list<KV>[m_numBuckets];
+    m_map = new KV*[m_numBuckets]();
 }
 
 template <typename KeyType, typename ValueType>
 ExpandableHashMap<KeyType, ValueType>::~ExpandableHashMap()
 {
+    destroyItems();
     delete[] m_map;
 }
 
 template <typename KeyType, typename ValueType>
 void ExpandableHashMap<KeyType, ValueType>::reset()
 {
+    destroyItems();
+    m_items.release();
     delete[] m_map;
     m_numBuckets = 8;
     m_numItems = 0;
-    m_map = new std::list<KV>[m_numBuckets];
+    m_map = new KV*[m_numBuckets]();
 }
 
 template <typename KeyType, typename ValueType>
@@ -89,12 +99,8 @@ void ExpandableHashMap<KeyType, ValueType>::associate(const KeyType& key, const
         return;
     }
 
-    KV kv;
-    kv.key = key;
-    kv.value = value;
-
     unsigned int bucketNum = getBucket(key);
-    m_map[bucketNum].push_back(kv);
+    m_map[bucketNum] = m_items.make<KV>(KV{ key, value, m_map[bucketNum] });
 
     m_numItems++;
 
@@ -107,9 +113,9 @@ template <typename KeyType, typename ValueType>
 const ValueType* ExpandableHashMap<KeyType, ValueType>::find(const KeyType& key) const
 {
     unsigned int bucketNum = getBucket(key);
-    for (auto it = m_map[bucketNum].begin(); it != m_map[bucketNum].end(); it++) {
-        if ((*it).key == key)
-            return &it->value;
+    for (const KV* kv = m_map[bucketNum]; kv != nullptr; kv = kv->next) {
+        if (kv->key == key)
+            return &kv->value;
     }
 
     return nullptr;
@@ -124,20 +130,34 @@ unsigned int ExpandableHashMap<KeyType, ValueType>::getBucket(const KeyType& key
 
 template <typename KeyType, typename ValueType>
 void ExpandableHashMap<KeyType, ValueType>::reallocate() {
-    std::cerr << "Reallocating!" << std::endl;
     int oldNumBuckets = m_numBuckets;
     m_numBuckets *= 2;
-    std::list<KV>* newMap = new std::list<KV>[m_numBuckets * 2];
+    KV** newMap = new KV*[m_numBuckets]();
 
     for (int i = 0; i < oldNumBuckets; i++) {
-        while(m_map[i].size() > 0) {
-            auto it = m_map[i].begin();
-            unsigned int newBucketNumber = getBucket(it->key);
-            newMap[newBucketNumber].splice(newMap[newBucketNumber].begin(), m_map[i], it);
+        while (m_map[i] != nullptr) {
+            KV* kv = m_map[i];
+            m_map[i] = kv->next;
+            unsigned int newBucketNumber = getBucket(kv->key);
+            kv->next = newMap[newBucketNumber];
+            newMap[newBucketNumber] = kv;
         }
     }
 
     delete[] m_map;
 
     m_map = newMap;
-}
\ No newline at end of file
+}
+
+template <typename KeyType, typename ValueType>
+void ExpandableHashMap<KeyType, ValueType>::destroyItems() {
+    for (int i = 0; i < m_numBuckets; i++) {
+        for (KV* kv = m_map[i]; kv != nullptr; ) {
+            KV* next = kv->next;
+            kv->~KV();
+            kv = next;
+        }
+    }
+}
+
+#endif // EXPANDABLEHASHMAP_INCLUDED
@@ -0,0 +1,327 @@
+#include "provided.h"
+#include "Executor.h"
+#include <vector>
+#include <algorithm>
+#include <numeric>
+using namespace std;
+
+class FleetPlannerImpl
+{
+public:
+    FleetPlannerImpl(const StreetMap* sm);
+    ~FleetPlannerImpl();
+    DeliveryResult generateFleetPlan(
+        const GeoCoord& depot,
+        const vector<Vehicle>& vehicles,
+        const vector<DeliveryRequest>& deliveries,
+        vector<vector<DeliveryCommand>>& commands,
+        vector<double>& distances,
+        double& totalDistanceTravelled) const;
+private:
+    const StreetMap* m_sm;
+
+    // Stops are numbered 1..n in the order of the deliveries; 0 is the depot.
+    // Each route is the list of stops one vehicle visits, in order, and
+    // every distance is crow distance until the routes are handed to the
+    // DeliveryPlanner.
+    typedef vector<int> Route;
+
+    bool sweep(const GeoCoord& depot, const vector<Vehicle>& vehicles,
+        const vector<DeliveryRequest>& deliveries, vector<Route>& routes) const;
+    bool firstFitDecreasing(const vector<Vehicle>& vehicles,
+        const vector<DeliveryRequest>& deliveries, vector<Route>& routes) const;
+    void improve(const vector<Vehicle>& vehicles, const vector<DeliveryRequest>& deliveries,
+        const vector<vector<double>>& dist, vector<Route>& routes) const;
+
+    bool relocate(const vector<Vehicle>& vehicles, const vector<double>& quantity,
+        const vector<vector<double>>& dist, vector<Route>& routes, vector<double>& loads) const;
+    bool exchange(const vector<Vehicle>& vehicles, const vector<double>& quantity,
+        const vector<vector<double>>& dist, vector<Route>& routes, vector<double>& loads) const;
+
+    const int kMaxImprovementPasses = 1000;
+};
+
+FleetPlannerImpl::FleetPlannerImpl(const StreetMap* sm)
+{
+    m_sm = sm;
+}
+
+FleetPlannerImpl::~FleetPlannerImpl()
+{
+}
+
+DeliveryResult FleetPlannerImpl::generateFleetPlan(
+    const GeoCoord& depot,
+    const vector<Vehicle>& vehicles,
+    const vector<DeliveryRequest>& deliveries,
+    vector<vector<DeliveryCommand>>& commands,
+    vector<double>& distances,
+    double& totalDistanceTravelled) const
+{
+    totalDistanceTravelled = 0;
+    commands.assign(vehicles.size(), vector<DeliveryCommand>());
+    distances.assign(vehicles.size(), 0);
+
+    if (deliveries.empty())
+        return DELIVERY_SUCCESS;
+
+    // Split the stops among the vehicles.  Sweeping around the depot keeps
+    // each vehicle's stops together; if the sweep can't fit everything in,
+    // pack by size alone.
+    vector<Route> routes;
+    if (!sweep(depot, vehicles, deliveries, routes) &&
+        !firstFitDecreasing(vehicles, deliveries, routes))
+        return OVER_CAPACITY;
+
+    vector<GeoCoord> stops(1, depot);
+    for (const DeliveryRequest& d : deliveries)
+        stops.push_back(d.location);
+
+    vector<vector<double>> dist(stops.size(), vector<double>(stops.size()));
+    for (size_t i = 0; i < stops.size(); i++)
+        for (size_t j = 0; j < stops.size(); j++)
+            dist[i][j] = distanceEarthMiles(stops[i], stops[j]);
+
+    improve(vehicles, deliveries, dist, routes);
+
+    // Plan the vehicles' routes at once on the executor.  Each plan still
+    // runs the DeliveryOptimizer, so the order within a route is settled there.
+    vector<DeliveryResult> results(vehicles.size(), DELIVERY_SUCCESS);
+    DeliveryPlanner planner(m_sm);
+    Executor::shared().parallelFor(vehicles.size(), [&](size_t v) {
+        if (routes[v].empty())
+            return;
+        vector<DeliveryRequest> assigned;
+        for (int stop : routes[v])
+            assigned.push_back(deliveries[stop - 1]);
+        results[v] = planner.generateDeliveryPlan(depot, assigned, commands[v], distances[v]);
+    });
+
+    for (size_t v = 0; v < vehicles.size(); v++) {
+        if (results[v] != DELIVERY_SUCCESS)
+            return results[v];
+        totalDistanceTravelled += distances[v];
+    }
+
+    return DELIVERY_SUCCESS;
+}
+
+bool FleetPlannerImpl::sweep(const GeoCoord& depot, const vector<Vehicle>& vehicles,
+    const vector<DeliveryRequest>& deliveries, vector<Route>& routes) const
+{
+    int n = deliveries.size();
+
+    vector<double> angle(n + 1);
+    vector<int> order(n);
+    for (int i = 1; i <= n; i++) {
+        order[i - 1] = i;
+        angle[i] = atan2(deliveries[i - 1].location.latitude - depot.latitude,
+            deliveries[i - 1].location.longitude - depot.longitude);
+    }
+    sort(order.begin(), order.end(), [&angle](int a, int b) { return angle[a] < angle[b]; });
+
+    // start the sweep just after the widest empty wedge, so no cluster of
+    // stops gets split across the start and the end
+    int begin = 0;
+    double widestGap = -1;
+    for (int k = 0; k < n; k++) {
+        double gap = angle[order[k]] - angle[order[(k + n - 1) % n]];
+        if (gap <= 0)
+            gap += 2 * 3.14159265358979323846;
+        if (gap > widestGap) {
+            widestGap = gap;
+            begin = k;
+        }
+    }
+    rotate(order.begin(), order.begin() + begin, order.end());
+
+    routes.assign(vehicles.size(), Route());
+    size_t v = 0;
+    double load = 0;
+    for (int stop : order) {
+        double q = deliveries[stop - 1].quantity;
+        while (v < vehicles.size() && load + q > vehicles[v].capacity) {
+            v++;
+            load = 0;
+        }
+        if (v == vehicles.size())
+            return false;
+        routes[v].push_back(stop);
+        load += q;
+    }
+
+    return true;
+}
+
+bool FleetPlannerImpl::firstFitDecreasing(const vector<Vehicle>& vehicles,
+    const vector<DeliveryRequest>& deliveries, vector<Route>& routes) const
+{
+    int n = deliveries.size();
+
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 1);
+    sort(order.begin(), order.end(), [&deliveries](int a, int b) {
+        return deliveries[a - 1].quantity > deliveries[b - 1].quantity;
+    });
+
+    routes.assign(vehicles.size(), Route());
+    vector<double> room(vehicles.size());
+    for (size_t v = 0; v < vehicles.size(); v++)
+        room[v] = vehicles[v].capacity;
+
+    for (int stop : order) {
+        double q = deliveries[stop - 1].quantity;
+        size_t v = 0;
+        while (v < vehicles.size() && room[v] < q)
+            v++;
+        if (v == vehicles.size())
+            return false;
+        routes[v].push_back(stop);
+        room[v] -= q;
+    }
+
+    return true;
+}
+
+void FleetPlannerImpl::improve(const vector<Vehicle>& vehicles, const vector<DeliveryRequest>& deliveries,
+    const vector<vector<double>>& dist, vector<Route>& routes) const
+{
+    vector<double> quantity(deliveries.size() + 1, 0);
+    for (size_t i = 0; i < deliveries.size(); i++)
+        quantity[i + 1] = deliveries[i].quantity;
+
+    vector<double> loads(routes.size(), 0);
+    for (size_t v = 0; v < routes.size(); v++)
+        for (int stop : routes[v])
+            loads[v] += quantity[stop];
+
+    for (int pass = 0; pass < kMaxImprovementPasses; pass++) {
+        if (!relocate(vehicles, quantity, dist, routes, loads) &&
+            !exchange(vehicles, quantity, dist, routes, loads))
+            break;
+    }
+}
+
+// Moves the one stop whose move to another route saves the most distance,
+// putting it at the cheapest place in that route.  Returns false if no such
+// move saves anything.
+bool FleetPlannerImpl::relocate(const vector<Vehicle>& vehicles, const vector<double>& quantity,
+    const vector<vector<double>>& dist, vector<Route>& routes, vector<double>& loads) const
+{
+    const double kEpsilon = 1e-9;
+    double bestDelta = -kEpsilon;
+    int bestFrom = -1, bestPos = -1, bestTo = -1, bestInsert = -1;
+
+    for (size_t a = 0; a < routes.size(); a++) {
+        const Route& from = routes[a];
+        for (size_t p = 0; p < from.size(); p++) {
+            int stop = from[p];
+            int prev = p == 0 ? 0 : from[p - 1];
+            int next = p + 1 == from.size() ? 0 : from[p + 1];
+            double removeGain = dist[prev][stop] + dist[stop][next] - dist[prev][next];
+
+            for (size_t b = 0; b < routes.size(); b++) {
+                if (b == a || loads[b] + quantity[stop] > vehicles[b].capacity)
+                    continue;
+                const Route& to = routes[b];
+                for (size_t q = 0; q <= to.size(); q++) {
+                    int before = q == 0 ? 0 : to[q - 1];
+                    int after = q == to.size() ? 0 : to[q];
+                    double insertCost = dist[before][stop] + dist[stop][after] - dist[before][after];
+                    double delta = insertCost - removeGain;
+                    if (delta < bestDelta) {
+                        bestDelta = delta;
+                        bestFrom = a;
+                        bestPos = p;
+                        bestTo = b;
+                        bestInsert = q;
+                    }
+                }
+            }
+        }
+    }
+
+    if (bestFrom < 0)
+        return false;
+
+    int stop = routes[bestFrom][bestPos];
+    routes[bestFrom].erase(routes[bestFrom].begin() + bestPos);
+    routes[bestTo].insert(routes[bestTo].begin() + bestInsert, stop);
+    loads[bestFrom] -= quantity[stop];
+    loads[bestTo] += quantity[stop];
+    return true;
+}
+
+// Swaps the pair of stops on different routes, each taking the other's place,
+// that saves the most distance.  Returns false if no swap saves anything.
+bool FleetPlannerImpl::exchange(const vector<Vehicle>& vehicles, const vector<double>& quantity,
+    const vector<vector<double>>& dist, vector<Route>& routes, vector<double>& loads) const
+{
+    const double kEpsilon = 1e-9;
+    double bestDelta = -kEpsilon;
+    int bestA = -1, bestP = -1, bestB = -1, bestQ = -1;
+
+    // change in a route's length when the stop at position p is replaced
+    auto replaceCost = [&dist](const Route& r, size_t p, int replacement) {
+        int prev = p == 0 ? 0 : r[p - 1];
+        int next = p + 1 == r.size() ? 0 : r[p + 1];
+        return dist[prev][replacement] + dist[replacement][next] - dist[prev][r[p]] - dist[r[p]][next];
+    };
+
+    for (size_t a = 0; a < routes.size(); a++) {
+        for (size_t b = a + 1; b < routes.size(); b++) {
+            for (size_t p = 0; p < routes[a].size(); p++) {
+                int i = routes[a][p];
+                for (size_t q = 0; q < routes[b].size(); q++) {
+                    int j = routes[b][q];
+                    if (loads[a] - quantity[i] + quantity[j] > vehicles[a].capacity ||
+                        loads[b] - quantity[j] + quantity[i] > vehicles[b].capacity)
+                        continue;
+                    double delta = replaceCost(routes[a], p, j) + replaceCost(routes[b], q, i);
+                    if (delta < bestDelta) {
+                        bestDelta = delta;
+                        bestA = a;
+                        bestP = p;
+                        bestB = b;
+                        bestQ = q;
+                    }
+                }
+            }
+        }
+    }
+
+    if (bestA < 0)
+        return false;
+
+    int i = routes[bestA][bestP];
+    int j = routes[bestB][bestQ];
+    swap(routes[bestA][bestP], routes[bestB][bestQ]);
+    loads[bestA] += quantity[j] - quantity[i];
+    loads[bestB] += quantity[i] - quantity[j];
+    return true;
+}
+
+//******************** FleetPlanner functions *********************************
+
+// These functions simply delegate to FleetPlannerImpl's functions.
+
+FleetPlanner::FleetPlanner(const StreetMap* sm)
+{
+    m_impl = new FleetPlannerImpl(sm);
+}
+
+FleetPlanner::~FleetPlanner()
+{
+    delete m_impl;
+}
+
+DeliveryResult FleetPlanner::generateFleetPlan(
+    const GeoCoord& depot,
+    const vector<Vehicle>& vehicles,
+    const vector<DeliveryRequest>& deliveries,
+    vector<vector<DeliveryCommand>>& commands,
+    vector<double>& distances,
+    double& totalDistanceTravelled) const
+{
+    return m_impl->generateFleetPlan(depot, vehicles, deliveries, commands, distances, totalDistanceTravelled);
+}
@@ -0,0 +1,562 @@
+#include "provided.h"
+#include "StreetGraph.h"
+#include "Executor.h"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <queue>
+#include <random>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <limits>
+using namespace std;
+
+// Pruned landmark labeling over the junctions.  The junctions are ranked by
+// how important they look, then searched from in that order, the most
+// important first.  The search from a junction leaves it as a hub in the
+// label of each junction it reaches, except that it goes no further from a
+// junction whose distance the labels made so far already give.  The first
+// searches cover most of the map and the later ones die out almost at once.
+//
+// An interior node's distances go through the junctions at the ends of its
+// chain, or straight along the chain to another node on it.
+class HubLabelsImpl
+{
+public:
+    HubLabelsImpl(const StreetMap* sm);
+    ~HubLabelsImpl();
+    bool build();
+    bool save(string file) const;
+    bool load(string file);
+    bool empty() const { return m_graph == nullptr; }
+    bool current() const;
+    double distance(const GeoCoord& start, const GeoCoord& end) const;
+    void distanceTable(const vector<GeoCoord>& points, vector<vector<double>>& miles) const;
+    size_t labelEntries() const { return m_hubs.size(); }
+private:
+    const StreetMap* m_sm;
+    shared_ptr<const StreetGraph> m_graph;  // what the labels were built from
+
+      // Labels, by junction index (the junctions numbered in node order).
+      // Junction j's hubs, by rank, are m_hubs[m_firstHub[j] ..
+      // m_firstHub[j+1]-1], in increasing order.
+    vector<size_t> m_firstHub;
+    vector<int> m_hubs;
+    vector<float> m_hubMiles;
+
+      // Every node's way onto the junctions: the junctions at either end of
+      // its chain and how far they are, at 2n and 2n+1.  A junction is its
+      // own first end and has no second (-1).
+    vector<int> m_end;
+    vector<float> m_endMiles;
+      // for an interior node, one of the two chains it's on (the lower
+      // numbered) and how far along it it is; -1 for a junction
+    vector<int> m_chain;
+    vector<float> m_along;
+
+      // a chain in the junction graph the labels are built over
+    struct Hop {
+        int junction;
+        double miles;
+    };
+
+      // shortest-path trees the junctions are ranked by
+    static constexpr int kSampleTrees = 32;
+      // searches in a batch at most this fraction of those already done
+    static constexpr int kBatchDivisor = 16;
+      // stored distances are in these units
+    static constexpr double kUnitsPerMile = 65536;
+    static constexpr unsigned int kFormatVersion = 1;
+
+    static unsigned long long signature(const StreetGraph& g);
+
+      // Finds every node's chain ends.  Returns the junction count, and the
+      // junction graph: junction j's chains are next[firstNext[j] ..
+      // firstNext[j+1]-1].
+    int measure(const StreetGraph& g, vector<size_t>& firstNext, vector<Hop>& next);
+
+      // miles between junctions a and b by merging their labels
+    double hubMiles(int a, int b) const;
+
+      // miles between nodes u and v
+    double nodeMiles(int u, int v) const;
+};
+
+HubLabelsImpl::HubLabelsImpl(const StreetMap* sm)
+ : m_sm(sm)
+{
+}
+
+HubLabelsImpl::~HubLabelsImpl()
+{
+}
+
+// FNV-1a over the node positions and edges, in id order, so labels are only
+// loaded for the same map loaded the same way.
+unsigned long long HubLabelsImpl::signature(const StreetGraph& g)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    auto mix = [&hash](const void* data, size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; i++) {
+            hash ^= p[i];
+            hash *= 1099511628211ull;
+        }
+    };
+    int counts[2] = { g.numNodes(), g.numEdges() };
+    mix(counts, sizeof(counts));
+    for (const GeoCoord& gc : g.coords) {
+        mix(&gc.latitude, sizeof(double));
+        mix(&gc.longitude, sizeof(double));
+    }
+    mix(g.edgeSource.data(), g.edgeSource.size() * sizeof(int));
+    mix(g.edgeTarget.data(), g.edgeTarget.size() * sizeof(int));
+    return hash;
+}
+
+// Chains are walked edge by edge with the edges' own lengths, which are there
+// whether or not the map is compressed.
+int HubLabelsImpl::measure(const StreetGraph& g, vector<size_t>& firstNext, vector<Hop>& next)
+{
+    int n = g.numNodes();
+    vector<int> junctionIndex(n, -1);
+    int numJunctions = 0;
+    for (int u = 0; u < n; u++)
+        if (g.junction[u])
+            junctionIndex[u] = numJunctions++;
+
+    m_end.assign(2 * size_t(n), -1);
+    m_endMiles.assign(2 * size_t(n), 0);
+    m_chain.assign(n, -1);
+    m_along.assign(n, 0);
+    firstNext.assign(numJunctions + 1, 0);
+    next.clear();
+
+    for (int u = 0; u < n; u++) {
+        int j = junctionIndex[u];
+        if (j < 0)
+            continue;
+        m_end[2 * size_t(u)] = j;
+        firstNext[j] = next.size();
+        for (int e = g.firstEdge[u]; e != g.firstEdge[u + 1]; e++) {
+            int c = g.edgeChain[e];
+            int size = g.chainSize(c);
+            double miles = 0;
+            for (int pos = 0; pos < size; pos++) {
+                int f = g.chainEdge(c, pos);
+                miles += g.length(f);
+                if (pos == size - 1) {
+                    int target = junctionIndex[g.edgeTarget[f]];
+                    if (target != j)
+                        next.push_back(Hop{ target, miles });
+                    break;
+                }
+                // the first chain to reach an interior node fills its first
+                // end, and the same chain the other way its second
+                size_t v = g.edgeTarget[f];
+                size_t slot = m_end[2 * v] < 0 ? 2 * v : 2 * v + 1;
+                m_end[slot] = j;
+                m_endMiles[slot] = miles;
+                if (m_chain[v] < 0 || c < m_chain[v]) {
+                    m_chain[v] = c;
+                    m_along[v] = miles;
+                }
+            }
+        }
+    }
+    firstNext[numJunctions] = next.size();
+    return numJunctions;
+}
+
+bool HubLabelsImpl::build()
+{
+    shared_ptr<const GraphSnapshot> snapshot = m_sm->snapshot();
+    if (snapshot == nullptr || snapshot->graph == nullptr || snapshot->tileDegrees > 0 ||
+        snapshot->graph->numNodes() == 0)
+        return false;
+    const StreetGraph& g = *snapshot->graph;
+
+    vector<size_t> firstNext;
+    vector<Hop> next;
+    int numJunctions = measure(g, firstNext, next);
+    Executor& executor = Executor::shared();
+    const double kInfinity = numeric_limits<double>::infinity();
+
+    typedef pair<double, int> Entry;
+    typedef priority_queue<Entry, vector<Entry>, greater<Entry>> Queue;
+
+    // Rank by how many nodes lie beyond each junction in shortest-path trees
+    // from a sample of roots: a junction many shortest routes go through is
+    // a hub for all of them.  Ties go to the junction with more chains.
+    vector<double> weight(numJunctions, 0);
+    mutex weightLock;
+    executor.parallelFor(min(kSampleTrees, numJunctions), [&](size_t t) {
+        mt19937 engine(static_cast<unsigned>(t) + 1);
+        int root = uniform_int_distribution<int>(0, numJunctions - 1)(engine);
+        vector<double> dist(numJunctions, kInfinity);
+        vector<int> parent(numJunctions, -1);
+        vector<int> settled;
+        Queue queue;
+        dist[root] = 0;
+        queue.push(Entry(0, root));
+        while (!queue.empty()) {
+            Entry top = queue.top();
+            queue.pop();
+            int u = top.second;
+            if (top.first > dist[u])
+                continue;
+            settled.push_back(u);
+            for (size_t h = firstNext[u]; h != firstNext[u + 1]; h++) {
+                double miles = top.first + next[h].miles;
+                int v = next[h].junction;
+                if (miles < dist[v]) {
+                    dist[v] = miles;
+                    parent[v] = u;
+                    queue.push(Entry(miles, v));
+                }
+            }
+        }
+        vector<double> below(numJunctions, 0);
+        for (size_t k = settled.size(); k-- > 0; ) {
+            int u = settled[k];
+            below[u] += 1;
+            if (parent[u] >= 0)
+                below[parent[u]] += below[u];
+        }
+        lock_guard<mutex> lock(weightLock);
+        for (int u = 0; u < numJunctions; u++)
+            weight[u] += below[u];
+    });
+    vector<int> order(numJunctions);
+    for (int j = 0; j < numJunctions; j++)
+        order[j] = j;
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        if (weight[a] != weight[b])
+            return weight[a] > weight[b];
+        size_t degreeA = firstNext[a + 1] - firstNext[a], degreeB = firstNext[b + 1] - firstNext[b];
+        if (degreeA != degreeB)
+            return degreeA > degreeB;
+        return a < b;
+    });
+
+    // The searches run in batches on the executor, each pruned only by the
+    // labels from earlier batches, so a batch's searches can leave hubs that
+    // one of them would have made needless.  The first few searches matter
+    // most and run alone; a batch is never more than a small part of what's
+    // been done.
+    struct Hub {
+        int rank;
+        float miles;
+    };
+    vector<vector<Hub>> labels(numJunctions);
+    vector<vector<pair<int, double>>> reached;
+    size_t maxBatch = executor.numWorkers();
+    for (size_t first = 0; first < size_t(numJunctions); ) {
+        size_t batch = max<size_t>(1, min(maxBatch, first / kBatchDivisor));
+        batch = min(batch, numJunctions - first);
+        reached.assign(batch, vector<pair<int, double>>());
+        executor.parallelFor(batch, [&](size_t b) {
+            struct Scratch {
+                vector<double> dist;
+                vector<double> rootMiles;     // the root's label, by hub rank
+                vector<int> touched;
+            };
+            static thread_local Scratch scratch;
+            if (scratch.dist.size() != size_t(numJunctions)) {
+                scratch.dist.assign(numJunctions, kInfinity);
+                scratch.rootMiles.assign(numJunctions, kInfinity);
+            }
+            int rank = first + b;
+            int root = order[rank];
+            for (const Hub& hub : labels[root])
+                scratch.rootMiles[hub.rank] = hub.miles;
+
+            Queue queue;
+            scratch.dist[root] = 0;
+            scratch.touched.push_back(root);
+            queue.push(Entry(0, root));
+            while (!queue.empty()) {
+                Entry top = queue.top();
+                queue.pop();
+                int u = top.second;
+                if (top.first > scratch.dist[u])
+                    continue;
+                bool covered = false;
+                for (const Hub& hub : labels[u]) {
+                    if (scratch.rootMiles[hub.rank] + hub.miles <= top.first) {
+                        covered = true;
+                        break;
+                    }
+                }
+                if (covered)
+                    continue;
+                reached[b].emplace_back(u, top.first);
+                for (size_t h = firstNext[u]; h != firstNext[u + 1]; h++) {
+                    double miles = top.first + next[h].miles;
+                    int v = next[h].junction;
+                    if (miles < scratch.dist[v]) {
+                        if (scratch.dist[v] == kInfinity)
+                            scratch.touched.push_back(v);
+                        scratch.dist[v] = miles;
+                        queue.push(Entry(miles, v));
+                    }
+                }
+            }
+
+            for (int u : scratch.touched)
+                scratch.dist[u] = kInfinity;
+            scratch.touched.clear();
+            for (const Hub& hub : labels[root])
+                scratch.rootMiles[hub.rank] = kInfinity;
+        });
+        for (size_t b = 0; b < batch; b++)
+            for (const pair<int, double>& r : reached[b])
+                labels[r.first].push_back(Hub{ static_cast<int>(first + b), static_cast<float>(r.second) });
+        first += batch;
+    }
+
+    m_firstHub.assign(numJunctions + 1, 0);
+    for (int j = 0; j < numJunctions; j++)
+        m_firstHub[j + 1] = m_firstHub[j] + labels[j].size();
+    m_hubs.resize(m_firstHub[numJunctions]);
+    m_hubMiles.resize(m_firstHub[numJunctions]);
+    for (int j = 0; j < numJunctions; j++) {
+        for (size_t k = 0; k < labels[j].size(); k++) {
+            m_hubs[m_firstHub[j] + k] = labels[j][k].rank;
+            m_hubMiles[m_firstHub[j] + k] = labels[j][k].miles;
+        }
+        vector<Hub>().swap(labels[j]);
+    }
+    m_graph = snapshot->graph;
+    return true;
+}
+
+// The file: "HUBL", the format version and the map's signature, then the
+// junction count and each junction's label, all as varints.  A label is its
+// length, then per hub the rank less the one before it and the distance in
+// units of 1/kUnitsPerMile miles.  The chain ends aren't stored; they come
+// from the map again on loading.
+bool HubLabelsImpl::save(string file) const
+{
+    if (empty())
+        return false;
+    ofstream os(file, ios::binary);
+    if (!os)
+        return false;
+
+    string bytes = "HUBL";
+    auto varint = [&bytes](unsigned long long value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<char>(value));
+    };
+    varint(kFormatVersion);
+    varint(signature(*m_graph));
+    size_t numJunctions = m_firstHub.size() - 1;
+    varint(numJunctions);
+    for (size_t j = 0; j < numJunctions; j++) {
+        varint(m_firstHub[j + 1] - m_firstHub[j]);
+        int prev = 0;
+        for (size_t k = m_firstHub[j]; k != m_firstHub[j + 1]; k++) {
+            varint(m_hubs[k] - prev);
+            varint(llround(m_hubMiles[k] * kUnitsPerMile));
+            prev = m_hubs[k];
+        }
+        if (bytes.size() >= (1 << 20)) {
+            os.write(bytes.data(), bytes.size());
+            bytes.clear();
+        }
+    }
+    os.write(bytes.data(), bytes.size());
+    return static_cast<bool>(os);
+}
+
+bool HubLabelsImpl::load(string file)
+{
+    shared_ptr<const GraphSnapshot> snapshot = m_sm->snapshot();
+    if (snapshot == nullptr || snapshot->graph == nullptr || snapshot->tileDegrees > 0)
+        return false;
+    const StreetGraph& g = *snapshot->graph;
+
+    ifstream is(file, ios::binary);
+    if (!is)
+        return false;
+    string bytes((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+    size_t at = 4;
+    bool ok = bytes.compare(0, 4, "HUBL") == 0;
+    auto varint = [&]() {
+        unsigned long long value = 0;
+        for (int shift = 0; ok; shift += 7) {
+            if (at == bytes.size() || shift > 63) {
+                ok = false;
+                break;
+            }
+            unsigned char byte = bytes[at++];
+            value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return value;
+    };
+    if (!ok || varint() != kFormatVersion || varint() != signature(g))
+        return false;
+
+    size_t numJunctions = count(g.junction.begin(), g.junction.end(), true);
+    if (varint() != numJunctions || !ok)
+        return false;
+
+    vector<size_t> firstHub(numJunctions + 1, 0);
+    vector<int> hubs;
+    vector<float> hubMiles;
+    for (size_t j = 0; j < numJunctions && ok; j++) {
+        size_t count = varint();
+        if (count > numJunctions)
+            return false;
+        unsigned long long rank = 0;
+        for (size_t k = 0; k < count && ok; k++) {
+            rank += varint();
+            if (rank >= numJunctions)
+                return false;
+            hubs.push_back(static_cast<int>(rank));
+            hubMiles.push_back(static_cast<float>(varint() / kUnitsPerMile));
+        }
+        firstHub[j + 1] = hubs.size();
+    }
+    if (!ok || at != bytes.size())
+        return false;
+
+    vector<size_t> firstNext;
+    vector<Hop> next;
+    measure(g, firstNext, next);
+    m_firstHub.swap(firstHub);
+    m_hubs.swap(hubs);
+    m_hubMiles.swap(hubMiles);
+    m_graph = snapshot->graph;
+    return true;
+}
+
+bool HubLabelsImpl::current() const
+{
+    if (m_graph == nullptr)
+        return false;
+    shared_ptr<const GraphSnapshot> snapshot = m_sm->snapshot();
+    return snapshot->graph == m_graph && snapshot->changedEdges == 0;
+}
+
+double HubLabelsImpl::hubMiles(int a, int b) const
+{
+    size_t i = m_firstHub[a], iEnd = m_firstHub[a + 1];
+    size_t j = m_firstHub[b], jEnd = m_firstHub[b + 1];
+    float best = numeric_limits<float>::infinity();
+    while (i != iEnd && j != jEnd) {
+        if (m_hubs[i] < m_hubs[j])
+            i++;
+        else if (m_hubs[j] < m_hubs[i])
+            j++;
+        else {
+            best = min(best, m_hubMiles[i] + m_hubMiles[j]);
+            i++;
+            j++;
+        }
+    }
+    return best;
+}
+
+double HubLabelsImpl::nodeMiles(int u, int v) const
+{
+    double best = numeric_limits<double>::infinity();
+    if (m_chain[u] >= 0 && m_chain[u] == m_chain[v])
+        best = fabs(m_along[u] - m_along[v]);
+    for (size_t i = 2 * size_t(u); i != 2 * size_t(u) + 2 && m_end[i] >= 0; i++)
+        for (size_t j = 2 * size_t(v); j != 2 * size_t(v) + 2 && m_end[j] >= 0; j++)
+            best = min(best, m_endMiles[i] + m_endMiles[j] + hubMiles(m_end[i], m_end[j]));
+    return best;
+}
+
+double HubLabelsImpl::distance(const GeoCoord& start, const GeoCoord& end) const
+{
+    if (empty())
+        return -1;
+    int u = m_graph->findNode(start);
+    int v = m_graph->findNode(end);
+    if (u < 0 || v < 0)
+        return -1;
+    return nodeMiles(u, v);
+}
+
+void HubLabelsImpl::distanceTable(const vector<GeoCoord>& points, vector<vector<double>>& miles) const
+{
+    size_t n = points.size();
+    miles.assign(n, vector<double>(n, -1));
+    if (empty())
+        return;
+    vector<int> nodes(n);
+    for (size_t i = 0; i < n; i++)
+        nodes[i] = m_graph->findNode(points[i]);
+    Executor::shared().parallelFor(n, [&](size_t i) {
+        if (nodes[i] < 0)
+            return;
+        for (size_t j = 0; j < n; j++)
+            if (nodes[j] >= 0)
+                miles[i][j] = nodeMiles(nodes[i], nodes[j]);
+    });
+}
+
+//******************** HubLabels functions ************************************
+
+// These functions simply delegate to HubLabelsImpl's functions.
+// You probably don't want to change any of this code.
+
+HubLabels::HubLabels(const StreetMap* sm)
+{
+    m_impl = new HubLabelsImpl(sm);
+}
+
+HubLabels::~HubLabels()
+{
+    delete m_impl;
+}
+
+bool HubLabels::build()
+{
+    return m_impl->build();
+}
+
+bool HubLabels::save(string file) const
+{
+    return m_impl->save(file);
+}
+
+bool HubLabels::load(string file)
+{
+    return m_impl->load(file);
+}
+
+bool HubLabels::empty() const
+{
+    return m_impl->empty();
+}
+
+bool HubLabels::current() const
+{
+    return m_impl->current();
+}
+
+double HubLabels::distance(const GeoCoord& start, const GeoCoord& end) const
+{
+    return m_impl->distance(start, end);
+}
+
+void HubLabels::distanceTable(const vector<GeoCoord>& points, vector<vector<double>>& miles) const
+{
+    m_impl->distanceTable(points, miles);
+}
+
+size_t HubLabels::labelEntries() const
+{
+    return m_impl->labelEntries();
+}
@@ -0,0 +1,302 @@
+// IndexedHeap.h
+
+// Priority queues over integer ids 0 .. n-1, for the router's searches.  All
+// three have the same interface:
+//
+//   reserve(n)       make room for ids 0 .. n-1
+//   push(id, key)    queue id with key, or lower its key if it is already
+//                    queued with a larger one
+//   pop(id)          remove the id with the smallest key; false if none left
+//   clear()          empty the queue, in time proportional to what it held
+//
+// An id that has been popped may be pushed again.
+
+#ifndef INDEXEDHEAP_INCLUDED
+#define INDEXEDHEAP_INCLUDED
+
+#include <vector>
+#include <queue>
+#include <functional>
+#include <cmath>
+#include <limits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// std::priority_queue with lazy deletion: a lowered key is pushed again and
+// the stale copy is skipped when it comes out.
+class LazyBinaryHeap
+{
+public:
+    void reserve(int n)
+    {
+        if (static_cast<int>(m_key.size()) < n)
+            m_key.resize(n, kNotQueued);
+    }
+
+    void push(int id, double key)
+    {
+        if (m_key[id] <= key)
+            return;
+        if (m_key[id] == kNotQueued)
+            m_touched.push_back(id);
+        m_key[id] = key;
+        m_heap.emplace(key, id);
+    }
+
+    bool pop(int& id)
+    {
+        while (!m_heap.empty()) {
+            Entry top = m_heap.top();
+            m_heap.pop();
+            if (top.first == m_key[top.second]) {
+                id = top.second;
+                m_key[id] = kPopped;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void clear()
+    {
+        for (int id : m_touched)
+            m_key[id] = kNotQueued;
+        m_touched.clear();
+        m_heap = Heap();
+    }
+
+private:
+    typedef std::pair<double, int> Entry;
+    typedef std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> Heap;
+
+      // NaN compares false with everything, so a popped id's leftover copies
+      // are skipped and pushing it again is always accepted
+    static constexpr double kNotQueued = std::numeric_limits<double>::infinity();
+    static constexpr double kPopped = std::numeric_limits<double>::quiet_NaN();
+
+    Heap m_heap;
+    std::vector<double> m_key;      // key id is queued with
+    std::vector<int> m_touched;
+};
+
+// A D-ary heap that knows where every id sits in it, so a key can be lowered
+// in place instead of queueing a second copy.  Four children per node make
+// the tree half as deep as a binary heap, and the four are adjacent in memory.
+template <int D = 4>
+class IndexedHeap
+{
+public:
+    void reserve(int n)
+    {
+        if (static_cast<int>(m_pos.size()) < n)
+            m_pos.resize(n, kNotQueued);
+    }
+
+    void push(int id, double key)
+    {
+        int pos = m_pos[id];
+        if (pos >= 0) {
+            if (key < m_heap[pos].key) {
+                m_heap[pos].key = key;
+                siftUp(pos);
+            }
+            return;
+        }
+        if (pos == kNotQueued)
+            m_touched.push_back(id);
+        m_heap.push_back(Entry{ key, id });
+        m_pos[id] = m_heap.size() - 1;
+        siftUp(m_heap.size() - 1);
+    }
+
+    bool pop(int& id)
+    {
+        if (m_heap.empty())
+            return false;
+        id = m_heap[0].id;
+        m_pos[id] = kPopped;
+        Entry last = m_heap.back();
+        m_heap.pop_back();
+        if (!m_heap.empty()) {
+            m_heap[0] = last;
+            m_pos[last.id] = 0;
+            siftDown(0);
+        }
+        return true;
+    }
+
+    void clear()
+    {
+        for (int id : m_touched)
+            m_pos[id] = kNotQueued;
+        m_touched.clear();
+        m_heap.clear();
+    }
+
+private:
+    struct Entry {
+        double key;
+        int id;
+    };
+
+    static constexpr int kNotQueued = -1;
+    static constexpr int kPopped = -2;
+
+    std::vector<Entry> m_heap;
+    std::vector<int> m_pos;         // index in m_heap, or kNotQueued / kPopped
+    std::vector<int> m_touched;
+
+    void siftUp(size_t pos)
+    {
+        Entry moving = m_heap[pos];
+        while (pos > 0) {
+            size_t parent = (pos - 1) / D;
+            if (!(moving.key < m_heap[parent].key))
+                break;
+            m_heap[pos] = m_heap[parent];
+            m_pos[m_heap[pos].id] = pos;
+            pos = parent;
+        }
+        m_heap[pos] = moving;
+        m_pos[moving.id] = pos;
+    }
+
+    void siftDown(size_t pos)
+    {
+        Entry moving = m_heap[pos];
+        size_t size = m_heap.size();
+        for (;;) {
+            size_t first = pos * D + 1;
+            if (first >= size)
+                break;
+            size_t last = first + D < size ? first + D : size;
+            size_t best = first;
+            for (size_t child = first + 1; child < last; child++)
+                if (m_heap[child].key < m_heap[best].key)
+                    best = child;
+            if (!(m_heap[best].key < moving.key))
+                break;
+            m_heap[pos] = m_heap[best];
+            m_pos[m_heap[pos].id] = pos;
+            pos = best;
+        }
+        m_heap[pos] = moving;
+        m_pos[moving.id] = pos;
+    }
+};
+
+// Radix heap over keys scaled to integers (key * scale, rounded down).  It
+// relies on the keys coming out never decreasing, which holds for A* with a
+// consistent heuristic; a key below the last one popped is raised to it.
+// Bucket i holds keys that first differ from the last popped key at bit
+// i - 1, so each entry moves down at most 64 times over its life.
+class RadixHeap
+{
+public:
+    explicit RadixHeap(double scale = 1e6)
+     : m_scale(scale), m_last(0), m_size(0)
+    {}
+
+    void setScale(double scale) { m_scale = scale; }
+
+    void reserve(int n)
+    {
+        if (static_cast<int>(m_key.size()) < n)
+            m_key.resize(n, kNotQueued);
+    }
+
+    void push(int id, double key)
+    {
+        unsigned long long k = scaled(key);
+        if (m_key[id] != kPopped && m_key[id] != kNotQueued && m_key[id] <= k)
+            return;
+        if (m_key[id] == kNotQueued)
+            m_touched.push_back(id);
+        m_key[id] = k;
+        m_buckets[bucket(k)].push_back(Entry{ k, id });
+        m_size++;
+    }
+
+    bool pop(int& id)
+    {
+        for (;;) {
+            if (m_size == 0)
+                return false;
+            if (m_buckets[0].empty()) {
+                int i = 1;
+                while (m_buckets[i].empty())
+                    i++;
+                unsigned long long smallest = m_buckets[i][0].key;
+                for (const Entry& e : m_buckets[i])
+                    if (e.key < smallest)
+                        smallest = e.key;
+                m_last = smallest;
+                for (const Entry& e : m_buckets[i])     // all land in buckets below i
+                    m_buckets[bucket(e.key)].push_back(e);
+                m_buckets[i].clear();
+            }
+            Entry e = m_buckets[0].back();
+            m_buckets[0].pop_back();
+            m_size--;
+            if (m_key[e.id] == e.key) {     // otherwise a stale copy
+                id = e.id;
+                m_key[id] = kPopped;
+                return true;
+            }
+        }
+    }
+
+    void clear()
+    {
+        for (int id : m_touched)
+            m_key[id] = kNotQueued;
+        m_touched.clear();
+        for (std::vector<Entry>& b : m_buckets)
+            b.clear();
+        m_last = 0;
+        m_size = 0;
+    }
+
+private:
+    struct Entry {
+        unsigned long long key;
+        int id;
+    };
+
+    static constexpr unsigned long long kNotQueued = ~0ull;
+    static constexpr unsigned long long kPopped = ~0ull - 1;
+
+    double m_scale;
+    unsigned long long m_last;
+    size_t m_size;
+    std::vector<Entry> m_buckets[65];
+    std::vector<unsigned long long> m_key;
+    std::vector<int> m_touched;
+
+    unsigned long long scaled(double key) const
+    {
+        double k = std::floor(key * m_scale);
+        unsigned long long u = k <= 0 ? 0 : k >= 1.8e19 ? kPopped - 1 : static_cast<unsigned long long>(k);
+        return u < m_last ? m_last : u;
+    }
+
+      // position of the highest set bit of x, which isn't 0
+    static int highestBit(unsigned long long x)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, x);
+        return static_cast<int>(index);
+#else
+        return 63 - __builtin_clzll(x);
+#endif
+    }
+
+    int bucket(unsigned long long key) const
+    {
+        return key == m_last ? 0 : highestBit(key ^ m_last) + 1;
+    }
+};
+
+#endif // INDEXEDHEAP_INCLUDED
@@ -0,0 +1,353 @@
+#include "provided.h"
+#include "Executor.h"
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+using namespace std;
+
+class MultiDepotPlannerImpl
+{
+public:
+    MultiDepotPlannerImpl(const StreetMap* sm);
+    ~MultiDepotPlannerImpl();
+    DeliveryResult generatePlan(
+        const vector<Depot>& depots,
+        const vector<DeliveryRequest>& deliveries,
+        vector<DepotPlan>& plans,
+        double& totalDistanceTravelled) const;
+private:
+    const StreetMap* m_sm;
+    PointToPointRouter m_router;
+
+      // rounds of moving each vehicle's stop to the middle of its cluster
+    static constexpr int kMaxClusterRounds = 4;
+
+      // how many medoids, the nearest by crow, each delivery is routed from
+      // while clustering
+    static constexpr int kCandidateMedoids = 8;
+
+      // added to the crow distance from the other medoids, so they're
+      // chosen only when the nearer ones are full
+    static constexpr double kNotRouted = 1e6;
+
+      // Puts item i in bin[i], a bin with room for it, nearest by dist[b][i]
+      // first.  The items with most to lose by not getting their nearest bin
+      // go first; if that leaves some out, the biggest go first instead.
+      // False if they still don't all fit.
+    bool assign(const vector<vector<double>>& dist, const vector<double>& quantity,
+        const vector<double>& capacity, vector<int>& bin) const;
+    bool assignInOrder(const vector<vector<double>>& dist, const vector<double>& quantity,
+        const vector<double>& capacity, const vector<int>& order, vector<int>& bin) const;
+
+      // Splits the deliveries members among the depot's vehicles, one
+      // cluster per vehicle.
+    DeliveryResult cluster(const Depot& depot, const vector<DeliveryRequest>& deliveries,
+        const vector<int>& members, vector<vector<int>>& clusters) const;
+
+      // dist[c][j] is how far points[j] is by road from points[medoids[c]],
+      // for the kCandidateMedoids medoids nearest each point by crow, and
+      // kNotRouted more than the crow distance for the rest.
+    DeliveryResult medoidDistances(const vector<GeoCoord>& points, const vector<int>& medoids,
+        vector<vector<double>>& dist) const;
+};
+
+MultiDepotPlannerImpl::MultiDepotPlannerImpl(const StreetMap* sm)
+ : m_sm(sm), m_router(sm)
+{
+}
+
+MultiDepotPlannerImpl::~MultiDepotPlannerImpl()
+{
+}
+
+DeliveryResult MultiDepotPlannerImpl::generatePlan(
+    const vector<Depot>& depots,
+    const vector<DeliveryRequest>& deliveries,
+    vector<DepotPlan>& plans,
+    double& totalDistanceTravelled) const
+{
+    totalDistanceTravelled = 0;
+    plans.assign(depots.size(), DepotPlan());
+    for (size_t d = 0; d < depots.size(); d++) {
+        plans[d].deliveries.resize(depots[d].vehicles.size());
+        plans[d].commands.resize(depots[d].vehicles.size());
+        plans[d].distances.assign(depots[d].vehicles.size(), 0);
+    }
+
+    if (deliveries.empty())
+        return DELIVERY_SUCCESS;
+    if (depots.empty())
+        return OVER_CAPACITY;
+
+    // How far every delivery is from every depot, one search per depot.
+    vector<GeoCoord> sources, targets;
+    for (const Depot& depot : depots)
+        sources.push_back(depot.location);
+    for (const DeliveryRequest& d : deliveries)
+        targets.push_back(d.location);
+    vector<vector<double>> dist;
+    DeliveryResult result = m_router.generateDistanceMatrix(sources, targets, dist);
+    if (result != DELIVERY_SUCCESS)
+        return result;
+
+    for (size_t i = 0; i < deliveries.size(); i++) {
+        bool reachable = false;
+        for (size_t d = 0; d < depots.size() && !reachable; d++)
+            reachable = dist[d][i] != numeric_limits<double>::infinity();
+        if (!reachable)
+            return NO_ROUTE;
+    }
+
+    vector<double> quantity(deliveries.size());
+    for (size_t i = 0; i < deliveries.size(); i++)
+        quantity[i] = deliveries[i].quantity;
+    vector<double> capacity(depots.size(), 0);
+    for (size_t d = 0; d < depots.size(); d++)
+        for (const Vehicle& v : depots[d].vehicles)
+            capacity[d] += v.capacity;
+
+    vector<int> depotOf;
+    if (!assign(dist, quantity, capacity, depotOf))
+        return OVER_CAPACITY;
+    dist.clear();
+
+    vector<vector<int>> members(depots.size());
+    for (size_t i = 0; i < deliveries.size(); i++)
+        members[depotOf[i]].push_back(i);
+    for (size_t d = 0; d < depots.size(); d++) {
+        if (members[d].empty())
+            continue;
+        result = cluster(depots[d], deliveries, members[d], plans[d].deliveries);
+        if (result != DELIVERY_SUCCESS)
+            return result;
+    }
+
+    // Plan every vehicle that has something to deliver, from all the depots
+    // at once.
+    vector<pair<int, int>> work;
+    for (size_t d = 0; d < depots.size(); d++)
+        for (size_t v = 0; v < depots[d].vehicles.size(); v++)
+            if (!plans[d].deliveries[v].empty())
+                work.emplace_back(d, v);
+
+    vector<DeliveryResult> results(work.size(), DELIVERY_SUCCESS);
+    DeliveryPlanner planner(m_sm);
+    Executor::shared().parallelFor(work.size(), [&](size_t w) {
+        int d = work[w].first;
+        int v = work[w].second;
+        vector<DeliveryRequest> assigned;
+        for (int i : plans[d].deliveries[v])
+            assigned.push_back(deliveries[i]);
+        results[w] = planner.generateDeliveryPlan(depots[d].location, assigned,
+            plans[d].commands[v], plans[d].distances[v]);
+    });
+
+    for (size_t w = 0; w < work.size(); w++) {
+        if (results[w] != DELIVERY_SUCCESS)
+            return results[w];
+        totalDistanceTravelled += plans[work[w].first].distances[work[w].second];
+    }
+
+    return DELIVERY_SUCCESS;
+}
+
+bool MultiDepotPlannerImpl::assign(const vector<vector<double>>& dist, const vector<double>& quantity,
+    const vector<double>& capacity, vector<int>& bin) const
+{
+    const double infinity = numeric_limits<double>::infinity();
+    int n = quantity.size();
+
+    // regret: how much further the second nearest bin is than the nearest
+    vector<double> regret(n);
+    for (int i = 0; i < n; i++) {
+        double first = infinity, second = infinity;
+        for (const vector<double>& row : dist) {
+            if (row[i] < first) {
+                second = first;
+                first = row[i];
+            }
+            else if (row[i] < second)
+                second = row[i];
+        }
+        regret[i] = second - first;
+    }
+
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        return regret[a] != regret[b] ? regret[a] > regret[b] : quantity[a] > quantity[b];
+    });
+    if (assignInOrder(dist, quantity, capacity, order, bin))
+        return true;
+
+    stable_sort(order.begin(), order.end(), [&quantity](int a, int b) { return quantity[a] > quantity[b]; });
+    return assignInOrder(dist, quantity, capacity, order, bin);
+}
+
+bool MultiDepotPlannerImpl::assignInOrder(const vector<vector<double>>& dist, const vector<double>& quantity,
+    const vector<double>& capacity, const vector<int>& order, vector<int>& bin) const
+{
+    vector<double> room = capacity;
+    bin.assign(quantity.size(), -1);
+    for (int i : order) {
+        int best = -1;
+        for (size_t b = 0; b < room.size(); b++) {
+            if (room[b] >= quantity[i] && dist[b][i] != numeric_limits<double>::infinity() &&
+                (best < 0 || dist[b][i] < dist[best][i]))
+                best = b;
+        }
+        if (best < 0)
+            return false;
+        bin[i] = best;
+        room[best] -= quantity[i];
+    }
+    return true;
+}
+
+// Capacity-aware k-medoids, with one medoid per vehicle and every medoid a
+// delivery's node.  The medoids start spread out, each as far by crow from
+// those before it as can be, the first furthest from the depot.  Each round
+// routes out of the medoids to the depot's deliveries, clusters them by
+// assign, and moves each medoid to the delivery nearest its cluster's
+// centroid, until the medoids stay put.
+DeliveryResult MultiDepotPlannerImpl::cluster(const Depot& depot, const vector<DeliveryRequest>& deliveries,
+    const vector<int>& members, vector<vector<int>>& clusters) const
+{
+    int m = members.size();
+
+    // the vehicles used, biggest first, if there are more than deliveries
+    vector<int> vehicles(depot.vehicles.size());
+    iota(vehicles.begin(), vehicles.end(), 0);
+    stable_sort(vehicles.begin(), vehicles.end(), [&depot](int a, int b) {
+        return depot.vehicles[a].capacity > depot.vehicles[b].capacity;
+    });
+    if (static_cast<int>(vehicles.size()) > m)
+        vehicles.resize(m);
+    int k = vehicles.size();
+
+    vector<double> quantity(m), capacity(k);
+    vector<GeoCoord> targets(m);
+    for (int j = 0; j < m; j++) {
+        quantity[j] = deliveries[members[j]].quantity;
+        targets[j] = deliveries[members[j]].location;
+    }
+    for (int c = 0; c < k; c++)
+        capacity[c] = depot.vehicles[vehicles[c]].capacity;
+
+    vector<int> medoids;
+    vector<double> nearest(m);
+    for (int j = 0; j < m; j++)
+        nearest[j] = distanceEarthMiles(depot.location, targets[j]);
+    while (static_cast<int>(medoids.size()) < k) {
+        int next = max_element(nearest.begin(), nearest.end()) - nearest.begin();
+        medoids.push_back(next);
+        for (int j = 0; j < m; j++)
+            nearest[j] = min(nearest[j], distanceEarthMiles(targets[next], targets[j]));
+    }
+
+    vector<int> clusterOf;
+    vector<vector<double>> dist;
+    for (int round = 0; round < kMaxClusterRounds; round++) {
+        DeliveryResult result = medoidDistances(targets, medoids, dist);
+        if (result != DELIVERY_SUCCESS)
+            return result;
+        if (!assign(dist, quantity, capacity, clusterOf))
+            return OVER_CAPACITY;
+
+        vector<double> latitude(k, 0), longitude(k, 0);
+        vector<int> size(k, 0);
+        for (int j = 0; j < m; j++) {
+            latitude[clusterOf[j]] += targets[j].latitude;
+            longitude[clusterOf[j]] += targets[j].longitude;
+            size[clusterOf[j]]++;
+        }
+        vector<double> closest(k, numeric_limits<double>::infinity());
+        vector<int> moved = medoids;
+        for (int j = 0; j < m; j++) {
+            int c = clusterOf[j];
+            GeoCoord centroid;
+            centroid.latitude = latitude[c] / size[c];
+            centroid.longitude = longitude[c] / size[c];
+            double miles = distanceEarthMiles(centroid, targets[j]);
+            if (miles < closest[c]) {
+                closest[c] = miles;
+                moved[c] = j;
+            }
+        }
+        if (moved == medoids)
+            break;
+        medoids = move(moved);
+    }
+
+    for (int j = 0; j < m; j++)
+        clusters[vehicles[clusterOf[j]]].push_back(members[j]);
+    return DELIVERY_SUCCESS;
+}
+
+// Routing out of every medoid to every delivery would search most of the
+// depot's area k times over.  Only the few medoids nearest a delivery could
+// reasonably take it, so each medoid's search stops once it has the
+// deliveries it is among the nearest few to.
+DeliveryResult MultiDepotPlannerImpl::medoidDistances(const vector<GeoCoord>& points, const vector<int>& medoids,
+    vector<vector<double>>& dist) const
+{
+    int m = points.size();
+    int k = medoids.size();
+    int candidates = min(kCandidateMedoids, k);
+
+    dist.assign(k, vector<double>(m));
+    vector<vector<int>> targets(k);
+    vector<pair<double, int>> crow(k);
+    for (int j = 0; j < m; j++) {
+        for (int c = 0; c < k; c++) {
+            dist[c][j] = kNotRouted + distanceEarthMiles(points[j], points[medoids[c]]);
+            crow[c] = make_pair(dist[c][j], c);
+        }
+        nth_element(crow.begin(), crow.begin() + candidates - 1, crow.end());
+        for (int i = 0; i < candidates; i++)
+            targets[crow[i].second].push_back(j);
+    }
+
+    vector<DeliveryResult> results(k, DELIVERY_SUCCESS);
+    Executor::shared().parallelFor(k, [&](size_t c) {
+        vector<GeoCoord> source(1, points[medoids[c]]), near;
+        for (int j : targets[c])
+            near.push_back(points[j]);
+        vector<vector<double>> miles;
+        results[c] = m_router.generateDistanceMatrix(source, near, miles);
+        if (results[c] == DELIVERY_SUCCESS) {
+            for (size_t i = 0; i < targets[c].size(); i++)
+                dist[c][targets[c][i]] = miles[0][i];
+        }
+    });
+
+    for (DeliveryResult result : results) {
+        if (result != DELIVERY_SUCCESS)
+            return result;
+    }
+    return DELIVERY_SUCCESS;
+}
+
+//******************** MultiDepotPlanner functions ****************************
+
+// These functions simply delegate to MultiDepotPlannerImpl's functions.
+
+MultiDepotPlanner::MultiDepotPlanner(const StreetMap* sm)
+{
+    m_impl = new MultiDepotPlannerImpl(sm);
+}
+
+MultiDepotPlanner::~MultiDepotPlanner()
+{
+    delete m_impl;
+}
+
+DeliveryResult MultiDepotPlanner::generatePlan(
+    const vector<Depot>& depots,
+    const vector<DeliveryRequest>& deliveries,
+    vector<DepotPlan>& plans,
+    double& totalDistanceTravelled) const
+{
+    return m_impl->generatePlan(depots, deliveries, plans, totalDistanceTravelled);
+}
@@ -1,64 +1,283 @@
 #include "provided.h"
+#include "StreetGraph.h"
+#include "IndexedHeap.h"
+#include "RouteCache.h"
+#include "Executor.h"
 #include <list>
-#include <queue>
-#include <unordered_map>
-#include <set>
-#include <unordered_set>
+#include <vector>
 #include <functional>
 #include <algorithm>
-#include <map>
+#include <limits>
 using namespace std;
 
-template <>
-struct hash<GeoCoord> {
-    size_t operator()(GeoCoord a) const {
-        std::hash<std::string> hash;
-        return hash(a.latitudeText + a.longitudeText);
+// What a search minimizes.  traverse() gives a node's label after travelling
+// an edge from a node with the given label, and h() a lower bound on what is
+// left to the goal.
+
+  // label = cost so far, in miles (or the overriding cost)
+struct DistanceCost
+{
+    static const bool kAdditive = true;     // a chain costs the sum of its edges
+    static const bool kCacheable = true;    // the best route depends only on its ends
+    static constexpr double kRadixScale = 1e6;
+
+    const GraphSnapshot& snap;
+    int goal;
+
+    double traverse(int e, double label) const {
+        return label + snap.edgeCost(e);
+    }
+
+      // what a delay of so many seconds adds to a label
+    static double delay(double seconds) {
+        return seconds * SpeedProfiles::kDefaultMph / 3600;
     }
+
+    double h(int node) const {
+        return snap.heuristicScale * snap.graph->crowMiles(node, goal);
+    }
+};
+
+  // label = clock time in seconds.  An edge's cost override counts as its
+  // length, so doubling the cost of a segment doubles the time to drive it.
+struct TravelTimeCost
+{
+    static const bool kAdditive = false;
+    static const bool kCacheable = false;
+    static constexpr double kRadixScale = 1e3;
+
+    const GraphSnapshot& snap;
+    int goal;
+
+    double traverse(int e, double label) const {
+        return snap.profiles->arrivalTime(e, snap.edgeCost(e), label);
+    }
+
+    static double delay(double seconds) {
+        return seconds;
+    }
+
+    double h(int node) const {
+        double miles = snap.heuristicScale * snap.graph->crowMiles(node, goal);
+        return miles / snap.profiles->maxMph * 3600;
+    }
+};
+
+  // How the search reached a node: along members from .. to-1 of a chain.
+  // That is the whole chain except where the route starts or ends part way
+  // along one.
+struct Via
+{
+    int chain = -1;
+    int from = 0;
+    int to = 0;
 };
 
+// Scratch space for searches, one per thread and kept between queries, so a
+// query neither allocates nor clears arrays the size of the map.  A node's
+// entries belong to the current search only if its stamp says so.
+struct SearchSpace
+{
+    vector<unsigned int> stamp;
+    vector<double> gScore;
+    vector<Via> cameFrom;
+    vector<bool> closed;
+    unsigned int current = 0;
+
+    vector<int> missing;        // nodes settled whose tiles weren't loaded
+
+      // The turn-aware search settles chains, not nodes, and the arrays above
+      // are indexed by chain, then by junction after the chains; cameFrom's
+      // chain is then the one driven before.
+      // It reaches the end along endVia, having driven the chain endPrev
+      // before it (-1 if the route starts on endVia's chain).
+    Via endVia;
+    int endPrev = -1;
+
+    LazyBinaryHeap binaryHeap;
+    IndexedHeap<4> fourAryHeap;
+    RadixHeap radixHeap;
+
+    void begin(int numNodes) {
+        if (static_cast<int>(stamp.size()) < numNodes) {
+            stamp.resize(numNodes, current);
+            gScore.resize(numNodes);
+            cameFrom.resize(numNodes);
+            closed.resize(numNodes);
+        }
+        binaryHeap.reserve(numNodes);
+        fourAryHeap.reserve(numNodes);
+        radixHeap.reserve(numNodes);
+        missing.clear();
+        if (++current == 0) {
+            fill(stamp.begin(), stamp.end(), 0);
+            current = 1;
+        }
+    }
+
+    void touch(int node) {
+        if (stamp[node] != current) {
+            stamp[node] = current;
+            gScore[node] = numeric_limits<double>::infinity();
+            cameFrom[node] = Via();
+            closed[node] = false;
+        }
+    }
+
+    double g(int node) const {
+        return stamp[node] == current ? gScore[node] : numeric_limits<double>::infinity();
+    }
+};
+
+thread_local SearchSpace searchSpace;
+
+// A shortest-path tree grown out of one end of a route, for alternatives to
+// it; the other end's tree is grown into the other one.
+struct RouteTree
+{
+    SearchSpace space;
+    vector<int> settled;        // in the order they were settled
+    vector<double> shared;      // for those, how much of their tree path is shortest route
+};
+
+thread_local RouteTree routeTrees[2];
+
 class PointToPointRouterImpl
 {
 public:
-    PointToPointRouterImpl(const StreetMap* sm);
+    PointToPointRouterImpl(const StreetMap* sm, const RouterOptions& options);
     ~PointToPointRouterImpl();
     DeliveryResult generatePointToPointRoute(
         const GeoCoord& start,
         const GeoCoord& end,
-        list<StreetSegment>& route,
-        double& totalDistanceTravelled) const;
+        Route& route) const;
+    DeliveryResult generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double departureTime,
+        Route& route,
+        double& arrivalTime) const;
+    DeliveryResult findReachable(const GeoCoord& start, double maxMiles, ReachableArea& area, bool withBoundary) const;
+    DeliveryResult findReachable(const vector<GeoCoord>& starts, double maxMiles, vector<ReachableArea>& areas,
+        bool withBoundary) const;
+    DeliveryResult generateAlternativeRoutes(const GeoCoord& start, const GeoCoord& end, int k,
+        vector<Route>& routes, const AlternativeRouteOptions& options) const;
+    DeliveryResult generateDistanceMatrix(const vector<GeoCoord>& sources, const vector<GeoCoord>& targets,
+        vector<vector<double>>& miles) const;
+    future<RouteResult> generatePointToPointRouteAsync(const GeoCoord& start, const GeoCoord& end,
+        const CancellationToken& token) const;
 
 private:
     const StreetMap* m_sm;
+    RouterOptions m_options;
+
+    template <typename Cost>
+    DeliveryResult findRoute(const GeoCoord& start, const GeoCoord& end, double startLabel,
+        Route& route, double& endLabel) const;
+
+      // runs aStar on the queue the options ask for
+    template <typename Cost>
+    bool search(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+        const Cost& cost, double& endLabel) const;
+
+    template <typename Cost, typename Queue>
+    bool aStar(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+        const Cost& cost, Queue& openSet, double& endLabel) const;
+
+      // Settles everything within budget of startNode, leaving the labels in
+      // searchSpace and the nodes in reached.  Given targets, it stops as
+      // soon as all of them have their final labels.
+    template <typename Queue>
+    void settleWithin(const GraphSnapshot& snap, int startNode, double budget, Queue& openSet,
+        vector<int>& reached, const vector<int>* targets) const;
+
+    void settleWithin(const GraphSnapshot& snap, int startNode, double budget, vector<int>& reached,
+        const vector<int>* targets) const;
+
+      // one row of the distance matrix, in this thread's searchSpace
+    DeliveryResult distancesFrom(const GeoCoord& source, const vector<GeoCoord>& targets,
+        vector<double>& miles) const;
 
-    double h(const GeoCoord& a, const GeoCoord& goal) const {
-        //return 0;
-        return distanceEarthMiles(a, goal);
+      // Grows tree out of root by distance, on to every node that could lie
+      // on a route to goal no longer than the shortest by stretch.  Returns
+      // how far goal is, or infinity if it can't be reached.  Given goal's
+      // tree, grown already, it keeps to the nodes in that.
+    template <typename Queue>
+    double growTree(const GraphSnapshot& snap, int root, int goal, double stretch, RouteTree& tree,
+        const RouteTree* goalTree, Queue& openSet) const;
+
+    double growTree(const GraphSnapshot& snap, int root, int goal, double stretch, RouteTree& tree,
+        const RouteTree* goalTree) const;
+
+      // the turn-aware search, on chains; penalty is by StreetGraph::Turn
+    template <typename Cost>
+    bool searchTurns(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+        const Cost& cost, double& endLabel) const;
+
+    template <typename Cost, typename Queue>
+    bool aStarTurns(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+        const Cost& cost, const double penalty[4], Queue& openSet, double& endLabel) const;
+
+      // walkChain, adding what the turns inside the chain cost
+    template <typename Cost>
+    double walkChainTurns(const GraphSnapshot& snap, const Cost& cost, const double penalty[4], int chain,
+        int from, int to, double chainLength, double label) const;
+
+    bool chargesTurns() const {
+        return m_options.leftTurnSeconds > 0 || m_options.rightTurnSeconds > 0 || m_options.uTurnSeconds > 0;
     }
 
-    double getWeight(const StreetSegment& a) const {
-        return distanceEarthMiles(a.start, a.end);
+    void reconstructTurnPath(const shared_ptr<const GraphSnapshot>& snapshot, Route& route) const {
+        const StreetGraph& g = *snapshot->graph;
+        const SearchSpace& space = searchSpace;
+        route.m_snapshot = snapshot;
+        route.m_edges.clear();
+        route.m_distance = 0;
+        Via via = space.endVia;
+        int chain = via.chain;
+        int prev = space.endPrev;
+        while (chain >= 0) {
+            for (int pos = via.to - 1; pos >= via.from; pos--) {
+                int e = g.chainEdge(chain, pos);
+                route.m_edges.push_back(e);
+                route.m_distance += g.length(e);
+            }
+            chain = prev;
+            if (chain >= 0) {
+                via = space.cameFrom[chain];
+                prev = via.chain;
+            }
+        }
+        reverse(route.m_edges.begin(), route.m_edges.end());
     }
 
-    void reconstructPath(unordered_map<GeoCoord, StreetSegment> cameFrom, GeoCoord end, list<StreetSegment>& path, double& totalDistance) const {
-        totalDistance = 0;
-        path.clear();
-        if (cameFrom.size() == 0) return;
-        StreetSegment current = cameFrom[end];
-        path.push_front(current);
-        totalDistance += getWeight(current);
+    template <typename Cost>
+    double walkChain(const GraphSnapshot& snap, const Cost& cost, int chain, int from, int to,
+        double chainLength, double label) const;
 
-        while (cameFrom.find(current.start) != cameFrom.end()) {
-            current = cameFrom[current.start];
-            path.push_front(current);
-            totalDistance += getWeight(current);
+    void reconstructPath(const shared_ptr<const GraphSnapshot>& snapshot, const vector<Via>& cameFrom, int start, int end,
+        Route& route) const {
+        const StreetGraph& g = *snapshot->graph;
+        route.m_snapshot = snapshot;
+        route.m_edges.clear();
+        route.m_distance = 0;
+        for (int node = end; node != start; ) {
+            const Via& via = cameFrom[node];
+            for (int pos = via.to - 1; pos >= via.from; pos--) {
+                int e = g.chainEdge(via.chain, pos);
+                route.m_edges.push_back(e);
+                route.m_distance += g.length(e);
+            }
+            node = g.edgeSource[g.chainEdge(via.chain, via.from)];
         }
+        reverse(route.m_edges.begin(), route.m_edges.end());
     }
 };
 
-PointToPointRouterImpl::PointToPointRouterImpl(const StreetMap* sm)
+PointToPointRouterImpl::PointToPointRouterImpl(const StreetMap* sm, const RouterOptions& options)
 {
     m_sm = sm;
+    m_options = options;
 }
 
 PointToPointRouterImpl::~PointToPointRouterImpl()
@@ -68,54 +287,1004 @@ PointToPointRouterImpl::~PointToPointRouterImpl()
 DeliveryResult PointToPointRouterImpl::generatePointToPointRoute(
         const GeoCoord& start,
         const GeoCoord& end,
-        list<StreetSegment>& route,
-        double& totalDistanceTravelled) const
+        Route& route) const
+{
+    double cost;
+    return findRoute<DistanceCost>(start, end, 0, route, cost);
+}
+
+DeliveryResult PointToPointRouterImpl::generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double departureTime,
+        Route& route,
+        double& arrivalTime) const
 {
-    typedef std::pair<double, GeoCoord> PriorityNode;
-    std::priority_queue<PriorityNode, std::vector<PriorityNode>, std::greater<PriorityNode>> openSet;
-    unordered_set<GeoCoord> closedSet;
-    unordered_map<GeoCoord, StreetSegment> cameFrom;
-    unordered_map<GeoCoord, double> gScore;
+    return findRoute<TravelTimeCost>(start, end, departureTime, route, arrivalTime);
+}
 
-    openSet.emplace(0, start);
-    gScore[start] = 0;
+template <typename Cost>
+DeliveryResult PointToPointRouterImpl::findRoute(const GeoCoord& start, const GeoCoord& end, double startLabel,
+    Route& route, double& endLabel) const
+{
+    // Hold on to one version of the map for the whole search, so an update
+    // published meanwhile can't change the graph under us.  On a tiled map the
+    // search may settle nodes whose tiles aren't loaded, and what it finds
+    // then may not be the best route.  It is run again with all those tiles
+    // loaded as well, until it needs no more.
+    vector<GeoCoord> needed;
+    needed.push_back(start);
+    needed.push_back(end);
 
-    vector<StreetSegment> neighbors;
-    if (!m_sm->getSegmentsThatStartWith(start, neighbors)) return BAD_COORD;
-    if (!m_sm->getSegmentsThatStartWith(end, neighbors)) return BAD_COORD;
+    // Looked up once, in the first version searched; a tiled map may move on
+    // to others as it reads tiles.
+    shared_ptr<RouteCache> cache;
+    if (Cost::kCacheable && m_options.useRouteCache && !chargesTurns())
+        cache = m_sm->routeCache();
+    bool lookedUp = false;
 
-    while (!openSet.empty()) {
-        GeoCoord current = openSet.top().second;
-        openSet.pop();
-        if (current == end) {
-            // done
-            reconstructPath(cameFrom, current, route, totalDistanceTravelled);
+    for (;;) {
+        shared_ptr<const GraphSnapshot> snapshot = m_sm->snapshotCovering(needed);
+        const GraphSnapshot& snap = *snapshot;
+
+        int startNode = snap.graph->findNode(start);
+        int endNode = snap.graph->findNode(end);
+        if (startNode < 0 || endNode < 0) return BAD_COORD;
+
+        if (cache && !lookedUp) {
+            lookedUp = true;
+            if (cache->find(snap, startNode, endNode, route.m_edges, route.m_distance, endLabel)) {
+                route.m_snapshot = snapshot;
+                return DELIVERY_SUCCESS;
+            }
+        }
+
+        Cost cost{ snap, endNode };
+        bool found = chargesTurns() ? searchTurns(snap, startNode, endNode, startLabel, cost, endLabel)
+                                    : search(snap, startNode, endNode, startLabel, cost, endLabel);
+        if (!found && CancellationScope::cancelled())
+            return CANCELLED;
+        if (searchSpace.missing.empty()) {
+            if (!found)
+                return NO_ROUTE;
+            if (chargesTurns())
+                reconstructTurnPath(snapshot, route);
+            else
+                reconstructPath(snapshot, searchSpace.cameFrom, startNode, endNode, route);
+            if (cache)
+                cache->insert(snap, startNode, endNode, route.m_edges, route.m_distance, endLabel);
             return DELIVERY_SUCCESS;
         }
+        for (int node : searchSpace.missing)
+            needed.push_back(snap.graph->coords[node]);
+    }
+}
 
-        closedSet.insert(current);
+// Label after travelling members from .. to-1 of a chain, or infinity if one
+// of them is closed.  An untouched chain under an additive cost is just its
+// precomputed length, chainLength.
+template <typename Cost>
+double PointToPointRouterImpl::walkChain(const GraphSnapshot& snap, const Cost& cost, int chain, int from, int to,
+    double chainLength, double label) const
+{
+    const StreetGraph& g = *snap.graph;
+    if (Cost::kAdditive && from == 0 && to == g.chainSize(chain) && snap.chainChanges[chain] == 0)
+        return label + chainLength;
 
-        if (!m_sm->getSegmentsThatStartWith(current, neighbors))
-            return NO_ROUTE;
+    for (int pos = from; pos < to; pos++) {
+        int e = g.chainEdge(chain, pos);
+        if (snap.states.closed(e))
+            return numeric_limits<double>::infinity();
+        label = cost.traverse(e, label);
+    }
+    return label;
+}
+
+template <typename Cost>
+bool PointToPointRouterImpl::search(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+    const Cost& cost, double& endLabel) const
+{
+    searchSpace.begin(snap.graph->numNodes());
+
+    bool found = false;
+    switch (m_options.queue)
+    {
+      case RouterOptions::BINARY_HEAP:
+        found = aStar(snap, startNode, endNode, startLabel, cost, searchSpace.binaryHeap, endLabel);
+        searchSpace.binaryHeap.clear();
+        break;
+      case RouterOptions::FOUR_ARY_HEAP:
+        found = aStar(snap, startNode, endNode, startLabel, cost, searchSpace.fourAryHeap, endLabel);
+        searchSpace.fourAryHeap.clear();
+        break;
+      case RouterOptions::RADIX_HEAP:
+        searchSpace.radixHeap.setScale(Cost::kRadixScale);
+        found = aStar(snap, startNode, endNode, startLabel, cost, searchSpace.radixHeap, endLabel);
+        searchSpace.radixHeap.clear();
+        break;
+    }
+    return found;
+}
+
+template <typename Cost>
+double PointToPointRouterImpl::walkChainTurns(const GraphSnapshot& snap, const Cost& cost, const double penalty[4],
+    int chain, int from, int to, double chainLength, double label) const
+{
+    const StreetGraph& g = *snap.graph;
+    if (Cost::kAdditive && from == 0 && to == g.chainSize(chain) && snap.chainChanges[chain] == 0) {
+        return label + chainLength + penalty[StreetGraph::LEFT] * g.chainTurns[2 * chain]
+            + penalty[StreetGraph::RIGHT] * g.chainTurns[2 * chain + 1];
+    }
+
+    for (int pos = from; pos < to; pos++) {
+        int e = g.chainEdge(chain, pos);
+        if (snap.states.closed(e))
+            return numeric_limits<double>::infinity();
+        if (pos > from)
+            label += penalty[g.turnBetween(g.chainEdge(chain, pos - 1), e)];
+        label = cost.traverse(e, label);
+    }
+    return label;
+}
+
+template <typename Cost>
+bool PointToPointRouterImpl::searchTurns(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+    const Cost& cost, double& endLabel) const
+{
+    const StreetGraph& g = *snap.graph;
+    searchSpace.begin(g.numChains() + g.numNodes());
+
+    double penalty[4];
+    penalty[StreetGraph::STRAIGHT] = 0;
+    penalty[StreetGraph::LEFT] = Cost::delay(m_options.leftTurnSeconds);
+    penalty[StreetGraph::RIGHT] = Cost::delay(m_options.rightTurnSeconds);
+    penalty[StreetGraph::U_TURN] = Cost::delay(m_options.uTurnSeconds);
+
+    bool found = false;
+    switch (m_options.queue)
+    {
+      case RouterOptions::BINARY_HEAP:
+        found = aStarTurns(snap, startNode, endNode, startLabel, cost, penalty, searchSpace.binaryHeap, endLabel);
+        searchSpace.binaryHeap.clear();
+        break;
+      case RouterOptions::FOUR_ARY_HEAP:
+        found = aStarTurns(snap, startNode, endNode, startLabel, cost, penalty, searchSpace.fourAryHeap, endLabel);
+        searchSpace.fourAryHeap.clear();
+        break;
+      case RouterOptions::RADIX_HEAP:
+        searchSpace.radixHeap.setScale(Cost::kRadixScale);
+        found = aStarTurns(snap, startNode, endNode, startLabel, cost, penalty, searchSpace.radixHeap, endLabel);
+        searchSpace.radixHeap.clear();
+        break;
+    }
+    return found;
+}
+
+// Which way a route turns at a junction depends on the edge it arrived by,
+// so this search settles chains rather than junctions: a chain's label is
+// the cost of having driven it to its far end, and going on from there costs
+// the turn onto the next chain as well as that chain.  The chains are the
+// edge-based graph, with the turns inside them counted in advance, so it is
+// no bigger than the junction graph's edges.  The end is reached at the end
+// of a chain or part way along one, and the search stops once nothing left
+// in the queue can beat the best way found to it.
+template <typename Cost, typename Queue>
+bool PointToPointRouterImpl::aStarTurns(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+    const Cost& cost, const double penalty[4], Queue& openSet, double& endLabel) const
+{
+    const StreetGraph& g = *snap.graph;
+    SearchSpace& space = searchSpace;
+
+    space.endVia = Via();
+    space.endPrev = -1;
+    if (startNode == endNode) {
+        endLabel = startLabel;
+        return true;
+    }
+
+    int endChain[2] = { -1, -1 };
+    int endPos[2] = { -1, -1 };
+    if (!g.junction[endNode]) {
+        for (int k = 0; k < 2; k++) {
+            int in = g.edgeTwin[g.firstEdge[endNode] + k];
+            endChain[k] = g.edgeChain[in];
+            endPos[k] = g.edgeChainPos[in];
+        }
+    }
+
+    // past the chains, the search space keeps a bound for each junction
+    int numChains = g.numChains();
+    double maxPenalty = *max_element(penalty, penalty + 4);
+
+    double best = numeric_limits<double>::infinity();
+    auto reachEnd = [&](double label, int chain, int from, int to, int prev) {
+        if (label < best) {
+            best = label;
+            space.endVia.chain = chain;
+            space.endVia.from = from;
+            space.endVia.to = to;
+            space.endPrev = prev;
+        }
+    };
+
+    // drive a chain from position from, having driven prev before it
+    auto follow = [&](int chain, int from, int target, double length, double label, int prev) {
+        for (int k = 0; k < 2; k++) {
+            if (endChain[k] == chain && endPos[k] >= from) {
+                double atEnd = walkChainTurns(snap, cost, penalty, chain, from, endPos[k] + 1, length, label);
+                reachEnd(atEnd, chain, from, endPos[k] + 1, prev);
+            }
+        }
+        // driving it can only add to label
+        int at = numChains + target;
+        double bound = min(space.g(chain), space.g(at));
+        if (label >= bound && target != endNode)
+            return;
+        int size = g.chainSize(chain);
+        label = walkChainTurns(snap, cost, penalty, chain, from, size, length, label);
+        if (target == endNode)
+            reachEnd(label, chain, from, size, prev);
+        if (label < bound) {
+            space.touch(chain);
+            space.gScore[chain] = label;
+            space.cameFrom[chain].chain = prev;
+            space.cameFrom[chain].from = from;
+            space.cameFrom[chain].to = size;
+            openSet.push(chain, label + cost.h(target));
+            if (label + maxPenalty < space.g(at)) {
+                space.touch(at);
+                space.gScore[at] = label + maxPenalty;
+            }
+        }
+    };
+
+    // nothing is turned from at the start
+    bool atJunction = g.junction[startNode];
+    if (atJunction && !g.incomplete.empty() && g.incomplete[startNode])
+        space.missing.push_back(startNode);
+    for (int e = g.firstEdge[startNode]; e != g.firstEdge[startNode + 1]; e++) {
+        int target;
+        double length;
+        g.chain(g.edgeChain[e], target, length);
+        follow(g.edgeChain[e], atJunction ? 0 : g.edgeChainPos[e], target, length, startLabel, -1);
+    }
+
+    const CancellationToken* token = CancellationScope::current();
+    int current;
+    while (openSet.pop(current)) {
+        if (token != nullptr && token->cancelled())
+            return false;
+        if (space.closed[current])
+            continue;
+        int in = g.chainEdge(current, g.chainSize(current) - 1);
+        int junction = g.edgeTarget[in];
+        double label = space.gScore[current];
+        if (label + cost.h(junction) >= best)
+            break;
+        space.closed[current] = true;
+
+        // A chain that gets to a junction costing more than another one does,
+        // by more than any turn costs, can't lead anywhere better than the
+        // other will.  Each junction's bound is what its cheapest chain in so
+        // far costs, plus the dearest turn.
+        int at = numChains + junction;
+        if (label >= space.g(at))
+            continue;
+
+        if (!space.closed[at]) {
+            space.closed[at] = true;
+            if (!g.incomplete.empty() && g.incomplete[junction])
+                space.missing.push_back(junction);
+        }
+
+        const unsigned char* turns = g.turnsFrom(in);
+        if (g.packed.empty()) {
+            int first = g.firstChain[junction];
+            for (int c = first; c != g.firstChain[junction + 1]; c++)
+                follow(c, 0, g.chainTarget[c], g.chainLength[c], label + penalty[turns[c - first]], current);
+        }
+        else {
+            PackedChains::Cursor chains(g.packed, junction);
+            int c, target;
+            double length;
+            for (int k = 0; chains.next(c, target, length); k++)
+                follow(c, 0, target, length, label + penalty[turns[k]], current);
+        }
+    }
+
+    if (best == numeric_limits<double>::infinity())
+        return false;
+    endLabel = best;
+    return true;
+}
+
+// The search settles junctions only, jumping along whole chains.  A start or
+// end that is an interior node is handled at the edges of the search: an
+// interior start seeds the junctions at either end of its chains, and an
+// interior end is reached part way along the chains that run through it.
+//
+// Travel times are FIFO, so a node's label can only get worse by leaving it
+// later, and the same label-setting search works for both cost models.
+template <typename Cost, typename Queue>
+bool PointToPointRouterImpl::aStar(const GraphSnapshot& snap, int startNode, int endNode, double startLabel,
+    const Cost& cost, Queue& openSet, double& endLabel) const
+{
+    const StreetGraph& g = *snap.graph;
+    SearchSpace& space = searchSpace;
+
+    if (startNode == endNode) {
+        endLabel = startLabel;
+        return true;
+    }
+
+    // The chains an interior end lies on, and the position of the member
+    // that arrives at it.  Those are the twins of the edges leaving it.
+    int endChain[2] = { -1, -1 };
+    int endPos[2] = { -1, -1 };
+    if (!g.junction[endNode]) {
+        for (int k = 0; k < 2; k++) {
+            int in = g.edgeTwin[g.firstEdge[endNode] + k];
+            endChain[k] = g.edgeChain[in];
+            endPos[k] = g.edgeChainPos[in];
+        }
+    }
+
+    auto relax = [&](int node, double label, int chain, int from, int to) {
+        if (label < space.g(node)) {
+            space.touch(node);
+            space.gScore[node] = label;
+            openSet.push(node, label + cost.h(node));
+            space.cameFrom[node].chain = chain;
+            space.cameFrom[node].from = from;
+            space.cameFrom[node].to = to;
+        }
+    };
+
+    // follow a chain from position from, stopping at the end node if it's on it
+    auto follow = [&](int chain, int from, int target, double length, double label) {
+        for (int k = 0; k < 2; k++) {
+            if (endChain[k] == chain && endPos[k] >= from)
+                relax(endNode, walkChain(snap, cost, chain, from, endPos[k] + 1, length, label), chain, from, endPos[k] + 1);
+        }
+        int size = g.chainSize(chain);
+        relax(target, walkChain(snap, cost, chain, from, size, length, label), chain, from, size);
+    };
+
+    space.touch(startNode);
+    if (g.junction[startNode]) {
+        space.gScore[startNode] = startLabel;
+        openSet.push(startNode, startLabel);
+    }
+    else {
+        space.closed[startNode] = true;
+        for (int e = g.firstEdge[startNode]; e != g.firstEdge[startNode + 1]; e++) {
+            int target;
+            double length;
+            g.chain(g.edgeChain[e], target, length);
+            follow(g.edgeChain[e], g.edgeChainPos[e], target, length, startLabel);
+        }
+    }
+
+    const CancellationToken* token = CancellationScope::current();
+    int current;
+    while (openSet.pop(current)) {
+        if (token != nullptr && token->cancelled())
+            return false;
+        if (current == endNode) {
+            // done
+            endLabel = space.gScore[current];
+            return true;
+        }
+
+        if (space.closed[current])
+            continue;
+        space.closed[current] = true;
+
+        // its tile isn't loaded, so it may have streets the search can't see
+        if (!g.incomplete.empty() && g.incomplete[current])
+            space.missing.push_back(current);
+
+        double label = space.gScore[current];
+        if (g.packed.empty()) {
+            for (int c = g.firstChain[current]; c != g.firstChain[current + 1]; c++)
+                follow(c, 0, g.chainTarget[c], g.chainLength[c], label);
+        }
+        else {
+            PackedChains::Cursor chains(g.packed, current);
+            int c, target;
+            double length;
+            while (chains.next(c, target, length))
+                follow(c, 0, target, length, label);
+        }
+    }
+
+    return false;
+}
+
+
+// The task routes with a copy of this router, which is only the map and the
+// options.
+future<RouteResult> PointToPointRouterImpl::generatePointToPointRouteAsync(const GeoCoord& start,
+    const GeoCoord& end, const CancellationToken& token) const
+{
+    PointToPointRouterImpl router = *this;
+    return Executor::shared().async<RouteResult>(token, [router, start, end](RouteResult& r) {
+        r.result = router.generatePointToPointRoute(start, end, r.route);
+    });
+}
+
+DeliveryResult PointToPointRouterImpl::findReachable(const GeoCoord& start, double maxMiles, ReachableArea& area,
+    bool withBoundary) const
+{
+    area.points.clear();
+    area.miles.clear();
+    area.boundary.clear();
+
+    // As in findRoute, a tiled map reads the tiles the search runs into and
+    // searches again, until it has all it needs.
+    vector<GeoCoord> needed;
+    needed.push_back(start);
+    vector<int> reached;
+    for (;;) {
+        shared_ptr<const GraphSnapshot> snapshot = m_sm->snapshotCovering(needed);
+        const GraphSnapshot& snap = *snapshot;
+
+        int startNode = snap.graph->findNode(start);
+        if (startNode < 0) return BAD_COORD;
+
+        reached.clear();
+        settleWithin(snap, startNode, maxMiles, reached, nullptr);
+        if (CancellationScope::cancelled())
+            return CANCELLED;
 
-        for (auto it = neighbors.begin(); it != neighbors.end(); it++) {
-            double cost = gScore[current] + getWeight(*it);
-            
-            if ((gScore.find(it->end) == gScore.end() && closedSet.find(it->end) == closedSet.end())
-                || cost < gScore[it->end]) {
-                // not in open or closed
-                gScore[it->end] = cost;
-                double priority = gScore[it->end] + h(it->end, end);
-                openSet.emplace(priority, it->end);
-                cameFrom[it->end] = *it;
+        if (searchSpace.missing.empty()) {
+            const StreetGraph& g = *snap.graph;
+            sort(reached.begin(), reached.end(), [](int a, int b) {
+                return searchSpace.gScore[a] < searchSpace.gScore[b];
+            });
+            for (int node : reached) {
+                area.points.push_back(g.coords[node]);
+                area.miles.push_back(searchSpace.gScore[node]);
             }
+            break;
         }
+        for (int node : searchSpace.missing)
+            needed.push_back(snap.graph->coords[node]);
     }
 
-    return NO_ROUTE;
+    if (withBoundary && !area.points.empty()) {
+        // Andrew's monotone chain: the lower hull left to right, then the
+        // upper hull right to left
+        vector<const GeoCoord*> sorted;
+        for (const GeoCoord& gc : area.points)
+            sorted.push_back(&gc);
+        sort(sorted.begin(), sorted.end(), [](const GeoCoord* a, const GeoCoord* b) {
+            return a->longitude < b->longitude || (a->longitude == b->longitude && a->latitude < b->latitude);
+        });
+        auto turn = [](const GeoCoord* o, const GeoCoord* a, const GeoCoord* b) {
+            return (a->longitude - o->longitude) * (b->latitude - o->latitude)
+                - (a->latitude - o->latitude) * (b->longitude - o->longitude);
+        };
+        vector<const GeoCoord*> hull;
+        for (int pass = 0; pass < 2; pass++) {
+            size_t lower = hull.size();
+            for (const GeoCoord* p : sorted) {
+                while (hull.size() >= lower + 2 && turn(hull[hull.size() - 2], hull.back(), p) <= 0)
+                    hull.pop_back();
+                hull.push_back(p);
+            }
+            hull.pop_back();    // it starts the other half
+            reverse(sorted.begin(), sorted.end());
+        }
+        if (hull.empty())       // a single point
+            hull.push_back(sorted[0]);
+        for (const GeoCoord* p : hull)
+            area.boundary.push_back(*p);
+    }
+    return DELIVERY_SUCCESS;
 }
 
+DeliveryResult PointToPointRouterImpl::findReachable(const vector<GeoCoord>& starts, double maxMiles,
+    vector<ReachableArea>& areas, bool withBoundary) const
+{
+    areas.assign(starts.size(), ReachableArea());
 
+    // Each thread searches in its own searchSpace.
+    vector<DeliveryResult> results(starts.size(), DELIVERY_SUCCESS);
+    Executor::shared().parallelFor(starts.size(), [&](size_t k) {
+        results[k] = findReachable(starts[k], maxMiles, areas[k], withBoundary);
+    });
+
+    for (DeliveryResult result : results) {
+        if (result != DELIVERY_SUCCESS)
+            return result;
+    }
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult PointToPointRouterImpl::generateDistanceMatrix(const vector<GeoCoord>& sources,
+    const vector<GeoCoord>& targets, vector<vector<double>>& miles) const
+{
+    miles.assign(sources.size(), vector<double>(targets.size(), numeric_limits<double>::infinity()));
+
+    vector<DeliveryResult> results(sources.size(), DELIVERY_SUCCESS);
+    Executor::shared().parallelFor(sources.size(), [&](size_t k) {
+        results[k] = distancesFrom(sources[k], targets, miles[k]);
+    });
+
+    for (DeliveryResult result : results) {
+        if (result != DELIVERY_SUCCESS)
+            return result;
+    }
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult PointToPointRouterImpl::distancesFrom(const GeoCoord& source, const vector<GeoCoord>& targets,
+    vector<double>& miles) const
+{
+    vector<GeoCoord> needed(targets);
+    needed.push_back(source);
+    vector<int> targetNodes, reached;
+    for (;;) {
+        shared_ptr<const GraphSnapshot> snapshot = m_sm->snapshotCovering(needed);
+        const GraphSnapshot& snap = *snapshot;
+        const StreetGraph& g = *snap.graph;
+
+        int startNode = g.findNode(source);
+        if (startNode < 0) return BAD_COORD;
+        targetNodes.clear();
+        for (const GeoCoord& gc : targets) {
+            int node = g.findNode(gc);
+            if (node < 0) return BAD_COORD;
+            targetNodes.push_back(node);
+        }
+
+        reached.clear();
+        settleWithin(snap, startNode, numeric_limits<double>::infinity(), reached, &targetNodes);
+        if (CancellationScope::cancelled())
+            return CANCELLED;
+
+        if (searchSpace.missing.empty()) {
+            for (size_t j = 0; j < targetNodes.size(); j++)
+                miles[j] = searchSpace.g(targetNodes[j]);
+            return DELIVERY_SUCCESS;
+        }
+        for (int node : searchSpace.missing)
+            needed.push_back(g.coords[node]);
+    }
+}
+
+void PointToPointRouterImpl::settleWithin(const GraphSnapshot& snap, int startNode, double budget,
+    vector<int>& reached, const vector<int>* targets) const
+{
+    searchSpace.begin(snap.graph->numNodes());
+    switch (m_options.queue)
+    {
+      case RouterOptions::BINARY_HEAP:
+        settleWithin(snap, startNode, budget, searchSpace.binaryHeap, reached, targets);
+        searchSpace.binaryHeap.clear();
+        break;
+      case RouterOptions::FOUR_ARY_HEAP:
+        settleWithin(snap, startNode, budget, searchSpace.fourAryHeap, reached, targets);
+        searchSpace.fourAryHeap.clear();
+        break;
+      case RouterOptions::RADIX_HEAP:
+        searchSpace.radixHeap.setScale(DistanceCost::kRadixScale);
+        settleWithin(snap, startNode, budget, searchSpace.radixHeap, reached, targets);
+        searchSpace.radixHeap.clear();
+        break;
+    }
+}
+
+// Dijkstra's algorithm out from startNode, settling junctions in order and
+// jumping along chains as aStar does, but walking each chain a member at a
+// time so that its interior nodes are reached too.  An interior node is
+// reached from both ends of its chain and keeps the nearer.  Nothing past
+// the budget is queued, so the search ends when the queue runs dry.
+//
+// A target's label is final once it is no more than the label of the node
+// being settled, since everything reached after that is reached from further
+// away.  Labels only fall and settled labels only rise, so the targets are
+// checked off in the order given, each once.
+template <typename Queue>
+void PointToPointRouterImpl::settleWithin(const GraphSnapshot& snap, int startNode, double budget, Queue& openSet,
+    vector<int>& reached, const vector<int>* targets) const
+{
+    const StreetGraph& g = *snap.graph;
+    SearchSpace& space = searchSpace;
+    DistanceCost cost{ snap, startNode };
+
+    auto reach = [&](int node, double label) {
+        if (label >= space.g(node))
+            return false;
+        if (space.stamp[node] != space.current)
+            reached.push_back(node);
+        space.touch(node);
+        space.gScore[node] = label;
+        return true;
+    };
+
+    auto walk = [&](int chain, int from, double label) {
+        int size = g.chainSize(chain);
+        for (int pos = from; pos < size; pos++) {
+            int e = g.chainEdge(chain, pos);
+            if (snap.states.closed(e))
+                return;
+            label = cost.traverse(e, label);
+            if (label > budget)
+                return;
+            int node = g.edgeTarget[e];
+            if (reach(node, label) && pos + 1 == size)
+                openSet.push(node, label);
+        }
+    };
+
+    if (budget < 0)
+        return;
+    reach(startNode, 0);
+    if (g.junction[startNode])
+        openSet.push(startNode, 0);
+    else {
+        space.closed[startNode] = true;
+        for (int e = g.firstEdge[startNode]; e != g.firstEdge[startNode + 1]; e++)
+            walk(g.edgeChain[e], g.edgeChainPos[e], 0);
+    }
+
+    const CancellationToken* token = CancellationScope::current();
+    size_t finalTargets = 0;
+    int current;
+    while (openSet.pop(current)) {
+        if (token != nullptr && token->cancelled())
+            return;
+        if (space.closed[current])
+            continue;
+        space.closed[current] = true;
+
+        if (!g.incomplete.empty() && g.incomplete[current])
+            space.missing.push_back(current);
+
+        double label = space.gScore[current];
+        if (targets != nullptr) {
+            while (finalTargets < targets->size() && space.g((*targets)[finalTargets]) <= label)
+                finalTargets++;
+            if (finalTargets == targets->size())
+                return;
+        }
+        if (g.packed.empty()) {
+            for (int c = g.firstChain[current]; c != g.firstChain[current + 1]; c++)
+                walk(c, 0, label);
+        }
+        else {
+            PackedChains::Cursor chains(g.packed, current);
+            int c, target;
+            double length;
+            while (chains.next(c, target, length))
+                walk(c, 0, label);
+        }
+    }
+}
+
+double PointToPointRouterImpl::growTree(const GraphSnapshot& snap, int root, int goal, double stretch,
+    RouteTree& tree, const RouteTree* goalTree) const
+{
+    SearchSpace& space = tree.space;
+    space.begin(snap.graph->numNodes());
+    tree.settled.clear();
+    double goalLabel = numeric_limits<double>::infinity();
+    switch (m_options.queue)
+    {
+      case RouterOptions::BINARY_HEAP:
+        goalLabel = growTree(snap, root, goal, stretch, tree, goalTree, space.binaryHeap);
+        space.binaryHeap.clear();
+        break;
+      case RouterOptions::FOUR_ARY_HEAP:
+        goalLabel = growTree(snap, root, goal, stretch, tree, goalTree, space.fourAryHeap);
+        space.fourAryHeap.clear();
+        break;
+      case RouterOptions::RADIX_HEAP:
+        space.radixHeap.setScale(DistanceCost::kRadixScale);
+        goalLabel = growTree(snap, root, goal, stretch, tree, goalTree, space.radixHeap);
+        space.radixHeap.clear();
+        break;
+    }
+    return goalLabel;
+}
+
+// aStar toward goal that carries on once it's there, until what's left in the
+// queue is too long a way to goal.  Every node settled then has its distance
+// from root and its path in the tree.
+//
+// The second tree needs only the nodes of routes short enough, and every
+// node of such a route is in the first tree, whose distances from goal are
+// exact.  With those for the heuristic it goes nowhere else.
+template <typename Queue>
+double PointToPointRouterImpl::growTree(const GraphSnapshot& snap, int root, int goal, double stretch,
+    RouteTree& tree, const RouteTree* goalTree, Queue& openSet) const
+{
+    const StreetGraph& g = *snap.graph;
+    SearchSpace& space = tree.space;
+    DistanceCost cost{ snap, goal };
+    auto h = [&](int node) {
+        if (goalTree == nullptr)
+            return cost.h(node);
+        const SearchSpace& other = goalTree->space;
+        if (other.stamp[node] != other.current || !other.closed[node])
+            return numeric_limits<double>::infinity();
+        return other.gScore[node];
+    };
+
+    int goalChain[2] = { -1, -1 };
+    int goalPos[2] = { -1, -1 };
+    if (!g.junction[goal]) {
+        for (int k = 0; k < 2; k++) {
+            int in = g.edgeTwin[g.firstEdge[goal] + k];
+            goalChain[k] = g.edgeChain[in];
+            goalPos[k] = g.edgeChainPos[in];
+        }
+    }
+
+    auto relax = [&](int node, double label, int chain, int from, int to) {
+        double toGoal = h(node);
+        if (label < space.g(node) && toGoal != numeric_limits<double>::infinity()) {
+            space.touch(node);
+            space.gScore[node] = label;
+            openSet.push(node, label + toGoal);
+            space.cameFrom[node].chain = chain;
+            space.cameFrom[node].from = from;
+            space.cameFrom[node].to = to;
+        }
+    };
+
+    auto follow = [&](int chain, int from, int target, double length, double label) {
+        for (int k = 0; k < 2; k++) {
+            if (goalChain[k] == chain && goalPos[k] >= from)
+                relax(goal, walkChain(snap, cost, chain, from, goalPos[k] + 1, length, label), chain, from, goalPos[k] + 1);
+        }
+        int size = g.chainSize(chain);
+        relax(target, walkChain(snap, cost, chain, from, size, length, label), chain, from, size);
+    };
+
+    space.touch(root);
+    space.gScore[root] = 0;
+    if (g.junction[root])
+        openSet.push(root, h(root));
+    else {
+        space.closed[root] = true;
+        tree.settled.push_back(root);
+        for (int e = g.firstEdge[root]; e != g.firstEdge[root + 1]; e++) {
+            int target;
+            double length;
+            g.chain(g.edgeChain[e], target, length);
+            follow(g.edgeChain[e], g.edgeChainPos[e], target, length, 0);
+        }
+    }
+
+    const CancellationToken* token = CancellationScope::current();
+    double goalLabel = numeric_limits<double>::infinity();
+    double bound = numeric_limits<double>::infinity();
+    int current;
+    while (openSet.pop(current)) {
+        if (token != nullptr && token->cancelled())
+            return numeric_limits<double>::infinity();
+        if (space.closed[current])
+            continue;
+        double label = space.gScore[current];
+        if (label + h(current) > bound)
+            break;
+        space.closed[current] = true;
+        tree.settled.push_back(current);
+
+        if (!g.incomplete.empty() && g.incomplete[current])
+            space.missing.push_back(current);
+
+        if (current == goal) {
+            goalLabel = label;
+            bound = label * (1 + stretch);
+        }
+        if (!g.junction[current])
+            continue;
+        if (g.packed.empty()) {
+            for (int c = g.firstChain[current]; c != g.firstChain[current + 1]; c++)
+                follow(c, 0, g.chainTarget[c], g.chainLength[c], label);
+        }
+        else {
+            PackedChains::Cursor chains(g.packed, current);
+            int c, target;
+            double length;
+            while (chains.next(c, target, length))
+                follow(c, 0, target, length, label);
+        }
+    }
+    return goalLabel;
+}
+
+// Alternatives by via node: a route from start to some node v on the way and
+// on from v to end, each part a shortest route, is found by looking v up in
+// the trees grown out of start and (backwards) out of end.  Any node settled
+// in both is a candidate, and a whole set of them comes from the one pair of
+// searches.  Candidates are tried best first -- short, and sharing little of
+// the shortest route -- and kept if they
+//
+//   are no longer than the shortest route by more than maxStretch,
+//   share no more than maxShared with any route kept before them, and
+//   pass a test of local optimality: the part from localOptimality before v
+//   to localOptimality after it must be a shortest route, which a route
+//   going out of its way to pass through v is not.
+//
+// All of it is measured in the searches' cost, which is length but for
+// segments with cost overrides.
+//
+// Streets are the same length both ways, so end's tree is grown forwards and
+// its paths are driven backwards.
+DeliveryResult PointToPointRouterImpl::generateAlternativeRoutes(const GeoCoord& start, const GeoCoord& end, int k,
+    vector<Route>& routes, const AlternativeRouteOptions& options) const
+{
+    routes.clear();
+
+    // how many candidates get as far as the local optimality test, which is
+    // a search of its own
+    const int kMaxTested = 64;
+
+    RouteTree& fromStart = routeTrees[0];
+    RouteTree& fromEnd = routeTrees[1];
+
+    // As in findRoute, a tiled map reads the tiles the searches run into
+    // and searches again.
+    vector<GeoCoord> needed;
+    needed.push_back(start);
+    needed.push_back(end);
+    for (;;) {
+        shared_ptr<const GraphSnapshot> snapshot = m_sm->snapshotCovering(needed);
+        const GraphSnapshot& snap = *snapshot;
+        const StreetGraph& g = *snap.graph;
+
+        int startNode = g.findNode(start);
+        int endNode = g.findNode(end);
+        if (startNode < 0 || endNode < 0) return BAD_COORD;
+
+        if (startNode == endNode) {
+            routes.emplace_back();
+            routes.back().m_snapshot = snapshot;
+            return DELIVERY_SUCCESS;
+        }
+
+        double stretch = max(0.0, options.maxStretch);
+        double shortest = growTree(snap, startNode, endNode, stretch, fromStart, nullptr);
+        bool found = shortest != numeric_limits<double>::infinity();
+        if (found)
+            growTree(snap, endNode, startNode, stretch, fromEnd, &fromStart);
+        if (CancellationScope::cancelled())
+            return CANCELLED;
+        if (!fromStart.space.missing.empty() || (found && !fromEnd.space.missing.empty())) {
+            for (int node : fromStart.space.missing)
+                needed.push_back(g.coords[node]);
+            if (found)
+                for (int node : fromEnd.space.missing)
+                    needed.push_back(g.coords[node]);
+            continue;
+        }
+        if (!found)
+            return NO_ROUTE;
+
+        routes.emplace_back();
+        reconstructPath(snapshot, fromStart.space.cameFrom, startNode, endNode, routes.back());
+        if (k <= 0)
+            return DELIVERY_SUCCESS;
+
+        // How far each node's tree path runs along a shortest route: all of
+        // it if the node is on one (the trees agree on its distance), else as
+        // far as its parent's does.  Parents are settled before children.
+        double tie = shortest * 1e-9;
+        for (RouteTree* tree : { &fromStart, &fromEnd }) {
+            const RouteTree& other = tree == &fromStart ? fromEnd : fromStart;
+            if (static_cast<int>(tree->shared.size()) < g.numNodes())
+                tree->shared.resize(g.numNodes());
+            for (int node : tree->settled) {
+                double label = tree->space.gScore[node];
+                const Via& via = tree->space.cameFrom[node];
+                if (other.space.g(node) + label <= shortest + tie)
+                    tree->shared[node] = label;
+                else if (via.chain < 0)
+                    tree->shared[node] = 0;
+                else
+                    tree->shared[node] = tree->shared[g.edgeSource[g.chainEdge(via.chain, via.from)]];
+            }
+        }
+
+        // The candidates, scored the usual way: twice the cost plus what's shared.
+        struct Candidate {
+            double score;
+            int node;
+        };
+        vector<Candidate> candidates;
+        double maxLength = shortest * (1 + stretch);
+        double maxShared = shortest * options.maxShared;
+        for (int node : fromStart.settled) {
+            if (node == startNode || node == endNode || !g.junction[node])
+                continue;
+            const SearchSpace& back = fromEnd.space;
+            if (back.stamp[node] != back.current || !back.closed[node])
+                continue;
+            double length = fromStart.space.gScore[node] + back.gScore[node];
+            double shared = fromStart.shared[node] + fromEnd.shared[node];
+            if (length <= maxLength && shared <= maxShared)
+                candidates.push_back(Candidate{ 2 * length + shared, node });
+        }
+        sort(candidates.begin(), candidates.end(),
+            [](const Candidate& a, const Candidate& b) { return a.score < b.score; });
+
+        // each route's edges, sorted, to measure how much a candidate shares with it
+        vector<vector<int>> kept(1, routes[0].m_edges);
+        sort(kept[0].begin(), kept[0].end());
+
+        Route toEnd;
+        vector<int> nodes;
+        int tested = 0;
+        for (const Candidate& c : candidates) {
+            if (static_cast<int>(routes.size()) > k || tested == kMaxTested)
+                break;
+
+            // start to the via node, then its path in end's tree driven backwards
+            Route via;
+            reconstructPath(snapshot, fromStart.space.cameFrom, startNode, c.node, via);
+            size_t at = via.m_edges.size();
+            reconstructPath(snapshot, fromEnd.space.cameFrom, endNode, c.node, toEnd);
+            for (auto e = toEnd.m_edges.rbegin(); e != toEnd.m_edges.rend(); ++e)
+                via.m_edges.push_back(g.edgeTwin[*e]);
+            via.m_distance += toEnd.m_distance;
+
+            // the two halves can meet before the via node, making a loop
+            nodes.clear();
+            nodes.push_back(startNode);
+            for (int e : via.m_edges)
+                nodes.push_back(g.edgeTarget[e]);
+            sort(nodes.begin(), nodes.end());
+            if (adjacent_find(nodes.begin(), nodes.end()) != nodes.end())
+                continue;
+
+            bool distinct = true;
+            for (const vector<int>& edges : kept) {
+                double shared = 0;
+                for (int e : via.m_edges)
+                    if (binary_search(edges.begin(), edges.end(), e))
+                        shared += snap.edgeCost(e);
+                if (shared > maxShared) {
+                    distinct = false;
+                    break;
+                }
+            }
+            if (!distinct)
+                continue;
+
+            // Local optimality, from the nodes localOptimality either side of
+            // the via node (or the ends).  Compressed lengths are a little
+            // long, so a little is allowed for.
+            tested++;
+            double reach = shortest * options.localOptimality;
+            size_t first = at, last = at;
+            double around = 0;
+            for (double before = 0; first > 0 && before < reach; first--)
+                before += snap.edgeCost(via.m_edges[first - 1]);
+            for (double after = 0; last < via.m_edges.size() && after < reach; last++)
+                after += snap.edgeCost(via.m_edges[last]);
+            for (size_t i = first; i < last; i++)
+                around += snap.edgeCost(via.m_edges[i]);
+            int from = g.edgeSource[via.m_edges[first]];
+            int to = g.edgeTarget[via.m_edges[last - 1]];
+            double direct;
+            bool reached = search(snap, from, to, 0, DistanceCost{ snap, to }, direct);
+            if (!reached && CancellationScope::cancelled())
+                return CANCELLED;
+            if (!reached || direct * (1 + 1e-3) < around)
+                continue;
+
+            kept.push_back(via.m_edges);
+            sort(kept.back().begin(), kept.back().end());
+            routes.push_back(move(via));
+        }
+        return DELIVERY_SUCCESS;
+    }
+}
 
 //******************** PointToPointRouter functions ***************************
 
@@ -124,7 +1293,12 @@ DeliveryResult PointToPointRouterImpl::generatePointToPointRoute(
 
 PointToPointRouter::PointToPointRouter(const StreetMap* sm)
 {
-    m_impl = new PointToPointRouterImpl(sm);
+    m_impl = new PointToPointRouterImpl(sm, RouterOptions());
+}
+
+PointToPointRouter::PointToPointRouter(const StreetMap* sm, const RouterOptions& options)
+{
+    m_impl = new PointToPointRouterImpl(sm, options);
 }
 
 PointToPointRouter::~PointToPointRouter()
@@ -138,5 +1312,135 @@ DeliveryResult PointToPointRouter::generatePointToPointRoute(
         list<StreetSegment>& route,
         double& totalDistanceTravelled) const
 {
-    return m_impl->generatePointToPointRoute(start, end, route, totalDistanceTravelled);
+    Route found;
+    DeliveryResult result = m_impl->generatePointToPointRoute(start, end, found);
+    if (result == DELIVERY_SUCCESS) {
+        found.getSegments(route);
+        totalDistanceTravelled = found.distance();
+    }
+    return result;
+}
+
+DeliveryResult PointToPointRouter::generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double departureTime,
+        list<StreetSegment>& route,
+        double& totalDistanceTravelled,
+        double& arrivalTime) const
+{
+    Route found;
+    DeliveryResult result = m_impl->generatePointToPointRoute(start, end, departureTime, found, arrivalTime);
+    if (result == DELIVERY_SUCCESS) {
+        found.getSegments(route);
+        totalDistanceTravelled = found.distance();
+    }
+    return result;
+}
+
+DeliveryResult PointToPointRouter::generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        Route& route) const
+{
+    return m_impl->generatePointToPointRoute(start, end, route);
+}
+
+DeliveryResult PointToPointRouter::generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double departureTime,
+        Route& route,
+        double& arrivalTime) const
+{
+    return m_impl->generatePointToPointRoute(start, end, departureTime, route, arrivalTime);
+}
+
+DeliveryResult PointToPointRouter::findReachable(
+        const GeoCoord& start,
+        double maxMiles,
+        ReachableArea& area,
+        bool withBoundary) const
+{
+    return m_impl->findReachable(start, maxMiles, area, withBoundary);
+}
+
+DeliveryResult PointToPointRouter::findReachable(
+        const vector<GeoCoord>& starts,
+        double maxMiles,
+        vector<ReachableArea>& areas,
+        bool withBoundary) const
+{
+    return m_impl->findReachable(starts, maxMiles, areas, withBoundary);
+}
+
+DeliveryResult PointToPointRouter::generateAlternativeRoutes(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        int k,
+        vector<Route>& routes,
+        const AlternativeRouteOptions& options) const
+{
+    return m_impl->generateAlternativeRoutes(start, end, k, routes, options);
+}
+
+DeliveryResult PointToPointRouter::generateDistanceMatrix(
+        const vector<GeoCoord>& sources,
+        const vector<GeoCoord>& targets,
+        vector<vector<double>>& miles) const
+{
+    return m_impl->generateDistanceMatrix(sources, targets, miles);
+}
+
+future<RouteResult> PointToPointRouter::generatePointToPointRouteAsync(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        const CancellationToken& token) const
+{
+    return m_impl->generatePointToPointRouteAsync(start, end, token);
+}
+
+//******************** Route functions ****************************************
+
+void Route::clear()
+{
+    m_snapshot.reset();
+    m_edges.clear();
+    m_distance = 0;
+}
+
+StreetSegment Route::segment(size_t i) const
+{
+    return m_snapshot->graph->segment(m_edges[i]);
+}
+
+double Route::length(size_t i) const
+{
+    return m_snapshot->graph->length(m_edges[i]);
+}
+
+double Route::angle(size_t i) const
+{
+    return m_snapshot->graph->angle(m_edges[i]);
+}
+
+const string& Route::streetName(size_t i) const
+{
+    const StreetGraph& g = *m_snapshot->graph;
+    return g.names[g.edgeName[m_edges[i]]];
+}
+
+void Route::getSegments(list<StreetSegment>& segments) const
+{
+    // the list nodes segments already has are reused, strings and all
+    list<StreetSegment> spare;
+    spare.splice(spare.end(), segments);
+    for (int e : m_edges) {
+        if (spare.empty())
+            segments.push_back(m_snapshot->graph->segment(e));
+        else {
+            m_snapshot->graph->segment(e, spare.front());
+            segments.splice(segments.end(), spare, spare.begin());
+        }
+    }
 }
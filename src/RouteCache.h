@@ -0,0 +1,248 @@
+// RouteCache.h
+
+// Shortest routes kept by (start node, end node) for the version of the map
+// they were found in, so a leg driven again and again is searched once.  The
+// entries are split over shards by key, each with its own lock and its own
+// least-recently-used list, so routers on different threads seldom wait on
+// one another.  Each shard keeps to its share of the byte budget by dropping
+// its least recently used routes.
+//
+// Each route remembers the version of the map it was found in.  Asked about a
+// newer version, the cache checks the route against what has changed since:
+// it is dropped if any of its edges is now closed or dearer, or if a segment
+// made cheaper since could be on a shorter route, going by the same lower
+// bound the router's heuristic uses.  Anything else an update touched can
+// only have got dearer, so the route is still the shortest.  A route found
+// before the map's graph was replaced, or before the list of cheaper segments
+// was cut short, can't be checked and is dropped.  Asked about an older
+// version, by a search still holding on to it, the cache doesn't answer.
+//
+// A tiled map builds a new graph as tiles come and go, numbering its edges
+// afresh but keeping its nodes' numbers.  A route found in another graph has
+// its edges found again from its nodes; if one of the tiles it crosses isn't
+// loaded, the cache doesn't answer but keeps the route.
+
+#ifndef ROUTECACHE_INCLUDED
+#define ROUTECACHE_INCLUDED
+
+#include "provided.h"
+#include "StreetGraph.h"
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+
+class RouteCache
+{
+public:
+    RouteCache(size_t maxBytes, int numShards = 16)
+     : m_numShards(numShards < 1 ? 1 : numShards),
+       m_shards(new Shard[m_numShards]),
+       m_shardBytes(maxBytes / m_numShards)
+    {}
+
+      // The route's edges, its distance in miles and its cost, if it's kept
+      // and still the shortest in snap.
+    bool find(const GraphSnapshot& snap, int start, int end,
+        std::vector<int>& edges, double& distance, double& cost)
+    {
+        unsigned long long key = keyOf(start, end);
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end() || it->second->version > snap.version) {
+            shard.misses++;
+            return false;
+        }
+        Entry& entry = *it->second;
+        if (entry.version < snap.version) {
+            if (entry.version >= snap.cheaperSince && entry.graphVersion != snap.graphVersion
+                && !relink(snap, entry)) {
+                shard.misses++;
+                return false;
+            }
+            double newCost;
+            if (!stillShortest(snap, start, end, entry, newCost)) {
+                shard.bytes -= bytesFor(entry.edges.size());
+                shard.recent.erase(it->second);
+                shard.index.erase(it);
+                shard.misses++;
+                shard.invalidations++;
+                return false;
+            }
+            entry.version = snap.version;
+            entry.cost = newCost;
+        }
+        shard.recent.splice(shard.recent.begin(), shard.recent, it->second);
+        edges = it->second->edges;
+        distance = it->second->distance;
+        cost = it->second->cost;
+        shard.hits++;
+        return true;
+    }
+
+    void insert(const GraphSnapshot& snap, int start, int end,
+        const std::vector<int>& edges, double distance, double cost)
+    {
+        size_t bytes = bytesFor(edges.size());
+        if (bytes > m_shardBytes)
+            return;
+        unsigned long long key = keyOf(start, end);
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        if (shard.index.count(key))
+            return;
+        while (shard.bytes + bytes > m_shardBytes) {
+            const Entry& oldest = shard.recent.back();
+            shard.bytes -= bytesFor(oldest.edges.size());
+            shard.index.erase(oldest.key);
+            shard.recent.pop_back();
+            shard.evictions++;
+        }
+        std::vector<int> nodes(1, start);
+        if (!edges.empty()) {
+            nodes.clear();
+            for (int e : edges)
+                nodes.push_back(snap.graph->edgeSource[e]);
+            nodes.push_back(snap.graph->edgeTarget[edges.back()]);
+        }
+        shard.recent.push_front(Entry{ key, snap.version, snap.graphVersion, edges, nodes, distance, cost });
+        shard.index[key] = shard.recent.begin();
+        shard.bytes += bytes;
+    }
+
+    RouteCacheStats stats() const
+    {
+        RouteCacheStats s;
+        for (int i = 0; i < m_numShards; i++) {
+            Shard& shard = m_shards[i];
+            std::lock_guard<std::mutex> lock(shard.lock);
+            s.hits += shard.hits;
+            s.misses += shard.misses;
+            s.evictions += shard.evictions;
+            s.invalidations += shard.invalidations;
+            s.entries += shard.index.size();
+            s.bytes += shard.bytes;
+        }
+        return s;
+    }
+
+    RouteCache(const RouteCache&) = delete;
+    RouteCache& operator=(const RouteCache&) = delete;
+
+private:
+    struct Entry {
+        unsigned long long key;
+        unsigned long long version;         // of the map it's known to be shortest in
+        unsigned long long graphVersion;    // of the graph edges are in
+        std::vector<int> edges;
+        std::vector<int> nodes;             // the route's nodes, start to end
+        double distance;
+        double cost;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::list<Entry> recent;            // most recently used first
+        std::unordered_map<unsigned long long, std::list<Entry>::iterator> index;
+        size_t bytes = 0;
+        unsigned long long hits = 0;
+        unsigned long long misses = 0;
+        unsigned long long evictions = 0;
+        unsigned long long invalidations = 0;
+    };
+
+      // an entry's list and index nodes, besides the entry itself
+    static constexpr size_t kNodeOverhead = 64;
+      // relative error allowed for a route's cost summed edge by edge
+    static constexpr double kCostSlack = 1e-9;
+
+    int m_numShards;
+    std::unique_ptr<Shard[]> m_shards;
+    size_t m_shardBytes;
+
+    static unsigned long long keyOf(int start, int end)
+    {
+        return static_cast<unsigned long long>(static_cast<unsigned int>(start)) << 32 | static_cast<unsigned int>(end);
+    }
+
+    Shard& shardFor(unsigned long long key) const
+    {
+        unsigned long long h = key * 0x9e3779b97f4a7c15ull;
+        return m_shards[(h >> 32) % m_numShards];
+    }
+
+    static size_t bytesFor(size_t numEdges)
+    {
+        return sizeof(Entry) + (2 * numEdges + 1) * sizeof(int) + kNodeOverhead;
+    }
+
+      // Finds entry's edges again in snap's graph from its nodes, taking the
+      // cheapest open edge between each two, or a closed one if all are.
+      // False if two of them aren't joined in snap's graph.
+    static bool relink(const GraphSnapshot& snap, Entry& entry)
+    {
+        const StreetGraph& g = *snap.graph;
+        std::vector<int> edges;
+        double distance = 0;
+        for (size_t i = 0; i + 1 < entry.nodes.size(); i++) {
+            int from = entry.nodes[i];
+            if (from >= g.numNodes())
+                return false;
+            int best = -1;
+            for (int e = g.firstEdge[from]; e != g.firstEdge[from + 1]; e++) {
+                if (g.edgeTarget[e] != entry.nodes[i + 1] || snap.states.closed(e))
+                    continue;
+                if (best < 0 || snap.edgeCost(e) < snap.edgeCost(best))
+                    best = e;
+            }
+            for (int e = g.firstEdge[from]; e != g.firstEdge[from + 1] && best < 0; e++) {
+                if (g.edgeTarget[e] == entry.nodes[i + 1])
+                    best = e;
+            }
+            if (best < 0)
+                return false;
+            edges.push_back(best);
+            distance += g.length(best);
+        }
+        entry.edges.swap(edges);
+        entry.distance = distance;
+        entry.graphVersion = snap.graphVersion;
+        return true;
+    }
+
+      // Whether entry, a route from start to end found in an older version
+      // than snap, is still the shortest in snap, and if so its cost there.
+    static bool stillShortest(const GraphSnapshot& snap, int start, int end, const Entry& entry, double& cost)
+    {
+        if (entry.version < snap.cheaperSince)
+            return false;
+
+        cost = 0;
+        for (int e : entry.edges) {
+            if (snap.states.closed(e))
+                return false;
+            cost += snap.edgeCost(e);
+        }
+        if (cost > entry.cost * (1 + kCostSlack))
+            return false;
+
+        // Every other route's cost is at least what it was, unless it uses a
+        // segment made cheaper since, in which case it costs at least the
+        // crow-flies bound to the segment, the segment, and the bound on.
+        const GeoCoord& from = snap.graph->coords[start];
+        const GeoCoord& to = snap.graph->coords[end];
+        for (const CheaperSegment* c = snap.cheaper.get(); c != nullptr && c->version > entry.version;
+             c = c->older.get()) {
+            double forward = distanceEarthMiles(from, c->start) + distanceEarthMiles(c->end, to);
+            double backward = distanceEarthMiles(from, c->end) + distanceEarthMiles(c->start, to);
+            double bound = snap.heuristicScale * std::min(forward, backward) + c->cost;
+            if (bound < cost * (1 - kCostSlack))
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif // ROUTECACHE_INCLUDED
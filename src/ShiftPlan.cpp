@@ -0,0 +1,427 @@
+#include "provided.h"
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+using namespace std;
+
+class ShiftPlanImpl
+{
+public:
+    ShiftPlanImpl(const StreetMap* sm);
+    ~ShiftPlanImpl();
+    DeliveryResult start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries);
+    DeliveryResult start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries, double departureTime);
+    void advance(int count);
+    DeliveryResult insertStop(const DeliveryRequest& delivery);
+    DeliveryResult removeStop(int position);
+    void setRepairWindow(int stops) { m_repairWindow = max(0, stops); }
+    const vector<DeliveryRequest>& stops() const { return m_stops; }
+    int stopsMade() const { return m_made; }
+    double totalDistance() const { return m_distance; }
+    void getCommands(vector<DeliveryCommand>& commands) const;
+private:
+    const StreetMap* m_sm;
+    PointToPointRouter m_router;
+    DeliveryPlanner m_planner;
+
+    GeoCoord m_depot;
+    vector<DeliveryRequest> m_stops;
+
+    // m_legs[i] is the route to stop i from the one before it, or from the
+    // depot; m_legs[n], the last, is back to the depot.  There is always one
+    // more leg than there are stops, even when there are none.
+    vector<Route> m_legs;
+    int m_made;             // stops made so far, which are the first ones
+    int m_repairWindow;
+    double m_distance;
+
+    // For a plan started with a departure time, that time and when the driver
+    // reaches each stop, driving the legs at kMph.  Otherwise m_departure is
+    // NaN and the stops' time windows are left out of it.
+    double m_departure;
+    vector<double> m_arrivals;
+
+      // speed assumed on the legs when checking delivery windows, as the
+      // optimizer assumes for crow distance
+    static constexpr double kMph = 25;
+
+      // how many places to put a stop, the best by crow distance, are routed
+      // to choose between
+    static constexpr int kShortlist = 3;
+
+      // relocations tried after a change
+    static constexpr int kMaxRepairMoves = 4;
+
+    int numStops() const { return static_cast<int>(m_stops.size()); }
+
+      // stop i, or the depot for -1 and n
+    const GeoCoord& at(int i) const {
+        return (i < 0 || i == numStops()) ? m_depot : m_stops[i].location;
+    }
+
+    double crow(int i, int j) const {
+        return distanceEarthMiles(at(i), at(j));
+    }
+
+    bool timed() const { return !std::isnan(m_departure); }
+
+      // when the driver leaves stop i, or the depot for -1
+    double leaving(int i) const {
+        if (i < 0)
+            return m_departure;
+        return max(m_arrivals[i], m_stops[i].windowStart) + m_stops[i].serviceTime;
+    }
+
+      // Seconds late at stops[k] for each k, the driver having left the stop
+      // before the first at time leaving and driven legMiles[k] miles to each.
+    static double lateness(double leaving, const vector<const DeliveryRequest*>& stops,
+        const vector<double>& legMiles);
+
+      // Seconds late at the stops from position p on, as the plan is now.
+    double latenessFrom(int p) const;
+
+      // works out m_arrivals again, if the plan is timed
+    void schedule();
+
+      // Moves stop from to just before stop to (n for the end), if routing
+      // the three legs that change bears out that it's better: shorter, less
+      // the miles kLatenessPenalty puts on any change in lateness.  Returns
+      // where the stop is then, or -1 if it wasn't moved.
+    int relocate(int from, int to);
+
+      // tidies up the stops around position
+    void repair(int position);
+};
+
+ShiftPlanImpl::ShiftPlanImpl(const StreetMap* sm)
+ : m_sm(sm), m_router(sm), m_planner(sm), m_made(0), m_repairWindow(8), m_distance(0), m_departure(NAN)
+{
+    m_legs.resize(1);
+}
+
+ShiftPlanImpl::~ShiftPlanImpl()
+{
+}
+
+DeliveryResult ShiftPlanImpl::start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries)
+{
+    return start(depot, deliveries, NAN);
+}
+
+DeliveryResult ShiftPlanImpl::start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries,
+    double departureTime)
+{
+    vector<DeliveryRequest> ordered = deliveries;
+    if (!ordered.empty()) {
+        DeliveryOptimizer optimizer(m_sm);
+        double oldCrow, newCrow;
+        if (std::isnan(departureTime))
+            optimizer.optimizeDeliveryOrder(depot, ordered, oldCrow, newCrow);
+        else
+            optimizer.optimizeDeliveryOrder(depot, ordered, departureTime, oldCrow, newCrow);
+    }
+
+    vector<Route> legs(ordered.size() + 1);
+    double distance = 0;
+    for (size_t i = 0; i < legs.size(); i++) {
+        const GeoCoord& from = i == 0 ? depot : ordered[i - 1].location;
+        const GeoCoord& to = i == ordered.size() ? depot : ordered[i].location;
+        DeliveryResult result = m_router.generatePointToPointRoute(from, to, legs[i]);
+        if (result != DELIVERY_SUCCESS) return result;
+        distance += legs[i].distance();
+    }
+
+    m_depot = depot;
+    m_stops = move(ordered);
+    m_legs = move(legs);
+    m_made = 0;
+    m_distance = distance;
+    m_departure = departureTime;
+    m_arrivals.clear();
+    schedule();
+    return DELIVERY_SUCCESS;
+}
+
+double ShiftPlanImpl::lateness(double leaving, const vector<const DeliveryRequest*>& stops,
+    const vector<double>& legMiles)
+{
+    double late = 0;
+    for (size_t k = 0; k < stops.size(); k++) {
+        double arrival = leaving + legMiles[k] * 3600 / kMph;
+        late += max(0.0, arrival - stops[k]->windowEnd);
+        leaving = max(arrival, stops[k]->windowStart) + stops[k]->serviceTime;
+    }
+    return late;
+}
+
+double ShiftPlanImpl::latenessFrom(int p) const
+{
+    double late = 0;
+    for (int i = p; i < numStops(); i++)
+        late += max(0.0, m_arrivals[i] - m_stops[i].windowEnd);
+    return late;
+}
+
+void ShiftPlanImpl::schedule()
+{
+    if (std::isnan(m_departure))
+        return;
+    m_arrivals.resize(numStops());
+    for (int i = 0; i < numStops(); i++)
+        m_arrivals[i] = leaving(i - 1) + m_legs[i].distance() * 3600 / kMph;
+}
+
+void ShiftPlanImpl::advance(int count)
+{
+    m_made = min(numStops(), m_made + max(0, count));
+}
+
+// Cheapest insertion: every place the stop could go among those not yet made
+// is scored by crow distance, which costs next to nothing however long the
+// route, and only the best few are routed.  The winner's two legs replace the
+// one leg it breaks.  A timed plan adds kLatenessPenalty miles for every
+// second the stops end up later, reckoning the new legs by crow distance
+// until they're routed; that walks the stops after each place, so it costs
+// time in proportion to the route's length squared.
+DeliveryResult ShiftPlanImpl::insertStop(const DeliveryRequest& delivery)
+{
+    const GeoCoord& x = delivery.location;
+    bool withWindows = timed();
+
+    // the stops from position p on, preceded by delivery and reached along
+    // legs of in and out miles, then the legs there are now
+    vector<const DeliveryRequest*> after;
+    vector<double> afterMiles;
+    auto addedLateness = [&](int p, double in, double out) {
+        after.assign(1, &delivery);
+        afterMiles.assign(1, in);
+        for (int i = p; i < numStops(); i++) {
+            after.push_back(&m_stops[i]);
+            afterMiles.push_back(i == p ? out : m_legs[i].distance());
+        }
+        return lateness(leaving(p - 1), after, afterMiles) - latenessFrom(p);
+    };
+
+    vector<pair<double, int>> places;
+    for (int p = m_made; p <= numStops(); p++) {
+        double in = distanceEarthMiles(at(p - 1), x);
+        double out = distanceEarthMiles(x, at(p));
+        double added = in + out - crow(p - 1, p);
+        if (withWindows)
+            added += DeliveryOptimizer::kLatenessPenalty * addedLateness(p, in, out);
+        places.emplace_back(added, p);
+    }
+    int shortlist = min(static_cast<int>(places.size()), kShortlist);
+    partial_sort(places.begin(), places.begin() + shortlist, places.end());
+
+    int best = -1;
+    double bestAdded = 0, bestMiles = 0;
+    Route in, out, routeIn, routeOut;
+    DeliveryResult result = NO_ROUTE;
+    for (int k = 0; k < shortlist; k++) {
+        int p = places[k].second;
+        result = m_router.generatePointToPointRoute(at(p - 1), x, routeIn);
+        if (result == DELIVERY_SUCCESS)
+            result = m_router.generatePointToPointRoute(x, at(p), routeOut);
+        if (result == BAD_COORD)
+            return result;
+        if (result != DELIVERY_SUCCESS)
+            continue;
+        double miles = routeIn.distance() + routeOut.distance() - m_legs[p].distance();
+        double added = miles;
+        if (withWindows)
+            added += DeliveryOptimizer::kLatenessPenalty * addedLateness(p, routeIn.distance(), routeOut.distance());
+        if (best < 0 || added < bestAdded) {
+            best = p;
+            bestAdded = added;
+            bestMiles = miles;
+            swap(in, routeIn);
+            swap(out, routeOut);
+        }
+    }
+    if (best < 0)
+        return NO_ROUTE;
+
+    m_stops.insert(m_stops.begin() + best, delivery);
+    m_legs[best] = move(out);
+    m_legs.insert(m_legs.begin() + best, move(in));
+    m_distance += bestMiles;
+    schedule();
+    repair(best);
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult ShiftPlanImpl::removeStop(int position)
+{
+    if (position < m_made || position >= numStops())
+        return BAD_POSITION;
+
+    Route joined;
+    DeliveryResult result = m_router.generatePointToPointRoute(at(position - 1), at(position + 1), joined);
+    if (result != DELIVERY_SUCCESS) return result;
+
+    m_distance += joined.distance() - m_legs[position].distance() - m_legs[position + 1].distance();
+    m_stops.erase(m_stops.begin() + position);
+    m_legs.erase(m_legs.begin() + position);
+    m_legs[position] = move(joined);
+    schedule();
+    repair(min(position, numStops() - 1));
+    return DELIVERY_SUCCESS;
+}
+
+int ShiftPlanImpl::relocate(int from, int to)
+{
+    Route joined, in, out;
+    if (m_router.generatePointToPointRoute(at(from - 1), at(from + 1), joined) != DELIVERY_SUCCESS ||
+        m_router.generatePointToPointRoute(at(to - 1), at(from), in) != DELIVERY_SUCCESS ||
+        m_router.generatePointToPointRoute(at(from), at(to), out) != DELIVERY_SUCCESS)
+        return -1;
+    double change = joined.distance() + in.distance() + out.distance()
+                  - m_legs[from].distance() - m_legs[from + 1].distance() - m_legs[to].distance();
+    double score = change;
+    if (timed()) {
+        // the stops from the first that moves on, in their new order, and
+        // the legs to them
+        int first = min(from, to);
+        vector<const DeliveryRequest*> order;
+        vector<double> legMiles;
+        for (int i = first; i <= numStops(); i++) {
+            if (i == to) {
+                order.push_back(&m_stops[from]);
+                legMiles.push_back(in.distance());
+            }
+            if (i == numStops() || i == from)
+                continue;
+            order.push_back(&m_stops[i]);
+            legMiles.push_back(i == to ? out.distance() : i == from + 1 ? joined.distance() : m_legs[i].distance());
+        }
+        score += DeliveryOptimizer::kLatenessPenalty * (lateness(leaving(first - 1), order, legMiles) - latenessFrom(first));
+    }
+    if (score >= 0)
+        return -1;
+
+    DeliveryRequest stop = move(m_stops[from]);
+    m_legs[from + 1] = move(joined);
+    m_legs.erase(m_legs.begin() + from);
+    m_stops.erase(m_stops.begin() + from);
+    if (to > from)
+        to--;
+    m_legs[to] = move(out);
+    m_legs.insert(m_legs.begin() + to, move(in));
+    m_stops.insert(m_stops.begin() + to, move(stop));
+    m_distance += change;
+    schedule();
+    return to;
+}
+
+// A few relocations, each the one that saves most crow distance among the
+// stops within the repair window of the change.  Both the window and the
+// number of moves are fixed, so this takes as long for a long route as for
+// a short one.
+void ShiftPlanImpl::repair(int position)
+{
+    for (int moves = 0; moves < kMaxRepairMoves && m_repairWindow > 0; moves++) {
+        int lo = max(m_made, position - m_repairWindow);
+        int hi = min(numStops() - 1, position + m_repairWindow);
+        double bestGain = 1e-9;
+        int bestFrom = -1, bestTo = -1;
+        for (int j = lo; j <= hi; j++) {
+            double removed = crow(j - 1, j) + crow(j, j + 1) - crow(j - 1, j + 1);
+            for (int q = lo; q <= hi + 1; q++) {
+                if (q == j || q == j + 1)
+                    continue;
+                double gain = removed - (crow(q - 1, j) + crow(j, q) - crow(q - 1, q));
+                if (gain > bestGain) {
+                    bestGain = gain;
+                    bestFrom = j;
+                    bestTo = q;
+                }
+            }
+        }
+        if (bestFrom < 0)
+            break;
+        position = relocate(bestFrom, bestTo);
+        if (position < 0)
+            break;
+    }
+}
+
+void ShiftPlanImpl::getCommands(vector<DeliveryCommand>& commands) const
+{
+    commands.clear();
+    for (int i = m_made; i <= numStops(); i++) {
+        m_planner.getCommands(m_legs[i], commands);
+        if (i < numStops()) {
+            DeliveryCommand deliverCommand;
+            deliverCommand.initAsDeliverCommand(m_stops[i].item);
+            commands.push_back(deliverCommand);
+        }
+    }
+}
+
+//******************** ShiftPlan functions ************************************
+
+// These functions simply delegate to ShiftPlanImpl's functions.
+// You probably don't want to change any of this code.
+
+ShiftPlan::ShiftPlan(const StreetMap* sm)
+{
+    m_impl = new ShiftPlanImpl(sm);
+}
+
+ShiftPlan::~ShiftPlan()
+{
+    delete m_impl;
+}
+
+DeliveryResult ShiftPlan::start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries)
+{
+    return m_impl->start(depot, deliveries);
+}
+
+DeliveryResult ShiftPlan::start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries,
+    double departureTime)
+{
+    return m_impl->start(depot, deliveries, departureTime);
+}
+
+void ShiftPlan::advance(int count)
+{
+    m_impl->advance(count);
+}
+
+DeliveryResult ShiftPlan::insertStop(const DeliveryRequest& delivery)
+{
+    return m_impl->insertStop(delivery);
+}
+
+DeliveryResult ShiftPlan::removeStop(int position)
+{
+    return m_impl->removeStop(position);
+}
+
+void ShiftPlan::setRepairWindow(int stops)
+{
+    m_impl->setRepairWindow(stops);
+}
+
+const vector<DeliveryRequest>& ShiftPlan::stops() const
+{
+    return m_impl->stops();
+}
+
+int ShiftPlan::stopsMade() const
+{
+    return m_impl->stopsMade();
+}
+
+double ShiftPlan::totalDistance() const
+{
+    return m_impl->totalDistance();
+}
+
+void ShiftPlan::getCommands(vector<DeliveryCommand>& commands) const
+{
+    m_impl->getCommands(commands);
+}
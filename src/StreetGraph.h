@@ -0,0 +1,493 @@
+// StreetGraph.h
+
+// Node-indexed form of the street map.  StreetMapImpl builds a StreetGraph when
+// it loads a map file, and the router works with integer node and edge ids
+// instead of hashing GeoCoords on every step.
+
+#ifndef STREETGRAPH_INCLUDED
+#define STREETGRAPH_INCLUDED
+
+#include "provided.h"
+#include "ExpandableHashMap.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <utility>
+
+// Compressed form of what the router reads while it searches: the chains
+// leaving each junction, and every node's position for the heuristic
+// (MapLoadOptions::compressed).
+//
+// Nodes are taken in blocks of 16, which after a Hilbert or BFS renumbering
+// are close together on the map.  A junction's chains are a run of bytes: the
+// id of its first chain less the block's first chain, then two fields per
+// chain, its target's id less the junction's and its length in units of
+// kMilesPerUnit.  The ids are zigzag varints and the length is 16 bits; a
+// length too big for that is kLongChain, and the real one is kept aside.  A
+// run's start is found from its block's start plus a 16-bit offset.
+//
+// Positions are in units of kDegreesPerUnit, stored as 16-bit offsets from
+// their block's first node, or in full if the block is too spread out.
+//
+// Stored lengths are rounded up, with room for the positions' rounding, so the
+// heuristic on the stored positions never outruns them.  The search is then
+// exact for the stored lengths, which are within a foot or two of the real ones.
+struct PackedChains
+{
+    static const int kBlockBits = 4;
+    static constexpr double kMilesPerUnit = 1.0 / 8192;
+    static constexpr double kDegreesPerUnit = 1e-6;
+    static constexpr double kSlackMiles = 1.2e-4;   // more than two positions' rounding
+    static const unsigned short kLongChain = 0xffff;
+
+    bool empty() const { return blockByte.empty(); }
+
+      // decodes the chains leaving a junction, one at a time, in order
+    class Cursor
+    {
+    public:
+        Cursor(const PackedChains& packed, int node)
+         : m_packed(packed), m_at(packed.run(node)), m_end(packed.run(node + 1)), m_node(node), m_chain(0)
+        {
+            if (m_at != m_end)
+                m_chain = packed.blockChain[node >> kBlockBits] + static_cast<int>(varint());
+        }
+
+        bool next(int& chain, int& target, double& length)
+        {
+            if (m_at == m_end)
+                return false;
+            unsigned int zigzag = varint();
+            target = m_node + static_cast<int>((zigzag >> 1) ^ (0u - (zigzag & 1)));
+            unsigned short units = static_cast<unsigned short>(m_at[0] | (m_at[1] << 8));
+            m_at += 2;
+            chain = m_chain++;
+            length = units != kLongChain ? units * kMilesPerUnit : m_packed.longLength(chain);
+            return true;
+        }
+
+    private:
+        const PackedChains& m_packed;
+        const unsigned char* m_at;
+        const unsigned char* m_end;
+        int m_node;
+        int m_chain;
+
+        unsigned int varint()
+        {
+            unsigned int value = 0;
+            for (int shift = 0; ; shift += 7) {
+                unsigned char b = *m_at++;
+                value |= static_cast<unsigned int>(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    return value;
+            }
+        }
+    };
+
+    const unsigned char* run(int node) const
+    {
+        return bytes.data() + blockByte[node >> kBlockBits] + nodeByte[node];
+    }
+
+    int latitude(int node) const
+    {
+        int block = node >> kBlockBits;
+        if (blockWide[block] >= 0)
+            return wideLat[blockWide[block] + (node & ((1 << kBlockBits) - 1))];
+        return blockLat[block] + nodeLat[node];
+    }
+
+    int longitude(int node) const
+    {
+        int block = node >> kBlockBits;
+        if (blockWide[block] >= 0)
+            return wideLon[blockWide[block] + (node & ((1 << kBlockBits) - 1))];
+        return blockLon[block] + nodeLon[node];
+    }
+
+      // distanceEarthMiles on the stored positions
+    double crowMiles(int a, int b) const
+    {
+        const double radiansPerUnit = kDegreesPerUnit * 3.14159265358979323846 / 180;
+        const double earthRadiusMiles = 6371.0 / 1.609344;
+        double lat1 = latitude(a) * radiansPerUnit;
+        double lat2 = latitude(b) * radiansPerUnit;
+        double u = std::sin((lat2 - lat1) / 2);
+        double v = std::sin((longitude(b) - longitude(a)) * radiansPerUnit / 2);
+        return 2.0 * earthRadiusMiles * std::asin(std::sqrt(u * u + std::cos(lat1) * std::cos(lat2) * v * v));
+    }
+
+    double longLength(int chain) const
+    {
+        auto it = std::lower_bound(longChains.begin(), longChains.end(), std::make_pair(chain, 0.0));
+        return it->second;
+    }
+
+      // by block, and by node within the block; one more node than the graph
+      // has, so every run has an end
+    std::vector<unsigned int> blockByte;
+    std::vector<int> blockChain;
+    std::vector<unsigned short> nodeByte;
+    std::vector<unsigned char> bytes;
+    std::vector<std::pair<int, double>> longChains;   // by chain id
+
+    std::vector<int> blockLat;
+    std::vector<int> blockLon;
+    std::vector<int> blockWide;       // start in wideLat / wideLon, or -1
+    std::vector<short> nodeLat;
+    std::vector<short> nodeLon;
+    std::vector<int> wideLat;
+    std::vector<int> wideLon;
+};
+
+struct StreetGraph
+{
+    int numNodes() const { return static_cast<int>(coords.size()); }
+    int numEdges() const { return static_cast<int>(edgeTarget.size()); }
+
+      // returns -1 if gc is not the endpoint of any segment
+    int findNode(const GeoCoord& gc) const;
+
+      // the segment an edge stands for, built on demand
+    StreetSegment segment(int e) const
+    {
+        return StreetSegment(coords[edgeSource[e]], coords[edgeTarget[e]], names[edgeName[e]]);
+    }
+
+      // the same, into seg, whose strings keep what they have allocated
+    void segment(int e, StreetSegment& seg) const
+    {
+        seg.start = coords[edgeSource[e]];
+        seg.end = coords[edgeTarget[e]];
+        seg.name = names[edgeName[e]];
+    }
+
+    double length(int e) const { return edgeLength[e]; }
+
+      // straight-line miles between two nodes, for the router's heuristic
+    double crowMiles(int a, int b) const
+    {
+        if (!packed.empty())
+            return packed.crowMiles(a, b);
+        return distanceEarthMiles(coords[a], coords[b]);
+    }
+
+      // direction of travel in degrees counterclockwise from east, 0 <= angle < 360,
+      // as angleOfLine computes it
+    double angle(int e) const { return edgeAngle[e]; }
+
+    std::vector<GeoCoord> coords;     // indexed by node id
+
+      // Edges leaving node n are firstEdge[n] .. firstEdge[n+1]-1.  Every
+      // segment in the map file becomes two edges, one per direction.
+    std::vector<int> firstEdge;
+    std::vector<int> edgeSource;
+    std::vector<int> edgeTarget;
+    std::vector<int> edgeName;        // index into names
+    std::vector<int> edgeTwin;        // the same segment travelled the other way
+    std::vector<std::string> names;
+
+      // Lengths and angles never change after loading, so they are worked out
+      // once for every edge instead of on every relaxation and every
+      // instruction.  The edges and twins must be in place first.
+    void measureEdges();
+
+    std::vector<double> edgeLength;   // miles
+    std::vector<double> edgeAngle;
+
+    ExpandableHashMap<GeoCoord, int> nodeIds;
+
+      // Only for a tiled map: nodes in tiles that aren't loaded, which have just
+      // the segments that cross into loaded tiles.  They are always junctions,
+      // and a search that reaches one has to load its tile and start over.
+      // Empty when the whole map is loaded.
+    std::vector<bool> incomplete;
+
+      // Degree-2 chains.  A node joined to exactly two other nodes is
+      // interior; every other node is a junction.  Each edge belongs to
+      // exactly one chain: a run of edges from a junction through interior
+      // nodes to the next junction.  The router searches junction to junction
+      // along whole chains and unpacks them into edges afterwards.  (One node
+      // of any loop made only of interior nodes is made a junction.)
+    void buildChains();
+
+      // Replaces firstChain, chainTarget and chainLength with packed.  Leaves
+      // them as they are if a block's chains don't fit in 64K bytes.
+    void packChains();
+
+    int numChains() const { return static_cast<int>(firstChainEdge.size()) - 1; }
+    int chainSize(int c) const { return firstChainEdge[c + 1] - firstChainEdge[c]; }
+    int chainEdge(int c, int pos) const { return chainEdges[firstChainEdge[c] + pos]; }
+
+    std::vector<bool> junction;       // indexed by node id
+    std::vector<int> firstChain;      // chains leaving junction n are firstChain[n] .. firstChain[n+1]-1
+    std::vector<int> chainTarget;     // junction at the far end
+    std::vector<double> chainLength;  // sum of the members' lengths
+    std::vector<int> firstChainEdge;  // members of chain c, in order, are
+    std::vector<int> chainEdges;      //   chainEdges[firstChainEdge[c] .. firstChainEdge[c+1]-1]
+    std::vector<int> edgeChain;       // chain containing each edge
+    std::vector<int> edgeChainPos;    //   and where in it
+
+    PackedChains packed;              // empty unless the map was loaded compressed
+
+      // Turns, for routing that charges for them, worded the way instructions
+      // word them: turning from one street onto another is left or right by
+      // the angle between the two edges (as angleBetween2Lines gives it), and
+      // driving a segment straight back is a U-turn.  Anything else, a bend
+      // in the same street or a change of name within a degree of straight
+      // on, is STRAIGHT.
+    enum Turn { STRAIGHT, LEFT, RIGHT, U_TURN };
+
+    Turn turnBetween(int in, int out) const
+    {
+        if (out == edgeTwin[in])
+            return U_TURN;
+        if (edgeName[in] == edgeName[out])
+            return STRAIGHT;
+        double angle = edgeAngle[out] - edgeAngle[in];
+        if (angle < 0)
+            angle += 360;
+        if (angle <= 1 || angle >= 359)
+            return STRAIGHT;
+        return angle < 180 ? LEFT : RIGHT;
+    }
+
+      // Tables every turn at every junction, and counts the turns inside every
+      // chain.  The chains must be built first.
+    void classifyTurns();
+
+      // The turns from edge in onto each edge leaving the junction it arrives
+      // at, in out-edge order (and so in the order of the chains leaving it).
+    const unsigned char* turnsFrom(int in) const
+    {
+        int v = edgeTarget[in];
+        int first = firstEdge[v];
+        int degree = firstEdge[v + 1] - first;
+        return &turnTable[turnBase[v] + (edgeTwin[in] - first) * degree];
+    }
+
+      // the turn from edge in onto edge out at the junction between them
+    Turn turn(int in, int out) const
+    {
+        return static_cast<Turn>(turnsFrom(in)[out - firstEdge[edgeTarget[in]]]);
+    }
+
+    std::vector<int> turnBase;                // junction's degree x degree table in turnTable; -1 if interior
+    std::vector<unsigned char> turnTable;     // by edge in (as its twin's place) and edge out
+    std::vector<unsigned short> chainTurns;   // lefts and rights inside chain c at 2c and 2c+1
+
+      // target and length of chain c, in either form; with packed chains
+      // this has to decode the junction's others before it
+    void chain(int c, int& target, double& length) const
+    {
+        if (packed.empty()) {
+            target = chainTarget[c];
+            length = chainLength[c];
+            return;
+        }
+        PackedChains::Cursor chains(packed, edgeSource[chainEdge(c, 0)]);
+        int k;
+        while (chains.next(k, target, length) && k != c)
+            ;
+    }
+};
+
+// A fixed-size array split into chunks that copies of it share, so changing
+// one element of a copy only copies that element's chunk.
+template <typename T>
+class SharedChunks
+{
+public:
+    static const int kChunkBits = 10;
+    static const int kChunkSize = 1 << kChunkBits;
+
+    SharedChunks()
+    {}
+
+    SharedChunks(int size, const T& value)
+    {
+        std::shared_ptr<Chunk> filled = std::make_shared<Chunk>();
+        for (int i = 0; i < kChunkSize; i++)
+            filled->items[i] = value;
+        m_chunks.assign((size + kChunkSize - 1) / kChunkSize, filled);
+    }
+
+    const T& operator[](int i) const
+    {
+        return m_chunks[i >> kChunkBits]->items[i & (kChunkSize - 1)];
+    }
+
+    void set(int i, const T& value)
+    {
+        std::shared_ptr<Chunk> copy = std::make_shared<Chunk>(*m_chunks[i >> kChunkBits]);
+        copy->items[i & (kChunkSize - 1)] = value;
+        m_chunks[i >> kChunkBits] = copy;
+    }
+
+private:
+    struct Chunk {
+        T items[kChunkSize];
+    };
+
+    std::vector<std::shared_ptr<const Chunk>> m_chunks;
+};
+
+// Runtime state of every edge: closed or not, and an optional cost that
+// replaces the segment's length.
+class EdgeStates
+{
+public:
+    EdgeStates()
+    {}
+
+    explicit EdgeStates(int numEdges)
+     : m_cost(numEdges, -1), m_closed(numEdges, false)
+    {}
+
+    bool closed(int e) const
+    {
+        return m_closed[e];
+    }
+
+      // negative if the edge has no override
+    double costOverride(int e) const
+    {
+        return m_cost[e];
+    }
+
+    bool isDefault(int e) const
+    {
+        return !m_closed[e] && m_cost[e] < 0;
+    }
+
+    void set(int e, bool closed, double costOverride)
+    {
+        if (closed != m_closed[e])
+            m_closed.set(e, closed);
+        if (static_cast<float>(costOverride) != m_cost[e])
+            m_cost.set(e, static_cast<float>(costOverride));
+    }
+
+private:
+    SharedChunks<float> m_cost;
+    SharedChunks<bool> m_closed;
+};
+
+// Speeds for travel-time routing.  The day is divided into equal buckets and
+// each profile is one row of speeds, one per bucket; every edge names the row
+// it uses.  The rows are stored back to back so a lookup touches one short
+// contiguous run of floats.
+struct SpeedProfiles
+{
+    static constexpr double kSecondsPerDay = 24 * 60 * 60;
+    static constexpr double kDefaultMph = 25;
+
+      // a single constant-speed profile shared by every edge
+    explicit SpeedProfiles(int numEdges)
+     : numBuckets(1), bucketSeconds(kSecondsPerDay), mph(1, static_cast<float>(kDefaultMph)),
+       edgeProfile(numEdges, 0), maxMph(kDefaultMph)
+    {}
+
+    SpeedProfiles(int buckets, int numEdges)
+     : numBuckets(buckets), bucketSeconds(kSecondsPerDay / buckets), edgeProfile(numEdges, 0), maxMph(0)
+    {}
+
+      // Time at which a vehicle entering edge e at time departure (seconds
+      // since midnight) leaves it, having covered miles.  The speed changes at
+      // bucket boundaries part way along the edge, which keeps travel times
+      // FIFO: leaving later never gets you there earlier.
+    double arrivalTime(int e, double miles, double departure) const
+    {
+        const float* row = &mph[edgeProfile[e] * numBuckets];
+        double t = departure;
+        double remaining = miles;
+        for (;;) {
+            double timeOfDay = std::fmod(t, kSecondsPerDay);
+            if (timeOfDay < 0)
+                timeOfDay += kSecondsPerDay;
+            int bucket = static_cast<int>(timeOfDay / bucketSeconds);
+            if (bucket >= numBuckets)
+                bucket = numBuckets - 1;
+            double bucketLeft = (bucket + 1) * bucketSeconds - timeOfDay;
+            double milesPerSecond = row[bucket] / 3600.0;
+            double reach = milesPerSecond * bucketLeft;
+            if (reach >= remaining)
+                return t + remaining / milesPerSecond;
+            remaining -= reach;
+            t += bucketLeft;
+        }
+    }
+
+    int numBuckets;
+    double bucketSeconds;
+    std::vector<float> mph;                   // numProfiles rows of numBuckets speeds, all > 0
+    std::vector<unsigned short> edgeProfile;  // row used by each edge
+    double maxMph;                            // fastest speed anywhere, for the heuristic
+};
+
+// A segment an update made cheaper to drive: reopened, or given a lower cost.
+// Snapshots share a list of them, newest first, which tells a route cache
+// whether a route found in an older version could now be beaten.
+struct CheaperSegment
+{
+    unsigned long long version;     // the first version it was cheaper in
+    GeoCoord start;
+    GeoCoord end;
+    double cost;                    // what it cost then, the cheaper way along it
+    std::shared_ptr<const CheaperSegment> older;
+};
+
+// One published version of the map.  A snapshot never changes once
+// StreetMapImpl hands it out; updates build a new one and swap it in, so a
+// query holding an old snapshot keeps running against the graph it started on.
+struct GraphSnapshot
+{
+    std::shared_ptr<const StreetGraph> graph;
+    EdgeStates states;
+    unsigned long long version = 0;
+
+      // Largest factor by which the straight-line distance can be scaled and
+      // still never overestimate the cost of reaching a node.  It drops below 1
+      // only when some override makes an edge cheaper than its length.
+    double heuristicScale = 1;
+
+    std::shared_ptr<const SpeedProfiles> profiles;
+
+      // Size of the squares a tiled map is cut into; 0 if the whole map is
+      // loaded.  Only the tiles loaded when the snapshot was made are in graph:
+      // those in tiles, by column and row, in increasing order.
+    double tileDegrees = 0;
+    std::shared_ptr<const std::vector<std::pair<int, int>>> tiles;
+
+      // Version graph was first published in.  Edge ids mean the same in
+      // every snapshot of one graph.  Node ids mean the same from cheaperSince
+      // on, even when a tiled map builds a new graph as tiles come and go.
+    unsigned long long graphVersion = 0;
+
+      // Number of edges in each chain whose state isn't the default.  While it
+      // is zero the chain's cost is just its precomputed length.  Updates
+      // adjust only the chains they touch.
+    SharedChunks<int> chainChanges;
+
+      // Segments made cheaper after version cheaperSince, newest first.  A
+      // graph that numbers its nodes afresh starts the list again, as does a
+      // long list, and a route found before cheaperSince can't be checked
+      // against it.
+    std::shared_ptr<const CheaperSegment> cheaper;
+    unsigned long long cheaperSince = 0;
+    int numCheaper = 0;
+
+      // edges whose state isn't the default
+    int changedEdges = 0;
+
+    double edgeCost(int e) const
+    {
+        double cost = states.costOverride(e);
+        return cost >= 0 ? cost : graph->length(e);
+    }
+};
+
+#endif // STREETGRAPH_INCLUDED
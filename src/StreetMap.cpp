@@ -4,8 +4,21 @@
 #include <functional>
 #include <fstream>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <numeric>
 #include "ExpandableHashMap.h"
+#include "StreetGraph.h"
+#include "RouteCache.h"
 #include <unordered_set>
+#include <cmath>
+#include <map>
+#include <list>
+#include <sstream>
+#include <iomanip>
 using namespace std;
 
 unsigned int hasher(const GeoCoord& g)
@@ -13,111 +26,1327 @@ unsigned int hasher(const GeoCoord& g)
     return std::hash<string>()(g.latitudeText + g.longitudeText);
 }
 
-class StreetMapImpl
+int StreetGraph::findNode(const GeoCoord& gc) const
 {
-public:
-    StreetMapImpl();
-    ~StreetMapImpl();
-    bool load(string mapFile);
-    bool getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs) const;
+    const int* id = nodeIds.find(gc);
+    return id ? *id : -1;
+}
 
-private:
-    ExpandableHashMap<GeoCoord, vector<StreetSegment>> hashMap;
-};
+void StreetGraph::measureEdges()
+{
+    // Convert every node once, so each edge is a few flat array reads.  The
+    // arithmetic is the same as distanceEarthMiles and angleOfLine, and gives
+    // the same values.
+    int n = numNodes();
+    vector<double> latRad(n), lonRad(n), cosLat(n);
+    for (int i = 0; i < n; i++) {
+        latRad[i] = deg2rad(coords[i].latitude);
+        lonRad[i] = deg2rad(coords[i].longitude);
+        cosLat[i] = cos(latRad[i]);
+    }
 
-StreetMapImpl::StreetMapImpl()
+    const double earthRadiusKm = 6371.0;
+    const double milesPerKm = 1 / 1.609344;
+    int m = numEdges();
+    edgeLength.resize(m);
+    edgeAngle.resize(m);
+    for (int e = 0; e < m; e++) {
+        int from = edgeSource[e];
+        int to = edgeTarget[e];
+        if (edgeTwin[e] < e) {      // a segment's length is the same both ways
+            edgeLength[e] = edgeLength[edgeTwin[e]];
+        }
+        else {
+            double u = sin((latRad[to] - latRad[from]) / 2);
+            double v = sin((lonRad[to] - lonRad[from]) / 2);
+            edgeLength[e] = 2.0 * earthRadiusKm * asin(sqrt(u * u + cosLat[from] * cosLat[to] * v * v)) * milesPerKm;
+        }
+        double angle = rad2deg(atan2(coords[to].latitude - coords[from].latitude,
+                                     coords[to].longitude - coords[from].longitude));
+        edgeAngle[e] = angle < 0 ? angle + 360 : angle;
+    }
+}
+
+void StreetGraph::buildChains()
 {
+    int n = numNodes();
+
+    junction.assign(n, true);
+    for (int v = 0; v < n; v++) {
+        if (firstEdge[v + 1] - firstEdge[v] != 2 || (!incomplete.empty() && incomplete[v]))
+            continue;
+        int a = edgeTarget[firstEdge[v]];
+        int b = edgeTarget[firstEdge[v] + 1];
+        if (a != b && a != v && b != v)
+            junction[v] = false;
+    }
+
+    // the edge to leave interior node v by, having arrived along edge e
+    auto onward = [this](int v, int e) {
+        int first = firstEdge[v];
+        return first == edgeTwin[e] ? first + 1 : first;
+    };
+
+    // Follow the chains out of every junction, marking their edges.  Whatever
+    // is left over is a loop of interior nodes; make one of its nodes a
+    // junction and go again.
+    vector<bool> covered(numEdges(), false);
+    auto cover = [&](int u) {
+        for (int e = firstEdge[u]; e != firstEdge[u + 1]; e++) {
+            for (int f = e; ; f = onward(edgeTarget[f], f)) {
+                covered[f] = true;
+                if (junction[edgeTarget[f]])
+                    break;
+            }
+        }
+    };
+    for (int u = 0; u < n; u++)
+        if (junction[u])
+            cover(u);
+    for (int e = 0; e < numEdges(); e++) {
+        if (!covered[e]) {
+            junction[edgeSource[e]] = true;
+            cover(edgeSource[e]);
+        }
+    }
+
+    firstChain.assign(n + 1, 0);
+    chainTarget.clear();
+    chainLength.clear();
+    firstChainEdge.assign(1, 0);
+    chainEdges.clear();
+    edgeChain.assign(numEdges(), -1);
+    edgeChainPos.assign(numEdges(), -1);
+
+    for (int u = 0; u < n; u++) {
+        firstChain[u] = chainTarget.size();
+        if (!junction[u])
+            continue;
+        for (int e = firstEdge[u]; e != firstEdge[u + 1]; e++) {
+            int c = chainTarget.size();
+            double miles = 0;
+            int f = e;
+            for (int pos = 0; ; pos++, f = onward(edgeTarget[f], f)) {
+                chainEdges.push_back(f);
+                edgeChain[f] = c;
+                edgeChainPos[f] = pos;
+                miles += length(f);
+                if (junction[edgeTarget[f]])
+                    break;
+            }
+            chainTarget.push_back(edgeTarget[f]);
+            chainLength.push_back(miles);
+            firstChainEdge.push_back(chainEdges.size());
+        }
+    }
+    firstChain[n] = chainTarget.size();
 }
 
-StreetMapImpl::~StreetMapImpl()
+void StreetGraph::classifyTurns()
 {
+    int n = numNodes();
+    turnBase.assign(n, -1);
+    turnTable.clear();
+    for (int v = 0; v < n; v++) {
+        if (!junction[v])
+            continue;
+        turnBase[v] = turnTable.size();
+        for (int back = firstEdge[v]; back != firstEdge[v + 1]; back++) {
+            for (int out = firstEdge[v]; out != firstEdge[v + 1]; out++)
+                turnTable.push_back(turnBetween(edgeTwin[back], out));
+        }
+    }
+
+    int numChains = this->numChains();
+    chainTurns.assign(2 * numChains, 0);
+    for (int c = 0; c < numChains; c++) {
+        for (int pos = 1; pos < chainSize(c); pos++) {
+            Turn t = turnBetween(chainEdge(c, pos - 1), chainEdge(c, pos));
+            unsigned short& count = chainTurns[2 * c + (t == RIGHT)];
+            if ((t == LEFT || t == RIGHT) && count < 0xffff)
+                count++;
+        }
+    }
 }
 
-bool StreetMapImpl::load(string mapFile)
+void StreetGraph::packChains()
 {
+    const int blockSize = 1 << PackedChains::kBlockBits;
+    int n = numNodes();
+    int numBlocks = n / blockSize + 1;      // node n, past the end, has a block too
+    PackedChains p;
 
-    ifstream is(mapFile);
+    auto varint = [&p](unsigned int value) {
+        while (value >= 0x80) {
+            p.bytes.push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+        p.bytes.push_back(static_cast<unsigned char>(value));
+    };
 
-    if (!is) {
-        // Failed open
+    p.blockByte.resize(numBlocks);
+    p.blockChain.resize(numBlocks);
+    p.nodeByte.resize(n + 1);
+    for (int u = 0; u <= n; u++) {
+        int block = u >> PackedChains::kBlockBits;
+        if ((u & (blockSize - 1)) == 0) {
+            p.blockByte[block] = p.bytes.size();
+            p.blockChain[block] = firstChain[u];
+        }
+        if (p.bytes.size() - p.blockByte[block] > 0xffff)
+            return;
+        p.nodeByte[u] = static_cast<unsigned short>(p.bytes.size() - p.blockByte[block]);
+        if (u == n || firstChain[u] == firstChain[u + 1])
+            continue;
+
+        varint(firstChain[u] - p.blockChain[block]);
+        for (int c = firstChain[u]; c != firstChain[u + 1]; c++) {
+            int delta = chainTarget[c] - u;
+            varint((static_cast<unsigned int>(delta) << 1) ^ static_cast<unsigned int>(delta >> 31));
+
+            double length = chainLength[c] + PackedChains::kSlackMiles;
+            double units = ceil(length / PackedChains::kMilesPerUnit);
+            unsigned short stored = PackedChains::kLongChain;
+            if (units < PackedChains::kLongChain)
+                stored = static_cast<unsigned short>(units);
+            else
+                p.longChains.push_back(make_pair(c, length));
+            p.bytes.push_back(static_cast<unsigned char>(stored & 0xff));
+            p.bytes.push_back(static_cast<unsigned char>(stored >> 8));
+        }
     }
 
+    p.blockLat.resize(numBlocks);
+    p.blockLon.resize(numBlocks);
+    p.blockWide.assign(numBlocks, -1);
+    p.nodeLat.resize(n);
+    p.nodeLon.resize(n);
+    for (int first = 0; first < n; first += blockSize) {
+        int last = min(first + blockSize, n);
+        int block = first >> PackedChains::kBlockBits;
+        vector<int> lat, lon;
+        bool narrow = true;
+        for (int v = first; v < last; v++) {
+            lat.push_back(static_cast<int>(lround(coords[v].latitude / PackedChains::kDegreesPerUnit)));
+            lon.push_back(static_cast<int>(lround(coords[v].longitude / PackedChains::kDegreesPerUnit)));
+            narrow = narrow && abs(lat.back() - lat[0]) <= 0x7fff && abs(lon.back() - lon[0]) <= 0x7fff;
+        }
+        p.blockLat[block] = lat[0];
+        p.blockLon[block] = lon[0];
+        if (!narrow) {
+            p.blockWide[block] = p.wideLat.size();
+            p.wideLat.insert(p.wideLat.end(), lat.begin(), lat.end());
+            p.wideLon.insert(p.wideLon.end(), lon.begin(), lon.end());
+            p.wideLat.resize(p.wideLat.size() + blockSize - lat.size());
+            p.wideLon.resize(p.wideLon.size() + blockSize - lon.size());
+            continue;
+        }
+        for (int v = first; v < last; v++) {
+            p.nodeLat[v] = static_cast<short>(lat[v - first] - lat[0]);
+            p.nodeLon[v] = static_cast<short>(lon[v - first] - lon[0]);
+        }
+    }
+
+    p.bytes.shrink_to_fit();
+    packed = std::move(p);
+    vector<int>().swap(firstChain);
+    vector<int>().swap(chainTarget);
+    vector<double>().swap(chainLength);
+}
+
+// Position of cell (x, y) along a Hilbert curve filling a 2^16 x 2^16 grid.
+static unsigned long long hilbertIndex(unsigned int x, unsigned int y)
+{
+    const unsigned int side = 1u << 16;
+    unsigned long long d = 0;
+    for (unsigned int s = side / 2; s > 0; s /= 2) {
+        unsigned int rx = (x & s) ? 1 : 0;
+        unsigned int ry = (y & s) ? 1 : 0;
+        d += static_cast<unsigned long long>(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
+
+// The order to number the graph's nodes in: order[k] is the node that
+// becomes node k.
+static vector<int> nodeOrder(const StreetGraph& graph, const vector<int>& segStart, const vector<int>& segEnd,
+    MapLoadOptions::NodeOrder how)
+{
+    int n = graph.numNodes();
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    if (how == MapLoadOptions::FILE_ORDER || n == 0)
+        return order;
+
+    if (how == MapLoadOptions::HILBERT_ORDER) {
+        double minLat = graph.coords[0].latitude, maxLat = minLat;
+        double minLon = graph.coords[0].longitude, maxLon = minLon;
+        for (const GeoCoord& gc : graph.coords) {
+            minLat = min(minLat, gc.latitude);
+            maxLat = max(maxLat, gc.latitude);
+            minLon = min(minLon, gc.longitude);
+            maxLon = max(maxLon, gc.longitude);
+        }
+        double span = max(max(maxLat - minLat, maxLon - minLon), 1e-12);
+        vector<unsigned long long> key(n);
+        for (int v = 0; v < n; v++) {
+            unsigned int x = static_cast<unsigned int>((graph.coords[v].longitude - minLon) / span * 65535);
+            unsigned int y = static_cast<unsigned int>((graph.coords[v].latitude - minLat) / span * 65535);
+            key[v] = hilbertIndex(x, y);
+        }
+        stable_sort(order.begin(), order.end(), [&key](int a, int b) { return key[a] < key[b]; });
+        return order;
+    }
+
+    // BFS_ORDER: walk each connected piece of the map breadth first
+    // neighbors of v are neighbor[firstNeighbor[v]] .. neighbor[firstNeighbor[v+1]-1]
+    vector<int> firstNeighbor(n + 1, 0);
+    for (size_t i = 0; i < segStart.size(); i++) {
+        firstNeighbor[segStart[i] + 1]++;
+        firstNeighbor[segEnd[i] + 1]++;
+    }
+    for (int v = 0; v < n; v++)
+        firstNeighbor[v + 1] += firstNeighbor[v];
+    vector<int> neighbor(firstNeighbor[n]);
+    vector<int> fill(firstNeighbor.begin(), firstNeighbor.end() - 1);
+    for (size_t i = 0; i < segStart.size(); i++) {
+        neighbor[fill[segStart[i]]++] = segEnd[i];
+        neighbor[fill[segEnd[i]]++] = segStart[i];
+    }
+    vector<bool> seen(n, false);
+    order.clear();
+    for (int root = 0; root < n; root++) {
+        if (seen[root])
+            continue;
+        seen[root] = true;
+        order.push_back(root);
+        for (size_t next = order.size() - 1; next < order.size(); next++) {
+            for (int k = firstNeighbor[order[next]]; k < firstNeighbor[order[next] + 1]; k++) {
+                int w = neighbor[k];
+                if (!seen[w]) {
+                    seen[w] = true;
+                    order.push_back(w);
+                }
+            }
+        }
+    }
+    return order;
+}
+
+// Reads streets in the map file format: a street name, the number of segments
+// on it, then one line per segment.  Calls segment(nameId, start, end) for each
+// segment, nameId being the street's index in names.
+static bool readMapFile(istream& is, vector<string>& names,
+    const function<void(int nameId, const GeoCoord& start, const GeoCoord& end)>& segment)
+{
     string line;
+    istringstream is_seg;
+    string lat1, long1, lat2, long2;
     while (getline(is, line)) {
         // Get the street name
-        string name = line;
+        int nameId = names.size();
+        names.push_back(line);
 
         // get the num of segments
         int numSeg;
-        is >> numSeg;
+        if (!(is >> numSeg)) {
+            // Failed read
+            return false;
+        }
 
         is.ignore(1000, '\n');
-        
+
         for (int i = 0; i < numSeg; i++) {
             if (!getline(is, line)) {
                 // Failed read
+                return false;
             }
 
-            istringstream is_seg(line);
-
-            string lat1, long1, lat2, long2;
+            // one stream and set of strings for every line, not one each
+            is_seg.clear();
+            is_seg.str(line);
 
             if (!(is_seg >> lat1 >> long1 >> lat2 >> long2)) {
                 // Failed read
+                return false;
             }
 
-            // Mapping
+            segment(nameId, GeoCoord(lat1, long1), GeoCoord(lat2, long2));
+        }
+    }
+    return true;
+}
 
-            GeoCoord start(lat1, long1);
-            GeoCoord end(lat2, long2);
+// Id of the node at gc, adding it to graph if it's new.
+static int nodeFor(StreetGraph& graph, const GeoCoord& gc)
+{
+    int* id = graph.nodeIds.find(gc);
+    if (id)
+        return *id;
+    int newId = graph.numNodes();
+    graph.coords.push_back(gc);
+    graph.nodeIds.associate(gc, newId);
+    return newId;
+}
 
-            vector<StreetSegment>* connectedSegments;
-            if (! (connectedSegments = hashMap.find(start))) {
-                connectedSegments = &vector<StreetSegment>();
-                hashMap.associate(start, *connectedSegments);
-                connectedSegments = hashMap.find(start);
-            }
+// Turns the segments read into graph (a pair of node ids and a name id each)
+// into edges, and works out everything the router needs from them.
+// incomplete is as StreetGraph::incomplete, by the nodes' ids as read.
+static void buildEdges(StreetGraph& graph, vector<int>& segStart, vector<int>& segEnd, const vector<int>& segName,
+    const MapLoadOptions& options, const vector<bool>& incomplete)
+{
+    // Renumber the nodes if asked to.  Edges are laid out by start node
+    // below, so they follow the same order.
 
-            // connectedSegments is the vector of Street Segments that maps to start
+    int numNodes = graph.numNodes();
+    MapLoadOptions::NodeOrder how = options.nodeOrder;
+    vector<int> order = nodeOrder(graph, segStart, segEnd, how);
+    graph.incomplete.clear();
+    if (!incomplete.empty()) {
+        for (int k = 0; k < numNodes; k++)
+            graph.incomplete.push_back(incomplete[order[k]]);
+    }
+    if (how != MapLoadOptions::FILE_ORDER) {
+        vector<int> newId(numNodes);
+        vector<GeoCoord> coords(numNodes);
+        for (int k = 0; k < numNodes; k++) {
+            newId[order[k]] = k;
+            coords[k] = graph.coords[order[k]];
+            graph.nodeIds.associate(coords[k], k);
+        }
+        graph.coords.swap(coords);
+        for (size_t i = 0; i < segStart.size(); i++) {
+            segStart[i] = newId[segStart[i]];
+            segEnd[i] = newId[segEnd[i]];
+        }
+    }
 
-            vector<StreetSegment>::iterator it;
+    // Lay the edges out by start node.  Each segment becomes a forward and a
+    // reverse edge, which are recorded as each other's twins.
 
-            StreetSegment segment(start, end, name);
+    int numEdges = 2 * segStart.size();
 
-            connectedSegments->push_back(segment);
+    graph.firstEdge.assign(numNodes + 1, 0);
+    for (size_t i = 0; i < segStart.size(); i++) {
+        graph.firstEdge[segStart[i] + 1]++;
+        graph.firstEdge[segEnd[i] + 1]++;
+    }
+    for (int n = 0; n < numNodes; n++)
+        graph.firstEdge[n + 1] += graph.firstEdge[n];
 
-            // Reverse
+    vector<int> next(graph.firstEdge.begin(), graph.firstEdge.end() - 1);
+    graph.edgeSource.resize(numEdges);
+    graph.edgeTarget.resize(numEdges);
+    graph.edgeName.resize(numEdges);
+    graph.edgeTwin.resize(numEdges);
 
-            if (!(connectedSegments = hashMap.find(end))) {
-                connectedSegments = &vector<StreetSegment>();
-                hashMap.associate(end, *connectedSegments);
-                connectedSegments = hashMap.find(end);
-            }
+    for (size_t i = 0; i < segStart.size(); i++) {
+        int forward = next[segStart[i]]++;
+        int reverse = next[segEnd[i]]++;
+        graph.edgeSource[forward] = segStart[i];
+        graph.edgeTarget[forward] = segEnd[i];
+        graph.edgeSource[reverse] = segEnd[i];
+        graph.edgeTarget[reverse] = segStart[i];
+        graph.edgeName[forward] = graph.edgeName[reverse] = segName[i];
+        graph.edgeTwin[forward] = reverse;
+        graph.edgeTwin[reverse] = forward;
+    }
+
+    graph.measureEdges();
+    graph.buildChains();
+    graph.classifyTurns();
+    if (options.compressed)
+        graph.packChains();
+}
+
+// Tiled maps.  The map is cut into squares tileDegrees on a side, and each
+// square's streets are stored in a file of their own, in the map file format.
+// A tile holds every segment with an end in it, so one that crosses into
+// another tile is in both; it belongs to the tile its start is in.
 
-            StreetSegment reverseSegment(end, start, name);
+typedef pair<int, int> TileId;      // column and row of a square
+
+static TileId tileOf(const GeoCoord& gc, double tileDegrees)
+{
+    return TileId(static_cast<int>(floor(gc.longitude / tileDegrees)),
+                  static_cast<int>(floor(gc.latitude / tileDegrees)));
+}
+
+static string tileFileName(const string& directory, const TileId& t)
+{
+    return directory + "/tile_" + to_string(t.first) + "_" + to_string(t.second) + ".txt";
+}
+
+static string tileIndexName(const string& directory)
+{
+    return directory + "/index.txt";
+}
+
+// Both directions of a segment always change together, so one key covers
+// both; it puts the smaller end first.
+static string segmentKey(const GeoCoord& start, const GeoCoord& end)
+{
+    const GeoCoord& a = start < end ? start : end;
+    const GeoCoord& b = start < end ? end : start;
+    return a.latitudeText + " " + a.longitudeText + " " + b.latitudeText + " " + b.longitudeText;
+}
+
+// A tile as read from its file.  Its nodes are numbered as the graph's are,
+// so building a graph from tiles only has to look up the nodes in other tiles.
+struct MapTile
+{
+    vector<string> names;
+    vector<GeoCoord> nodes;     // every segment end, once
+    vector<bool> inside;        // whether each node lies in this tile
+    vector<int> segStart;       // index into nodes
+    vector<int> segEnd;
+    vector<int> segName;        // index into names
+};
+
+// Reads tile t of the tiled map in directory.  It touches nothing else, so it
+// is done without holding the map's lock.
+static bool readTile(const string& directory, double tileDegrees, const TileId& t, MapTile& tile)
+{
+    ifstream is(tileFileName(directory, t));
+    ExpandableHashMap<GeoCoord, int> nodeIds;
+    auto nodeFor = [&](const GeoCoord& gc) {
+        int* id = nodeIds.find(gc);
+        if (id)
+            return *id;
+        tile.nodes.push_back(gc);
+        tile.inside.push_back(tileOf(gc, tileDegrees) == t);
+        nodeIds.associate(gc, tile.nodes.size() - 1);
+        return static_cast<int>(tile.nodes.size() - 1);
+    };
+    return is && readMapFile(is, tile.names, [&](int nameId, const GeoCoord& start, const GeoCoord& end) {
+        tile.segStart.push_back(nodeFor(start));
+        tile.segEnd.push_back(nodeFor(end));
+        tile.segName.push_back(nameId);
+    });
+}
+
+static bool tileHasSegment(const MapTile& tile, const GeoCoord& start, const GeoCoord& end)
+{
+    for (size_t i = 0; i < tile.segStart.size(); i++) {
+        const GeoCoord& a = tile.nodes[tile.segStart[i]];
+        const GeoCoord& b = tile.nodes[tile.segEnd[i]];
+        if ((a == start && b == end) || (a == end && b == start))
+            return true;
+    }
+    return false;
+}
+
+class StreetMapImpl
+{
+public:
+    StreetMapImpl();
+    ~StreetMapImpl();
+    bool load(string mapFile, const MapLoadOptions& options);
+    bool getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs);
+
+    bool closeSegment(const GeoCoord& start, const GeoCoord& end);
+    bool reopenSegment(const GeoCoord& start, const GeoCoord& end);
+    bool setSegmentCost(const GeoCoord& start, const GeoCoord& end, double cost);
+    bool clearSegmentCost(const GeoCoord& start, const GeoCoord& end);
+
+    bool loadSpeedProfiles(string profileFile);
+
+    static bool writeTiles(string mapFile, string directory, double tileDegrees);
+    bool loadTiled(string directory, const MapLoadOptions& options);
+
+    shared_ptr<const GraphSnapshot> snapshot() const {
+        return atomic_load(&m_current);
+    }
+
+    shared_ptr<const GraphSnapshot> snapshotCovering(const vector<GeoCoord>& points);
+
+    void setRouteCacheSize(size_t maxBytes) {
+        atomic_store(&m_routeCache, maxBytes == 0 ? shared_ptr<RouteCache>() : make_shared<RouteCache>(maxBytes));
+    }
+
+    shared_ptr<RouteCache> routeCache() const {
+        return atomic_load(&m_routeCache);
+    }
+
+private:
+    // Readers only ever atomic_load m_current.  Writers take m_updateLock, copy
+    // the current snapshot, change the copy and atomic_store it back.
+    shared_ptr<const GraphSnapshot> m_current;
+    mutex m_updateLock;
+
+    shared_ptr<RouteCache> m_routeCache;        // atomic_load / atomic_store too
+
+    // cost / length of every edge that has a cost override, used to keep the
+    // router's heuristic admissible
+    multiset<double> m_overrideRatios;
+
+    // most segments made cheaper a snapshot lists for the route cache
+    static constexpr int kMaxCheaperSegments = 256;
+
+    // Every segment whose state isn't the default, keyed by its two ends, and
+    // the speed profiles.  A tiled map builds a new graph whenever its tiles
+    // change, and these are applied to it again.
+    struct SegmentState {
+        GeoCoord start;
+        GeoCoord end;
+        bool closed;
+        double cost;
+    };
+    unordered_map<string, SegmentState> m_segmentStates;
+    shared_ptr<const SpeedProfiles> m_profileRows;      // null if none loaded
+    unordered_map<string, int> m_streetProfile;
+
+    // The tiled map, if one is open.  m_tileDegrees is 0 otherwise.
+    string m_tileDirectory;
+    double m_tileDegrees;
+    MapLoadOptions m_options;
+    set<TileId> m_tileIndex;                    // tiles that have a file
+    unsigned long long m_mapLoads = 0;          // maps loaded, tiled or not
+    struct ResidentTile {
+        shared_ptr<const MapTile> tile;
+        vector<int> ids;                        // node id of each of tile->nodes
+        list<TileId>::iterator recent;
+    };
+    map<TileId, ResidentTile> m_resident;
+    list<TileId> m_recent;                      // resident tiles, most recently used first
+
+    // Node ids of the tiled map.  A node is numbered when a tile holding it is
+    // first read and keeps its number as tiles come and go, so the route cache
+    // can keep routes across them.  Once most numbers are of nodes in no
+    // resident tile, the resident tiles' nodes are numbered afresh.
+    ExpandableHashMap<GeoCoord, int> m_tileNodeIds;
+    vector<GeoCoord> m_tileCoords;
+
+    bool updateSegment(const GeoCoord& start, const GeoCoord& end,
+        const function<void(bool& closed, double& cost)>& change);
+
+      // The rest expect m_updateLock to be held.
+
+      // Changes both edges of every segment between start and end in snap,
+      // which is the next version; false if there's no such segment.
+    bool changeSegment(GraphSnapshot& snap, const GeoCoord& start, const GeoCoord& end,
+        const function<void(bool& closed, double& cost)>& change);
+
+      // Publishes graph as the next version of the map.  Unless keepChanges,
+      // closures, cost overrides and speed profiles are dropped.  renumbered
+      // says whether graph's node ids differ from the current graph's.
+    void publish(shared_ptr<const StreetGraph> graph, bool keepChanges, bool renumbered);
+
+    shared_ptr<const SpeedProfiles> profilesFor(const StreetGraph& graph) const;
+
+      // Saves the new state of a segment in a tile that isn't loaded, to be
+      // applied when it is.
+    void changeUnloadedSegment(GraphSnapshot& snap, const GeoCoord& start, const GeoCoord& end,
+        const function<void(bool& closed, double& cost)>& change);
+
+      // Adds a segment made cheaper, now costing cost, to snap's list.
+    void noteCheaper(GraphSnapshot& snap, const GeoCoord& start, const GeoCoord& end, double cost);
+
+      // Makes a tile that has been read resident, as the most recently used
+      // if recent and else as the least.
+    void addTile(const TileId& t, shared_ptr<const MapTile> tile, bool recent);
+
+      // Numbers a resident tile's nodes, giving those new to the map new ids.
+    void numberTile(ResidentTile& resident);
+
+      // Drops the tiled map, if one is open.
+    void forgetTiles();
+
+      // Publishes a graph of the resident tiles.
+    void buildFromTiles(bool keepChanges);
+};
+
+StreetMapImpl::StreetMapImpl()
+ : m_tileDegrees(0)
+{
+    shared_ptr<StreetGraph> graph = make_shared<StreetGraph>();
+    graph->firstEdge.push_back(0);
+
+    shared_ptr<GraphSnapshot> empty = make_shared<GraphSnapshot>();
+    empty->graph = graph;
+    m_current = empty;
+}
+
+StreetMapImpl::~StreetMapImpl()
+{
+}
+
+bool StreetMapImpl::load(string mapFile, const MapLoadOptions& options)
+{
+
+    ifstream is(mapFile);
+
+    if (!is) {
+        // Failed open
+        return false;
+    }
+
+    shared_ptr<StreetGraph> graph = make_shared<StreetGraph>();
+
+    // Each segment is read as a pair of node ids; the edges are laid out by
+    // start node once the whole file has been read.
+    vector<int> segStart, segEnd, segName;
+
+    bool ok = readMapFile(is, graph->names, [&](int nameId, const GeoCoord& start, const GeoCoord& end) {
+        segStart.push_back(nodeFor(*graph, start));
+        segEnd.push_back(nodeFor(*graph, end));
+        segName.push_back(nameId);
+    });
+    if (!ok)
+        return false;
+
+    buildEdges(*graph, segStart, segEnd, segName, options, vector<bool>());
+
+    lock_guard<mutex> lock(m_updateLock);
+
+    m_tileDegrees = 0;
+    forgetTiles();
+    publish(graph, false, true);
+
+    return true;
+}
+
+void StreetMapImpl::publish(shared_ptr<const StreetGraph> graph, bool keepChanges, bool renumbered)
+{
+    shared_ptr<GraphSnapshot> loaded = make_shared<GraphSnapshot>();
+    loaded->graph = graph;
+    loaded->states = EdgeStates(graph->numEdges());
+    loaded->chainChanges = SharedChunks<int>(graph->numChains(), 0);
+    loaded->version = m_current->version + 1;
+    loaded->graphVersion = loaded->version;
+    loaded->tileDegrees = m_tileDegrees;
+    if (m_tileDegrees > 0) {
+        shared_ptr<vector<pair<int, int>>> tiles = make_shared<vector<pair<int, int>>>();
+        for (const auto& resident : m_resident)
+            tiles->push_back(resident.first);
+        loaded->tiles = tiles;
+    }
+    m_overrideRatios.clear();
+
+    if (!keepChanges) {
+        m_segmentStates.clear();
+        m_profileRows.reset();
+        m_streetProfile.clear();
+    }
+    loaded->profiles = profilesFor(*graph);
+
+    vector<SegmentState> saved;
+    for (const auto& entry : m_segmentStates)
+        saved.push_back(entry.second);
+    for (const SegmentState& state : saved) {
+        changeSegment(*loaded, state.start, state.end, [&state](bool& closed, double& cost) {
+            closed = state.closed;
+            cost = state.cost;
+        });
+    }
+
+    // Putting the saved changes back makes nothing cheaper than it was, so
+    // the list goes on as it was.  Routes found with nodes numbered another
+    // way can't be checked against this graph.
+    if (renumbered) {
+        loaded->cheaper.reset();
+        loaded->numCheaper = 0;
+        loaded->cheaperSince = loaded->version;
+    } else {
+        loaded->cheaper = m_current->cheaper;
+        loaded->numCheaper = m_current->numCheaper;
+        loaded->cheaperSince = m_current->cheaperSince;
+    }
+
+    atomic_store(&m_current, shared_ptr<const GraphSnapshot>(loaded));
+}
+
+shared_ptr<const SpeedProfiles> StreetMapImpl::profilesFor(const StreetGraph& graph) const
+{
+    if (!m_profileRows)
+        return make_shared<SpeedProfiles>(graph.numEdges());
 
-            connectedSegments->push_back(reverseSegment);
+    shared_ptr<SpeedProfiles> profiles = make_shared<SpeedProfiles>(*m_profileRows);
+    profiles->edgeProfile.assign(graph.numEdges(), 0);
+    for (int e = 0; e < graph.numEdges(); e++) {
+        auto it = m_streetProfile.find(graph.names[graph.edgeName[e]]);
+        if (it != m_streetProfile.end())
+            profiles->edgeProfile[e] = it->second;
+    }
+    return profiles;
+}
+
+bool StreetMapImpl::loadSpeedProfiles(string profileFile)
+{
+    ifstream is(profileFile);
+
+    if (!is) {
+        // Failed open
+        return false;
+    }
+
+    // the number of buckets the day is split into, then the number of profiles
+    int numBuckets, numProfiles;
+    if (!(is >> numBuckets >> numProfiles) || numBuckets <= 0 || numProfiles <= 0 || numProfiles > 65535)
+        return false;
+    is.ignore(1000, '\n');
+
+    shared_ptr<SpeedProfiles> rows = make_shared<SpeedProfiles>(numBuckets, 0);
+    unordered_map<string, int> profileIds;
+
+    // each profile is a name line followed by a line of numBuckets speeds in mph
+    string line;
+    for (int p = 0; p < numProfiles; p++) {
+        string name;
+        if (!getline(is, name) || !getline(is, line))
+            return false;
+        profileIds[name] = p;
+
+        istringstream is_speeds(line);
+        for (int b = 0; b < numBuckets; b++) {
+            // arrivalTime would never finish an edge at a speed of NaN, or of
+            // 0 once stored as a float, so those and infinity are refused
+            double mph;
+            if (!(is_speeds >> mph))
+                return false;
+            float stored = static_cast<float>(mph);
+            if (!(stored > 0) || !isfinite(stored))
+                return false;
+            rows->mph.push_back(stored);
+            if (mph > rows->maxMph)
+                rows->maxMph = mph;
         }
     }
 
+    // the rest of the file is pairs of lines: a street name, then the name of
+    // the profile its segments use.  Streets not listed use the first profile.
+    unordered_map<string, int> streetProfile;
+    string street;
+    while (getline(is, street)) {
+        if (street.empty())
+            continue;
+        if (!getline(is, line))
+            return false;
+        auto it = profileIds.find(line);
+        if (it == profileIds.end())
+            return false;
+        streetProfile[street] = it->second;
+    }
+
+    lock_guard<mutex> lock(m_updateLock);
+
+    m_profileRows = rows;
+    m_streetProfile.swap(streetProfile);
+
+    shared_ptr<GraphSnapshot> updated = make_shared<GraphSnapshot>(*m_current);
+    updated->profiles = profilesFor(*updated->graph);
+    updated->version++;
+
+    atomic_store(&m_current, shared_ptr<const GraphSnapshot>(updated));
     return true;
 }
 
-bool StreetMapImpl::getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs) const
+bool StreetMapImpl::getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs)
 {
-    const vector<StreetSegment>* foundSegments;
-    if (! (foundSegments = hashMap.find(gc))) {
+    shared_ptr<const GraphSnapshot> snap = snapshotCovering(vector<GeoCoord>(1, gc));
+    const StreetGraph& graph = *snap->graph;
+
+    int node = graph.findNode(gc);
+    if (node < 0) {
         return false;
     }
 
     segs.clear();
-    for (auto it = foundSegments->begin(); it != foundSegments->end(); it++) {
-        segs.push_back(*it);
+    for (int e = graph.firstEdge[node]; e != graph.firstEdge[node + 1]; e++) {
+        if (!snap->states.closed(e))
+            segs.push_back(graph.segment(e));
+    }
+
+    return true;
+}
+
+bool StreetMapImpl::updateSegment(const GeoCoord& start, const GeoCoord& end,
+    const function<void(bool& closed, double& cost)>& change)
+{
+    for (;;) {
+        string directory;
+        double tileDegrees;
+        unsigned long long mapLoads;
+        TileId t;
+        {
+            lock_guard<mutex> lock(m_updateLock);
+
+            shared_ptr<GraphSnapshot> updated = make_shared<GraphSnapshot>(*m_current);
+            updated->version++;
+            if (changeSegment(*updated, start, end, change)) {
+                atomic_store(&m_current, shared_ptr<const GraphSnapshot>(updated));
+                return true;
+            }
+
+            // every segment of a loaded tile is in the graph
+            if (m_tileDegrees == 0)
+                return false;
+            t = tileOf(start, m_tileDegrees);
+            if (!m_tileIndex.count(t) || m_resident.count(t))
+                return false;
+            directory = m_tileDirectory;
+            tileDegrees = m_tileDegrees;
+            mapLoads = m_mapLoads;
+        }
+
+        // Look for the segment in its tile's file without holding the lock,
+        // so queries and other updates don't wait on the read.
+        MapTile tile;
+        if (!readTile(directory, tileDegrees, t, tile) || !tileHasSegment(tile, start, end))
+            return false;
+
+        lock_guard<mutex> lock(m_updateLock);
+        if (m_mapLoads != mapLoads)
+            continue;               // another map was loaded meanwhile
+
+        // the tile may have been loaded meanwhile too
+        shared_ptr<GraphSnapshot> updated = make_shared<GraphSnapshot>(*m_current);
+        updated->version++;
+        if (!changeSegment(*updated, start, end, change))
+            changeUnloadedSegment(*updated, start, end, change);
+        atomic_store(&m_current, shared_ptr<const GraphSnapshot>(updated));
+        return true;
+    }
+}
+
+bool StreetMapImpl::changeSegment(GraphSnapshot& snap, const GeoCoord& start, const GeoCoord& end,
+    const function<void(bool& closed, double& cost)>& change)
+{
+    const StreetGraph& graph = *snap.graph;
+    int from = graph.findNode(start);
+    int to = graph.findNode(end);
+    if (from < 0 || to < 0)
+        return false;
+
+    // Two streets can join the same pair of points, so change every segment
+    // between them, each in both directions.
+    vector<int> edges;
+    for (int e = graph.firstEdge[from]; e != graph.firstEdge[from + 1]; e++) {
+        if (graph.edgeTarget[e] == to) {
+            edges.push_back(e);
+            if (from != to)             // a loop's twin is found on its own
+                edges.push_back(graph.edgeTwin[e]);
+        }
+    }
+    if (edges.empty())
+        return false;
+    int edge = edges[0];
+
+    double cheaperCost = numeric_limits<double>::infinity();
+    for (int e : edges) {
+        bool wasClosed = snap.states.closed(e);
+        double wasCost = snap.edgeCost(e);
+        bool closed = wasClosed;
+        double oldCost = snap.states.costOverride(e);
+        double cost = oldCost;
+        change(closed, cost);
+        cost = static_cast<float>(cost);    // as it will be stored
+
+        double length = graph.length(e);
+        if (length > 0) {
+            if (oldCost >= 0) {
+                auto it = m_overrideRatios.find(oldCost / length);
+                if (it != m_overrideRatios.end())
+                    m_overrideRatios.erase(it);
+            }
+            if (cost >= 0)
+                m_overrideRatios.insert(cost / length);
+        }
+
+        bool wasDefault = snap.states.isDefault(e);
+        snap.states.set(e, closed, cost);
+        bool isDefault = snap.states.isDefault(e);
+        snap.changedEdges += (wasDefault ? 1 : 0) - (isDefault ? 1 : 0);
+        if (!closed && (wasClosed || snap.edgeCost(e) < wasCost))
+            cheaperCost = min(cheaperCost, snap.edgeCost(e));
+
+        // only the chain holding this edge needs its cost looked at again
+        int chain = graph.edgeChain[e];
+        if (wasDefault && !isDefault)
+            snap.chainChanges.set(chain, snap.chainChanges[chain] + 1);
+        else if (!wasDefault && isDefault)
+            snap.chainChanges.set(chain, snap.chainChanges[chain] - 1);
     }
 
+    if (cheaperCost < numeric_limits<double>::infinity())
+        noteCheaper(snap, start, end, cheaperCost);
+
+    string key = segmentKey(start, end);
+    if (snap.states.isDefault(edge))
+        m_segmentStates.erase(key);
+    else
+        m_segmentStates[key] = SegmentState{ start, end, snap.states.closed(edge), snap.states.costOverride(edge) };
+
+    snap.heuristicScale = 1;
+    if (!m_overrideRatios.empty() && *m_overrideRatios.begin() < 1)
+        snap.heuristicScale = *m_overrideRatios.begin();
     return true;
 }
 
+void StreetMapImpl::noteCheaper(GraphSnapshot& snap, const GeoCoord& start, const GeoCoord& end, double cost)
+{
+    // A long list would make every cache lookup walk it, so it's started
+    // again, and the routes found before it lose their check.
+    if (snap.numCheaper >= kMaxCheaperSegments) {
+        snap.cheaper.reset();
+        snap.numCheaper = 0;
+        snap.cheaperSince = snap.version;
+    }
+    shared_ptr<CheaperSegment> segment = make_shared<CheaperSegment>();
+    segment->version = snap.version;
+    segment->start = start;
+    segment->end = end;
+    segment->cost = cost;
+    segment->older = snap.cheaper;
+    snap.cheaper = segment;
+    snap.numCheaper++;
+}
+
+void StreetMapImpl::changeUnloadedSegment(GraphSnapshot& snap, const GeoCoord& start, const GeoCoord& end,
+    const function<void(bool& closed, double& cost)>& change)
+{
+    string key = segmentKey(start, end);
+    auto it = m_segmentStates.find(key);
+    SegmentState state = it != m_segmentStates.end() ? it->second : SegmentState{ start, end, false, -1 };
+    bool wasClosed = state.closed;
+    double length = distanceEarthMiles(start, end);
+    double wasCost = state.cost >= 0 ? state.cost : length;
+    change(state.closed, state.cost);
+    state.cost = static_cast<float>(state.cost);
+    double cost = state.cost >= 0 ? state.cost : length;
+    if (!state.closed && (wasClosed || cost < wasCost))
+        noteCheaper(snap, start, end, cost);
+    if (!state.closed && state.cost < 0)
+        m_segmentStates.erase(key);
+    else
+        m_segmentStates[key] = state;
+}
+
+bool StreetMapImpl::writeTiles(string mapFile, string directory, double tileDegrees)
+{
+    if (!(tileDegrees > 0))
+        return false;
+
+    ifstream is(mapFile);
+    if (!is)
+        return false;
+
+    // each tile's segment lines, by street, streets in the order they're read
+    map<TileId, map<int, vector<string>>> tiles;
+    vector<string> names;
+    bool ok = readMapFile(is, names, [&](int nameId, const GeoCoord& start, const GeoCoord& end) {
+        string line = start.latitudeText + " " + start.longitudeText + " " + end.latitudeText + " " + end.longitudeText;
+        TileId first = tileOf(start, tileDegrees);
+        TileId second = tileOf(end, tileDegrees);
+        tiles[first][nameId].push_back(line);
+        if (second != first)
+            tiles[second][nameId].push_back(line);
+    });
+    if (!ok)
+        return false;
+
+    for (const auto& tile : tiles) {
+        ofstream os(tileFileName(directory, tile.first));
+        for (const auto& street : tile.second) {
+            os << names[street.first] << '\n' << street.second.size() << '\n';
+            for (const string& line : street.second)
+                os << line << '\n';
+        }
+        if (!os)
+            return false;
+    }
+
+    // the index: the tile size, then the column and row of every tile
+    ofstream index(tileIndexName(directory));
+    index << setprecision(17) << tileDegrees << '\n';
+    for (const auto& tile : tiles)
+        index << tile.first.first << ' ' << tile.first.second << '\n';
+    return static_cast<bool>(index);
+}
+
+bool StreetMapImpl::loadTiled(string directory, const MapLoadOptions& options)
+{
+    ifstream is(tileIndexName(directory));
+    if (!is)
+        return false;
+
+    double tileDegrees;
+    if (!(is >> tileDegrees) || !(tileDegrees > 0))
+        return false;
+    set<TileId> index;
+    TileId t;
+    while (is >> t.first >> t.second)
+        index.insert(t);
+    if (!is.eof())
+        return false;
+
+    lock_guard<mutex> lock(m_updateLock);
+
+    m_tileDirectory = directory;
+    m_tileDegrees = tileDegrees;
+    m_options = options;
+    forgetTiles();
+    m_tileIndex.swap(index);
+    buildFromTiles(false);
+    return true;
+}
+
+void StreetMapImpl::forgetTiles()
+{
+    m_tileIndex.clear();
+    m_resident.clear();
+    m_recent.clear();
+    m_tileNodeIds.reset();
+    m_tileCoords.clear();
+    m_mapLoads++;
+}
+
+void StreetMapImpl::addTile(const TileId& t, shared_ptr<const MapTile> tile, bool recent)
+{
+    auto where = recent ? m_recent.begin() : m_recent.end();
+    ResidentTile& resident = m_resident[t];
+    resident.tile = tile;
+    resident.recent = m_recent.insert(where, t);
+    numberTile(resident);
+}
+
+void StreetMapImpl::numberTile(ResidentTile& resident)
+{
+    // The nodes new to the map are numbered in the order asked for, within
+    // the tile; the rest keep the numbers they have.
+    const MapTile& tile = *resident.tile;
+    StreetGraph nodes;
+    nodes.coords = tile.nodes;
+    vector<int> order = nodeOrder(nodes, tile.segStart, tile.segEnd, m_options.nodeOrder);
+
+    resident.ids.assign(tile.nodes.size(), -1);
+    for (int i : order) {
+        const int* id = m_tileNodeIds.find(tile.nodes[i]);
+        if (id) {
+            resident.ids[i] = *id;
+            continue;
+        }
+        resident.ids[i] = m_tileCoords.size();
+        m_tileCoords.push_back(tile.nodes[i]);
+        m_tileNodeIds.associate(tile.nodes[i], resident.ids[i]);
+    }
+}
+
+void StreetMapImpl::buildFromTiles(bool keepChanges)
+{
+    size_t numResident = 0;
+    for (const auto& resident : m_resident)
+        numResident += resident.second.tile->nodes.size();
+    bool renumbered = !keepChanges || m_tileCoords.size() > 2 * numResident + 1024;
+    if (renumbered) {
+        m_tileNodeIds.reset();
+        m_tileCoords.clear();
+        for (auto& resident : m_resident)
+            numberTile(resident.second);
+    }
+
+    // Every node numbered is in the graph, but only those in resident tiles
+    // can be found; the rest have no edges.  A node outside the tile it was
+    // read from is either inside another resident tile, or in one that isn't,
+    // and so incomplete.
+    shared_ptr<StreetGraph> graph = make_shared<StreetGraph>();
+    graph->coords = m_tileCoords;
+    vector<int> segStart, segEnd, segName;
+    vector<bool> incomplete(m_tileCoords.size(), false);
+    vector<bool> found(m_tileCoords.size(), false);
+    unordered_map<string, int> nameIds;
+
+    for (const auto& resident : m_resident) {
+        const MapTile& tile = *resident.second.tile;
+        const vector<int>& id = resident.second.ids;
+        for (size_t i = 0; i < tile.nodes.size(); i++) {
+            if (found[id[i]])
+                continue;
+            found[id[i]] = true;
+            graph->nodeIds.associate(tile.nodes[i], id[i]);
+            TileId home = tileOf(tile.nodes[i], m_tileDegrees);
+            incomplete[id[i]] = !m_resident.count(home) && m_tileIndex.count(home);
+        }
+
+        for (size_t i = 0; i < tile.segStart.size(); i++) {
+            // a segment in two loaded tiles is taken from the one it belongs to
+            if (!tile.inside[tile.segStart[i]] && !incomplete[id[tile.segStart[i]]])
+                continue;
+
+            const string& name = tile.names[tile.segName[i]];
+            auto it = nameIds.find(name);
+            if (it == nameIds.end()) {
+                it = nameIds.emplace(name, graph->names.size()).first;
+                graph->names.push_back(name);
+            }
+
+            segStart.push_back(id[tile.segStart[i]]);
+            segEnd.push_back(id[tile.segEnd[i]]);
+            segName.push_back(it->second);
+        }
+    }
+
+    // the nodes are already in the order asked for
+    MapLoadOptions options = m_options;
+    options.nodeOrder = MapLoadOptions::FILE_ORDER;
+    buildEdges(*graph, segStart, segEnd, segName, options, incomplete);
+    publish(graph, keepChanges, renumbered);
+}
+
+shared_ptr<const GraphSnapshot> StreetMapImpl::snapshotCovering(const vector<GeoCoord>& points)
+{
+    shared_ptr<const GraphSnapshot> current = snapshot();
+    if (current->tileDegrees == 0)
+        return current;
+
+    // Most queries find their tiles loaded already, and take no lock but to
+    // mark the tiles used, which is skipped if an update holds it.
+    set<TileId> wanted;
+    for (const GeoCoord& gc : points)
+        wanted.insert(tileOf(gc, current->tileDegrees));
+    bool covered = true;
+    for (const TileId& t : wanted)
+        covered = covered && binary_search(current->tiles->begin(), current->tiles->end(), t);
+    if (covered) {
+        unique_lock<mutex> lock(m_updateLock, try_to_lock);
+        if (lock.owns_lock()) {
+            for (const TileId& t : wanted) {
+                auto it = m_resident.find(t);
+                if (it != m_resident.end())
+                    m_recent.splice(m_recent.begin(), m_recent, it->second.recent);
+            }
+        }
+        return current;
+    }
+
+    // Otherwise the tiles to read are chosen under the lock, read without
+    // it, and added under it again, each time against the map as it is then.
+    for (;;) {
+        vector<TileId> toRead;
+        vector<bool> toReadWanted;
+        string directory;
+        double tileDegrees;
+        unsigned long long mapLoads;
+        {
+            lock_guard<mutex> lock(m_updateLock);
+            if (m_tileDegrees == 0)
+                return m_current;
+
+            wanted.clear();
+            for (const GeoCoord& gc : points)
+                wanted.insert(tileOf(gc, m_tileDegrees));
+            for (const TileId& t : wanted) {
+                auto it = m_resident.find(t);
+                if (it != m_resident.end())
+                    m_recent.splice(m_recent.begin(), m_recent, it->second.recent);
+                else if (m_tileIndex.count(t)) {
+                    toRead.push_back(t);
+                    toReadWanted.push_back(true);
+                }
+            }
+            if (toRead.empty())
+                return m_current;
+
+            // A search that needed a tile is likely to go on into its
+            // neighbours, so read those too while there is room, as the first
+            // to be dropped.
+            size_t room = m_options.maxResidentTiles;
+            size_t numResident = m_resident.size() + toRead.size();
+            for (const TileId& t : wanted) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        TileId near(t.first + dx, t.second + dy);
+                        if (numResident < room && !m_resident.count(near) && m_tileIndex.count(near)
+                            && find(toRead.begin(), toRead.end(), near) == toRead.end()) {
+                            toRead.push_back(near);
+                            toReadWanted.push_back(false);
+                            numResident++;
+                        }
+                    }
+                }
+            }
+
+            directory = m_tileDirectory;
+            tileDegrees = m_tileDegrees;
+            mapLoads = m_mapLoads;
+        }
+
+        vector<shared_ptr<const MapTile>> read(toRead.size());
+        for (size_t i = 0; i < toRead.size(); i++) {
+            shared_ptr<MapTile> tile = make_shared<MapTile>();
+            if (readTile(directory, tileDegrees, toRead[i], *tile))
+                read[i] = tile;
+        }
+
+        lock_guard<mutex> lock(m_updateLock);
+        if (m_mapLoads != mapLoads)
+            continue;               // another map was loaded meanwhile
+
+        bool changed = false;
+        for (size_t i = 0; i < toRead.size(); i++) {
+            if (!read[i]) {
+                // it can't be read, so its neighbours' nodes in it are complete
+                m_tileIndex.erase(toRead[i]);
+                changed = true;
+            }
+            else if (!m_resident.count(toRead[i])) {        // another query may have added it
+                addTile(toRead[i], read[i], toReadWanted[i]);
+                changed = true;
+            }
+        }
+
+        // drop the least recently used tiles, but none that were asked for
+        size_t room = m_options.maxResidentTiles;
+        for (auto it = m_recent.end(); m_resident.size() > room && it != m_recent.begin(); ) {
+            --it;
+            if (wanted.count(*it))
+                continue;
+            m_resident.erase(*it);
+            it = m_recent.erase(it);
+            changed = true;
+        }
+
+        if (changed)
+            buildFromTiles(true);
+
+        // another query may have dropped a tile asked for before these were read
+        bool done = true;
+        for (const TileId& t : wanted)
+            done = done && (m_resident.count(t) || !m_tileIndex.count(t));
+        if (done)
+            return m_current;
+    }
+}
+
+bool StreetMapImpl::closeSegment(const GeoCoord& start, const GeoCoord& end)
+{
+    return updateSegment(start, end, [](bool& closed, double&) { closed = true; });
+}
+
+bool StreetMapImpl::reopenSegment(const GeoCoord& start, const GeoCoord& end)
+{
+    return updateSegment(start, end, [](bool& closed, double&) { closed = false; });
+}
+
+bool StreetMapImpl::setSegmentCost(const GeoCoord& start, const GeoCoord& end, double cost)
+{
+    if (cost < 0)
+        return false;
+    return updateSegment(start, end, [cost](bool&, double& c) { c = cost; });
+}
+
+bool StreetMapImpl::clearSegmentCost(const GeoCoord& start, const GeoCoord& end)
+{
+    return updateSegment(start, end, [](bool&, double& c) { c = -1; });
+}
+
 //******************** StreetMap functions ************************************
 
 // These functions simply delegate to StreetMapImpl's functions.
@@ -135,10 +1364,81 @@ StreetMap::~StreetMap()
 
 bool StreetMap::load(string mapFile)
 {
-    return m_impl->load(mapFile);
+    return m_impl->load(mapFile, MapLoadOptions());
+}
+
+bool StreetMap::load(string mapFile, const MapLoadOptions& options)
+{
+    return m_impl->load(mapFile, options);
 }
 
 bool StreetMap::getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs) const
 {
    return m_impl->getSegmentsThatStartWith(gc, segs);
 }
+
+bool StreetMap::writeTiles(string mapFile, string directory, double tileDegrees)
+{
+    return StreetMapImpl::writeTiles(mapFile, directory, tileDegrees);
+}
+
+bool StreetMap::loadTiled(string directory, const MapLoadOptions& options)
+{
+    return m_impl->loadTiled(directory, options);
+}
+
+bool StreetMap::closeSegment(const GeoCoord& start, const GeoCoord& end)
+{
+    return m_impl->closeSegment(start, end);
+}
+
+bool StreetMap::reopenSegment(const GeoCoord& start, const GeoCoord& end)
+{
+    return m_impl->reopenSegment(start, end);
+}
+
+bool StreetMap::setSegmentCost(const GeoCoord& start, const GeoCoord& end, double cost)
+{
+    return m_impl->setSegmentCost(start, end, cost);
+}
+
+bool StreetMap::clearSegmentCost(const GeoCoord& start, const GeoCoord& end)
+{
+    return m_impl->clearSegmentCost(start, end);
+}
+
+bool StreetMap::loadSpeedProfiles(string profileFile)
+{
+    return m_impl->loadSpeedProfiles(profileFile);
+}
+
+shared_ptr<const GraphSnapshot> StreetMap::snapshot() const
+{
+    return m_impl->snapshot();
+}
+
+shared_ptr<const GraphSnapshot> StreetMap::snapshotCovering(const vector<GeoCoord>& points) const
+{
+    return m_impl->snapshotCovering(points);
+}
+
+unsigned long long StreetMap::version() const
+{
+    return m_impl->snapshot()->version;
+}
+
+void StreetMap::setRouteCacheSize(size_t maxBytes)
+{
+    m_impl->setRouteCacheSize(maxBytes);
+}
+
+RouteCacheStats StreetMap::routeCacheStats() const
+{
+    shared_ptr<RouteCache> cache = m_impl->routeCache();
+    return cache ? cache->stats() : RouteCacheStats();
+}
+
+shared_ptr<RouteCache> StreetMap::routeCache() const
+{
+    return m_impl->routeCache();
+}
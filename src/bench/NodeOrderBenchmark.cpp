@@ -0,0 +1,312 @@
+// NodeOrderBenchmark.cpp
+
+// Compares the node orders of MapLoadOptions on a large synthetic map: a
+// square grid of streets, each block cut into a few zigzag segments, written
+// out with its streets and segments shuffled so that file order scatters
+// neighbouring nodes.  Each order loads the same file and routes the same
+// random queries, which must come out the same length.
+//
+// Besides the time per query it counts cache misses two ways: from the CPU's
+// own counter (Linux only, and only where perf events are allowed), and from
+// a simulated 1 MiB, 16-way cache fed the addresses a junction-to-junction
+// A* over the graph reads, which works anywhere and doesn't vary from run
+// to run.
+//
+// Build from src/bench:
+//   g++ -std=c++17 -O2 -I.. NodeOrderBenchmark.cpp $(ls ../*.cpp | grep -v main.cpp) -o NodeOrderBenchmark -lpthread
+// Run:
+//   ./NodeOrderBenchmark [gridSize = 500] [queries = 20] [segmentsPerBlock = 3]
+
+#include "provided.h"
+#include "StreetGraph.h"
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+using namespace std;
+
+// hardware cache misses on this thread, where the kernel lets us count them
+class MissCounter
+{
+public:
+    MissCounter()
+     : m_fd(-1)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~MissCounter()
+    {
+#ifdef __linux__
+        if (m_fd >= 0)
+            close(m_fd);
+#endif
+    }
+
+    bool available() const { return m_fd >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    long long stop()
+    {
+        long long count = -1;
+#ifdef __linux__
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+                count = -1;
+        }
+#endif
+        return count;
+    }
+
+private:
+    int m_fd;
+};
+
+// A set-associative cache with LRU replacement within each set.
+class SimulatedCache
+{
+public:
+    SimulatedCache(size_t bytes, size_t ways)
+     : m_ways(ways), m_sets(bytes / kLineBytes / ways), m_tags(m_sets * ways, kEmpty), m_misses(0)
+    {}
+
+    void touch(const void* address)
+    {
+        uintptr_t line = reinterpret_cast<uintptr_t>(address) / kLineBytes;
+        uintptr_t* set = &m_tags[(line % m_sets) * m_ways];
+        size_t hit = 0;
+        while (hit < m_ways && set[hit] != line)
+            hit++;
+        if (hit == m_ways) {
+            m_misses++;
+            hit = m_ways - 1;
+        }
+        // most recently used first
+        for (size_t k = hit; k > 0; k--)
+            set[k] = set[k - 1];
+        set[0] = line;
+    }
+
+    void clear() { fill(m_tags.begin(), m_tags.end(), kEmpty); }
+
+    unsigned long long misses() const { return m_misses; }
+
+private:
+    static constexpr size_t kLineBytes = 64;
+    static constexpr uintptr_t kEmpty = ~uintptr_t(0);
+    size_t m_ways;
+    size_t m_sets;
+    vector<uintptr_t> m_tags;
+    unsigned long long m_misses;
+};
+
+static string coordText(double degrees)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.7f", degrees);
+    return text;
+}
+
+static const double kLat0 = 34.0, kLon0 = -118.5, kStep = 0.002;
+
+static GeoCoord corner(int i, int j)
+{
+    return GeoCoord(coordText(kLat0 + i * kStep), coordText(kLon0 + j * kStep));
+}
+
+// The grid as a map file, streets and the segments within them shuffled.
+static bool writeGrid(const string& file, int size, int pieces)
+{
+    struct Street {
+        string name;
+        vector<string> segments;
+    };
+    vector<Street> streets;
+    for (int row = 0; row < 2 * size; row++) {
+        bool across = row < size;
+        int line = across ? row : row - size;
+        Street street;
+        street.name = (across ? "Row " : "Col ") + to_string(line) + (across ? " Street" : " Avenue");
+        for (int k = 0; k + 1 < size; k++) {
+            double lat = kLat0 + (across ? line : k) * kStep;
+            double lon = kLon0 + (across ? k : line) * kStep;
+            vector<pair<double, double>> points;
+            for (int p = 0; p <= pieces; p++) {
+                double along = kStep * p / pieces;
+                double wiggle = (p == 0 || p == pieces) ? 0 : 0.00003 * ((p % 2) * 2 - 1);
+                points.emplace_back(across ? lat + wiggle : lat + along, across ? lon + along : lon + wiggle);
+            }
+            for (int p = 0; p < pieces; p++)
+                street.segments.push_back(coordText(points[p].first) + " " + coordText(points[p].second) + " " +
+                                          coordText(points[p + 1].first) + " " + coordText(points[p + 1].second));
+        }
+        streets.push_back(street);
+    }
+
+    mt19937 engine(1);
+    shuffle(streets.begin(), streets.end(), engine);
+    ofstream os(file);
+    for (Street& street : streets) {
+        shuffle(street.segments.begin(), street.segments.end(), engine);
+        os << street.name << '\n' << street.segments.size() << '\n';
+        for (const string& segment : street.segments)
+            os << segment << '\n';
+    }
+    return static_cast<bool>(os);
+}
+
+// Junction-to-junction A* with the crow heuristic, reading the graph the way
+// the router does, with every read of the graph and of the search's own
+// node-indexed arrays passed to cache.
+static void replaySearch(const StreetGraph& g, int start, int goal, vector<double>& dist, SimulatedCache& cache)
+{
+    typedef pair<double, int> Entry;
+    priority_queue<Entry, vector<Entry>, greater<Entry>> open;
+    vector<int> touched;
+    dist[start] = 0;
+    touched.push_back(start);
+    open.push(Entry(g.crowMiles(start, goal), start));
+    while (!open.empty()) {
+        int u = open.top().second;
+        double f = open.top().first;
+        open.pop();
+        cache.touch(&dist[u]);
+        cache.touch(&g.coords[u]);
+        if (f > dist[u] + g.crowMiles(u, goal) + 1e-12)
+            continue;
+        if (u == goal)
+            break;
+        cache.touch(&g.firstChain[u]);
+        for (int c = g.firstChain[u]; c != g.firstChain[u + 1]; c++) {
+            cache.touch(&g.chainTarget[c]);
+            cache.touch(&g.chainLength[c]);
+            int v = g.chainTarget[c];
+            double length = dist[u] + g.chainLength[c];
+            cache.touch(&dist[v]);
+            if (length < dist[v]) {
+                if (dist[v] == numeric_limits<double>::infinity())
+                    touched.push_back(v);
+                dist[v] = length;
+                cache.touch(&g.coords[v]);
+                open.push(Entry(length + g.crowMiles(v, goal), v));
+            }
+        }
+    }
+    for (int v : touched)
+        dist[v] = numeric_limits<double>::infinity();
+}
+
+int main(int argc, char* argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 500;
+    int numQueries = argc > 2 ? atoi(argv[2]) : 20;
+    int pieces = argc > 3 ? atoi(argv[3]) : 3;
+    if (size < 2 || numQueries < 1 || pieces < 1) {
+        cerr << "Usage: " << argv[0] << " [gridSize] [queries] [segmentsPerBlock]" << endl;
+        return 1;
+    }
+
+    string mapFile = "nodeorder_benchmark_map.txt";
+    if (!writeGrid(mapFile, size, pieces)) {
+        cerr << "Can't write " << mapFile << endl;
+        return 1;
+    }
+
+    mt19937 engine(7);
+    uniform_int_distribution<int> pick(0, size - 1);
+    vector<pair<GeoCoord, GeoCoord>> queries;
+    for (int q = 0; q < numQueries; q++)
+        queries.emplace_back(corner(pick(engine), pick(engine)), corner(pick(engine), pick(engine)));
+
+    const char* names[] = { "FILE_ORDER", "HILBERT_ORDER", "BFS_ORDER" };
+    MapLoadOptions::NodeOrder orders[] = { MapLoadOptions::FILE_ORDER, MapLoadOptions::HILBERT_ORDER,
+                                           MapLoadOptions::BFS_ORDER };
+    vector<double> expected;
+    MissCounter counter;
+    printf("%d x %d grid, %d segments a block, %d queries\n", size, size, pieces, numQueries);
+    printf("%-14s %10s %12s %16s %16s\n", "order", "load ms", "ms/query", "misses/query", "simulated/query");
+    for (int k = 0; k < 3; k++) {
+        StreetMap sm;
+        MapLoadOptions options;
+        options.nodeOrder = orders[k];
+        auto t0 = chrono::steady_clock::now();
+        if (!sm.load(mapFile, options)) {
+            cerr << "Can't load " << mapFile << endl;
+            return 1;
+        }
+        double loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+        RouterOptions routerOptions;
+        routerOptions.useRouteCache = false;
+        PointToPointRouter router(&sm, routerOptions);
+        vector<double> lengths;
+        counter.start();
+        t0 = chrono::steady_clock::now();
+        for (const auto& q : queries) {
+            list<StreetSegment> route;
+            double miles = -1;
+            router.generatePointToPointRoute(q.first, q.second, route, miles);
+            lengths.push_back(miles);
+        }
+        double queryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count() / numQueries;
+        long long misses = counter.stop();
+
+        if (expected.empty())
+            expected = lengths;
+        for (int q = 0; q < numQueries; q++) {
+            if (abs(lengths[q] - expected[q]) > 1e-9) {
+                cerr << names[k] << " routed query " << q << " differently" << endl;
+                return 1;
+            }
+        }
+
+        const StreetGraph& g = *sm.snapshot()->graph;
+        SimulatedCache cache(size_t(1) << 20, 16);
+        vector<double> dist(g.numNodes(), numeric_limits<double>::infinity());
+        for (const auto& q : queries) {
+            cache.clear();
+            replaySearch(g, g.findNode(q.first), g.findNode(q.second), dist, cache);
+        }
+
+        string measured = misses >= 0 ? to_string(misses / numQueries) : "n/a";
+        printf("%-14s %10.0f %12.2f %16s %16llu\n", names[k], loadMs, queryMs, measured.c_str(),
+               cache.misses() / numQueries);
+    }
+    remove(mapFile.c_str());
+    return 0;
+}
@@ -0,0 +1,88 @@
+// QueueBenchmark.cpp
+
+// Compares the priority queues RouterOptions offers (BINARY_HEAP, the lazy
+// std::priority_queue; FOUR_ARY_HEAP, the indexed 4-ary heap; RADIX_HEAP)
+// by routing the same random queries through PointToPointRouter on a map
+// file.  The route cache is off, so every query searches.  Routes must come
+// out the same length, the radix heap's to within its key scaling.
+//
+// Build from src/bench:
+//   g++ -std=c++17 -O2 -I.. QueueBenchmark.cpp $(ls ../*.cpp | grep -v main.cpp) -o QueueBenchmark -lpthread
+// Run:
+//   ./QueueBenchmark mapFile [queries = 400] [hilbert]
+
+#include "provided.h"
+#include "StreetGraph.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " mapFile [queries] [hilbert]" << endl;
+        return 1;
+    }
+    int numQueries = argc > 2 ? atoi(argv[2]) : 400;
+    MapLoadOptions options;
+    if (argc > 3 && strcmp(argv[3], "hilbert") == 0)
+        options.nodeOrder = MapLoadOptions::HILBERT_ORDER;
+
+    StreetMap sm;
+    if (!sm.load(argv[1], options)) {
+        cerr << "Can't load " << argv[1] << endl;
+        return 1;
+    }
+    const StreetGraph& g = *sm.snapshot()->graph;
+
+    mt19937 engine(7);
+    uniform_int_distribution<int> pick(0, g.numNodes() - 1);
+    vector<pair<GeoCoord, GeoCoord>> queries;
+    for (int q = 0; q < numQueries; q++)
+        queries.emplace_back(g.coords[pick(engine)], g.coords[pick(engine)]);
+
+    const char* names[] = { "BINARY_HEAP", "FOUR_ARY_HEAP", "RADIX_HEAP" };
+    RouterOptions::Queue queues[] = { RouterOptions::BINARY_HEAP, RouterOptions::FOUR_ARY_HEAP,
+                                      RouterOptions::RADIX_HEAP };
+    printf("%s: %d nodes, %d queries\n", argv[1], g.numNodes(), numQueries);
+    printf("%-14s %12s\n", "queue", "ms/query");
+    vector<double> expected;
+    for (int k = 0; k < 3; k++) {
+        RouterOptions routerOptions;
+        routerOptions.queue = queues[k];
+        routerOptions.useRouteCache = false;
+        PointToPointRouter router(&sm, routerOptions);
+
+        // one query first, so every queue starts with its workspace allocated
+        list<StreetSegment> route;
+        double miles;
+        router.generatePointToPointRoute(queries[0].first, queries[0].second, route, miles);
+
+        vector<double> lengths;
+        auto t0 = chrono::steady_clock::now();
+        for (const auto& q : queries) {
+            miles = -1;
+            router.generatePointToPointRoute(q.first, q.second, route, miles);
+            lengths.push_back(miles);
+        }
+        double queryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count() / numQueries;
+
+        if (expected.empty())
+            expected = lengths;
+        for (int q = 0; q < numQueries; q++) {
+            if (abs(lengths[q] - expected[q]) > 1e-3 * max(1.0, expected[q])) {
+                cerr << names[k] << " routed query " << q << " differently" << endl;
+                return 1;
+            }
+        }
+        printf("%-14s %12.3f\n", names[k], queryMs);
+    }
+    return 0;
+}
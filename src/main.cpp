@@ -11,7 +11,6 @@
 using namespace std;
 
 bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v);
-bool parseDelivery(string line, string& lat, string& lon, string& item);
 
 unsigned int hasher(const std::string& str) {
     std::hash<std::string> hash;
@@ -91,43 +90,9 @@ int main(int argc, char *argv[])
 
 bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v)
 {
-    ifstream inf(deliveriesFile);
-    if (!inf)
-        return false;
-    string lat;
-    string lon;
-    inf >> lat >> lon;
-    inf.ignore(10000, '\n');
-    depot = GeoCoord(lat, lon);
-    string line;
-    while (getline(inf, line))
-    {
-        string item;
-        if (parseDelivery(line, lat, lon, item))
-            v.push_back(DeliveryRequest(item, GeoCoord(lat, lon)));
-    }
-    return true;
-}
-
-bool parseDelivery(string line, string& lat, string& lon, string& item)
-{
-    const size_t colon = line.find(':');
-    if (colon == string::npos)
-    {
-        cout << "Missing colon in deliveries file line: " << line << endl;
-        return false;
-    }
-    istringstream iss(line.substr(0, colon));
-    if (!(iss >> lat >> lon))
-    {
-        cout << "Bad format in deliveries file line: " << line << endl;
-        return false;
-    }
-    item = line.substr(colon + 1);
-    if (item.empty())
-    {
-        cout << "Missing item in deliveries file line: " << line << endl;
-        return false;
-    }
-    return true;
+    vector<DeliveryFileError> errors;
+    bool ok = loadDeliveryFile(deliveriesFile, depot, v, errors);
+    for (const DeliveryFileError& e : errors)
+        cout << e.message << " in deliveries file line " << e.line << ": " << e.text << endl;
+    return ok;
 }
@@ -8,10 +8,31 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <iterator>
+#include <memory>
+#include <limits>
+#include <utility>
+#include <atomic>
+#include <future>
 
 enum DeliveryResult
 {
-    DELIVERY_SUCCESS, NO_ROUTE, BAD_COORD
+    DELIVERY_SUCCESS, NO_ROUTE, BAD_COORD, OVER_CAPACITY, CANCELLED, BAD_POSITION
+};
+
+  // Asks work started with it to stop.  Copies share one flag, so the caller
+  // keeps a copy and cancels it while the work runs elsewhere.  The work
+  // checks it now and then and gives up soon after, not at once.
+class CancellationToken
+{
+public:
+    CancellationToken()
+     : m_cancelled(std::make_shared<std::atomic<bool>>(false))
+    {}
+    void cancel() { m_cancelled->store(true); }
+    bool cancelled() const { return m_cancelled->load(std::memory_order_relaxed); }
+private:
+    std::shared_ptr<std::atomic<bool>> m_cancelled;
 };
 
 struct GeoCoord
@@ -72,6 +93,47 @@ bool operator==(const StreetSegment& lhs, const StreetSegment& rhs)
 }
 
 class StreetMapImpl;
+struct GraphSnapshot;
+class RouteCache;
+
+struct MapLoadOptions
+{
+      // How nodes are numbered, which decides where they sit in memory.
+      // FILE_ORDER keeps the order they first appear in the map file.
+      // HILBERT_ORDER follows a Hilbert curve over the map, and BFS_ORDER a
+      // breadth-first walk of the streets; both put nearby intersections
+      // next to each other, so a search touches fewer cache lines and pages.
+    enum NodeOrder { FILE_ORDER, HILBERT_ORDER, BFS_ORDER };
+
+    MapLoadOptions()
+     : nodeOrder(FILE_ORDER), maxResidentTiles(64), compressed(false)
+    {}
+
+    NodeOrder nodeOrder;
+
+      // For a tiled map, the most tiles kept in memory at once.  A query can
+      // go over it while it runs if it needs more.
+    int maxResidentTiles;
+
+      // Keep the part of the map that searches run over packed small, at
+      // some cost in speed.  Lengths are then stored to within about a foot,
+      // so a route can be longer than the best one by that much per street.
+    bool compressed;
+};
+
+struct RouteCacheStats
+{
+    RouteCacheStats()
+     : hits(0), misses(0), evictions(0), invalidations(0), entries(0), bytes(0)
+    {}
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;       // routes dropped to stay within the size
+    unsigned long long invalidations;   // routes dropped because the map changed
+    size_t entries;
+    size_t bytes;
+};
 
 class StreetMap
 {
@@ -79,7 +141,54 @@ public:
     StreetMap();
     ~StreetMap();
     bool load(std::string mapFile);
+    bool load(std::string mapFile, const MapLoadOptions& options);
     bool getSegmentsThatStartWith(const GeoCoord& gc, std::vector<StreetSegment>& segs) const;
+
+      // Road closures and cost changes, applied to both directions of the
+      // segment from start to end.  Each returns false if there is no such
+      // segment.  Queries already running keep the version of the map they
+      // started with; queries started afterwards see the change.
+    bool closeSegment(const GeoCoord& start, const GeoCoord& end);
+    bool reopenSegment(const GeoCoord& start, const GeoCoord& end);
+    bool setSegmentCost(const GeoCoord& start, const GeoCoord& end, double cost);
+    bool clearSegmentCost(const GeoCoord& start, const GeoCoord& end);
+
+      // Speed profiles for travel-time routing, read from a file after the map
+      // itself has been loaded.  Without one every street is driven at a
+      // constant 25 mph.  Loading the map again drops the profiles.  Returns
+      // false, keeping any profiles it had, if the file can't be read or a
+      // speed in it isn't a finite number above 0.
+    bool loadSpeedProfiles(std::string profileFile);
+
+      // Tiled maps, for maps too big to read whole.  writeTiles cuts a map
+      // file into squares tileDegrees on a side and writes one file per
+      // square, plus an index, into directory (which must already exist).
+      // loadTiled opens such a directory without reading any tiles: a tile is
+      // read when a query first reaches it, and the least recently used are
+      // dropped when there are more than options.maxResidentTiles.  Tiles
+      // are read without holding up other queries or updates.
+    static bool writeTiles(std::string mapFile, std::string directory, double tileDegrees);
+    bool loadTiled(std::string directory, const MapLoadOptions& options);
+
+      // The current version of the map.  The version number goes up with every
+      // load and every update, and whenever a tiled map reads or drops tiles.
+    std::shared_ptr<const GraphSnapshot> snapshot() const;
+    unsigned long long version() const;
+
+      // The current version, having first read the tiles that points lie in
+      // if the map is tiled.
+    std::shared_ptr<const GraphSnapshot> snapshotCovering(const std::vector<GeoCoord>& points) const;
+
+      // A cache of shortest routes (not timed ones), shared by every router
+      // on this map.  Routes are kept by their end points, in about maxBytes.
+      // An update drops only the routes it could change: those it closes or
+      // makes dearer, and those a segment it makes cheaper could beat.  A
+      // newly loaded map drops them all; a tiled map reading or dropping
+      // tiles keeps them.  Off to begin with; a size of 0 turns it
+      // off again.  Setting it empties it.
+    void setRouteCacheSize(size_t maxBytes);
+    RouteCacheStats routeCacheStats() const;
+    std::shared_ptr<RouteCache> routeCache() const;     // null when off
       // We prevent a StreetMap object from being copied or assigned.
     StreetMap(const StreetMap&) = delete;
     StreetMap& operator=(const StreetMap&) = delete;
@@ -89,16 +198,205 @@ private:
 
 class PointToPointRouterImpl;
 
+struct RouterOptions
+{
+      // The priority queue searches run on.  FOUR_ARY_HEAP lowers a queued
+      // node's key in place.  BINARY_HEAP is std::priority_queue, queueing a
+      // node again whenever its key drops.  RADIX_HEAP buckets keys scaled
+      // to integers (micro-miles, or milliseconds when routing by time).
+    enum Queue { BINARY_HEAP, FOUR_ARY_HEAP, RADIX_HEAP };
+
+    RouterOptions()
+     : queue(FOUR_ARY_HEAP), useRouteCache(true),
+       leftTurnSeconds(0), rightTurnSeconds(0), uTurnSeconds(0)
+    {}
+
+    Queue queue;
+
+      // look shortest routes up in the map's route cache, if it has one
+    bool useRouteCache;
+
+      // What each turn costs, in seconds: left and right turns from one
+      // street onto another, and U-turns.  Any above 0 makes the router
+      // search over the edges it arrives by rather than over intersections,
+      // so it knows which way it turns; such routes don't use the route
+      // cache.  Shortest routes count a second as the distance driven in it
+      // at 25 mph.
+    double leftTurnSeconds;
+    double rightTurnSeconds;
+    double uTurnSeconds;
+};
+
+// A route as the router finds it: the edges it runs along, in the version of
+// the map it was found in, which it keeps alive for as long as it's held.
+// StreetSegments are made only when asked for, so a caller that wants just
+// the distance, or the order of some stops, doesn't pay for them.
+class Route
+{
+public:
+    Route() : m_distance(0) {}
+
+    double distance() const { return m_distance; }     // miles
+    size_t size() const { return m_edges.size(); }
+    bool empty() const { return m_edges.empty(); }
+    void clear();
+
+      // the i-th segment, and its length in miles, direction as angleOfLine
+      // gives it, and street name
+    StreetSegment segment(size_t i) const;
+    double length(size_t i) const;
+    double angle(size_t i) const;
+    const std::string& streetName(size_t i) const;
+
+      // Visits the segments in order, making each one as it's reached.
+    class const_iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef StreetSegment value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const StreetSegment* pointer;
+        typedef StreetSegment reference;
+
+        const_iterator(const Route* route, size_t i) : m_route(route), m_i(i) {}
+        StreetSegment operator*() const { return m_route->segment(m_i); }
+        const_iterator& operator++() { m_i++; return *this; }
+        const_iterator operator++(int) { const_iterator old = *this; m_i++; return old; }
+        bool operator==(const const_iterator& other) const { return m_i == other.m_i; }
+        bool operator!=(const const_iterator& other) const { return m_i != other.m_i; }
+    private:
+        const Route* m_route;
+        size_t m_i;
+    };
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_edges.size()); }
+
+      // every segment, replacing what segments held
+    void getSegments(std::list<StreetSegment>& segments) const;
+
+private:
+    friend class PointToPointRouterImpl;
+
+    std::shared_ptr<const GraphSnapshot> m_snapshot;
+    std::vector<int> m_edges;
+    double m_distance;
+};
+
+  // What an asynchronous route search gives; result is CANCELLED if it was
+  // cancelled before it found a route.
+struct RouteResult
+{
+    RouteResult() : result(CANCELLED) {}
+    DeliveryResult result;
+    Route route;
+};
+
+  // What can be reached from a point within some distance by road.
+struct ReachableArea
+{
+      // every node (end of a segment) reached, nearest first, and how far
+      // each is by road
+    std::vector<GeoCoord> points;
+    std::vector<double> miles;
+
+      // the convex hull of points, counterclockwise; only if asked for
+    std::vector<GeoCoord> boundary;
+};
+
+  // How different alternative routes must be, as fractions of the cost of
+  // the shortest route: its length, but for segments with cost overrides.
+struct AlternativeRouteOptions
+{
+    AlternativeRouteOptions()
+     : maxStretch(0.25), maxShared(0.8), localOptimality(0.25)
+    {}
+
+      // no longer than the shortest route by more than this
+    double maxStretch;
+
+      // sharing no more than this with any route chosen before it
+    double maxShared;
+
+      // every part of it this long around where it turns off the shortest
+      // route is a shortest route itself, so it makes no needless detours
+    double localOptimality;
+};
+
 class PointToPointRouter
 {
 public:
     PointToPointRouter(const StreetMap* sm);
+    PointToPointRouter(const StreetMap* sm, const RouterOptions& options);
     ~PointToPointRouter();
     DeliveryResult generatePointToPointRoute(
         const GeoCoord& start,
         const GeoCoord& end,
         std::list<StreetSegment>& route,
         double& totalDistanceTravelled) const;
+      // The fastest route rather than the shortest, leaving start at
+      // departureTime (seconds since midnight) and driving at the speeds in
+      // the map's speed profiles.  arrivalTime is when the route reaches end.
+    DeliveryResult generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double departureTime,
+        std::list<StreetSegment>& route,
+        double& totalDistanceTravelled,
+        double& arrivalTime) const;
+      // The same two, giving the route as a Route.  The overloads above are
+      // these followed by Route::getSegments.
+    DeliveryResult generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        Route& route) const;
+    DeliveryResult generatePointToPointRoute(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double departureTime,
+        Route& route,
+        double& arrivalTime) const;
+      // Every point within maxMiles of start by road, going by the same costs
+      // shortest routes do, so closures and cost overrides count.  One search
+      // out from start, which stops where the budget runs out.
+    DeliveryResult findReachable(
+        const GeoCoord& start,
+        double maxMiles,
+        ReachableArea& area,
+        bool withBoundary = false) const;
+      // The same for several starts, searched on separate threads.  areas
+      // gets one entry per start; BAD_COORD if any start isn't on the map,
+      // whose area is left empty.
+    DeliveryResult findReachable(
+        const std::vector<GeoCoord>& starts,
+        double maxMiles,
+        std::vector<ReachableArea>& areas,
+        bool withBoundary = false) const;
+      // The shortest route from start to end and then up to k alternatives
+      // to it, best first, as options allow.  They are found together from
+      // one search out of each end, not a search apiece.
+    DeliveryResult generateAlternativeRoutes(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        int k,
+        std::vector<Route>& routes,
+        const AlternativeRouteOptions& options = AlternativeRouteOptions()) const;
+      // miles[i][j] is how far targets[j] is from sources[i] by road, going
+      // by the same costs as findReachable, or infinity if it can't be
+      // reached.  One search out of each source, on separate threads, that
+      // stops once it has every target.  BAD_COORD if any point isn't on
+      // the map.
+    DeliveryResult generateDistanceMatrix(
+        const std::vector<GeoCoord>& sources,
+        const std::vector<GeoCoord>& targets,
+        std::vector<std::vector<double>>& miles) const;
+      // generatePointToPointRoute on the shared executor.  The search gives up
+      // once token is cancelled.  The StreetMap must outlive the future; this
+      // router needn't.
+    std::future<RouteResult> generatePointToPointRouteAsync(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        const CancellationToken& token = CancellationToken()) const;
       // We prevent a PointToPointRouter object from being copied or assigned.
     PointToPointRouter(const PointToPointRouter&) = delete;
     PointToPointRouter& operator=(const PointToPointRouter&) = delete;
@@ -108,11 +406,97 @@ private:
 
 struct DeliveryRequest
 {
-    DeliveryRequest(std::string it, const GeoCoord& loc)
-     : item(it), location(loc)
+    DeliveryRequest(std::string it, const GeoCoord& loc, double qty = 1)
+     : item(std::move(it)), location(loc), quantity(qty),
+       windowStart(0), windowEnd(std::numeric_limits<double>::infinity()), serviceTime(0)
     {}
     std::string item;
     GeoCoord location;
+    double quantity;    // how much of a vehicle's capacity the item takes up
+
+      // When the delivery was promised for, in seconds since midnight.  A
+      // driver arriving early waits for windowStart; arriving after windowEnd
+      // is late.  serviceTime is how many seconds the drop-off itself takes.
+    double windowStart;
+    double windowEnd;
+    double serviceTime;
+};
+
+  // A line of a deliveries file that couldn't be read.
+struct DeliveryFileError
+{
+    size_t line;            // counting from 1
+    std::string message;
+    std::string text;       // the line itself
+};
+
+  // Reads a deliveries file: the depot's latitude and longitude on the first
+  // line, then one "latitude longitude:item" line per delivery.  Blank lines
+  // are skipped, as is anything after the depot's longitude.  Lines that
+  // can't be read are left out and reported in errors.  Returns false only if
+  // the file can't be opened, the depot can't be read, or the work it's part
+  // of is cancelled.  With threads other than 1 a big file is split into
+  // that many pieces (0 for one per worker), read on the shared executor;
+  // the deliveries come out in file order either way.
+bool loadDeliveryFile(std::string deliveriesFile, GeoCoord& depot, std::vector<DeliveryRequest>& deliveries,
+    std::vector<DeliveryFileError>& errors, int threads = 1);
+
+  // What an asynchronous optimization gives: the deliveries in their new
+  // order, and the crow distances of the old and new orders.  result is
+  // CANCELLED if it was cancelled before it finished, and the order is then
+  // the best found by then.
+struct OrderResult
+{
+    OrderResult() : result(CANCELLED), oldCrowDistance(0), newCrowDistance(0) {}
+    DeliveryResult result;
+    std::vector<DeliveryRequest> deliveries;
+    double oldCrowDistance;
+    double newCrowDistance;
+};
+
+class HubLabelsImpl;
+
+  // Shortest-route miles between any two points on a map, looked up instead
+  // of searched for.  Each intersection gets a label, its distances to a few
+  // hub intersections, chosen so that any two labels have a hub in common on
+  // a shortest route between them; a query merges the two labels, which
+  // takes microseconds.  Building takes much longer, on the shared executor,
+  // so the labels can be saved and loaded again.  They go by the map's
+  // lengths as it was when they were built, to within an inch or so, and
+  // are out of date once a segment is closed or its cost changed, until it
+  // is put back or the labels are built again.  A tiled map can't be
+  // labelled.
+class HubLabels
+{
+public:
+    HubLabels(const StreetMap* sm);
+    ~HubLabels();
+      // Labels the map as it is now, replacing any labels there were.
+      // Returns false if the map is tiled or has nothing loaded.
+    bool build();
+      // A compressed file of the labels.  load returns false if the file
+      // can't be read or was saved for another map, or the map loaded
+      // another way, and then keeps the labels it had.
+    bool save(std::string file) const;
+    bool load(std::string file);
+      // true until the labels have been built or loaded
+    bool empty() const;
+      // whether the map is still as it was when the labels were built: the
+      // same map loaded, and every segment open at its own length
+    bool current() const;
+      // -1 if either point isn't an end of a segment, infinity if there is
+      // no route between them
+    double distance(const GeoCoord& start, const GeoCoord& end) const;
+      // miles[i][j] is distance(points[i], points[j]); each point is looked
+      // up once and the rows are split across the executor
+    void distanceTable(const std::vector<GeoCoord>& points, std::vector<std::vector<double>>& miles) const;
+      // hubs in all the labels together, which is what the labels' size goes by
+    size_t labelEntries() const;
+      // We prevent a HubLabels object from being copied or assigned.
+    HubLabels(const HubLabels&) = delete;
+    HubLabels& operator=(const HubLabels&) = delete;
+private:
+    HubLabelsImpl* m_impl;
 };
 
 class DeliveryOptimizerImpl;
@@ -127,6 +511,32 @@ public:
         std::vector<DeliveryRequest>& deliveries,
         double& oldCrowDistance,
         double& newCrowDistance) const;
+      // As above, but for a driver leaving the depot at departureTime (seconds
+      // since midnight), trading distance off against lateness: each second
+      // past a delivery's windowEnd costs as much as kLatenessPenalty miles.
+    void optimizeDeliveryOrder(
+        const GeoCoord& depot,
+        std::vector<DeliveryRequest>& deliveries,
+        double departureTime,
+        double& oldCrowDistance,
+        double& newCrowDistance) const;
+    static constexpr double kLatenessPenalty = 1.0 / 60;
+      // Orders with at most maxStops deliveries (16 by default) and no
+      // deadlines are solved exactly instead of by simulated annealing.
+    void setExactSolverLimit(int maxStops);
+      // Orders without deadlines are scored by the road distances in labels,
+      // which must outlive the optimizer, instead of crow distance (the old
+      // and new crow distances reported are still crow distances).  Null,
+      // the default, goes back to crow distance.  Orders of more than 2000
+      // deliveries, any with a point the labels can't reach, and all of them
+      // while the labels aren't current, are still scored by crow distance.
+    void setHubLabels(const HubLabels* labels);
+      // optimizeDeliveryOrder on the shared executor, which stops improving
+      // the order once token is cancelled.  The deliveries are copied in.
+    std::future<OrderResult> optimizeDeliveryOrderAsync(
+        const GeoCoord& depot,
+        const std::vector<DeliveryRequest>& deliveries,
+        const CancellationToken& token = CancellationToken()) const;
       // We prevent a DeliveryOptimizer object from being copied or assigned.
     DeliveryOptimizer(const DeliveryOptimizer&) = delete;
     DeliveryOptimizer& operator=(const DeliveryOptimizer&) = delete;
@@ -208,6 +618,16 @@ private:
     double       m_distance;    // 1.92 (in miles)
 };
 
+  // What an asynchronous plan gives; result is CANCELLED if it was cancelled
+  // before it was done.
+struct PlanResult
+{
+    PlanResult() : result(CANCELLED), totalDistanceTravelled(0) {}
+    DeliveryResult result;
+    std::vector<DeliveryCommand> commands;
+    double totalDistanceTravelled;
+};
+
 class DeliveryPlannerImpl;
 
 class DeliveryPlanner
@@ -220,6 +640,28 @@ public:
         const std::vector<DeliveryRequest>& deliveries,
         std::vector<DeliveryCommand>& commands,
         double& totalDistanceTravelled) const;
+      // Plans by travel time instead, with the driver leaving the depot at
+      // departureTime (seconds since midnight).  arrivalTimes gets the time
+      // the driver reaches each delivery in the order visited, followed by
+      // the time they are back at the depot.  The order is chosen with the
+      // deliveries' time windows in mind, and the driver waits for a window
+      // to open and spends each delivery's service time before moving on.
+    DeliveryResult generateDeliveryPlan(
+        const GeoCoord& depot,
+        const std::vector<DeliveryRequest>& deliveries,
+        double departureTime,
+        std::vector<DeliveryCommand>& commands,
+        double& totalDistanceTravelled,
+        std::vector<double>& arrivalTimes) const;
+      // Appends the commands for following route to commands.
+    void getCommands(const Route& route, std::vector<DeliveryCommand>& commands) const;
+      // generateDeliveryPlan on the shared executor.  Once token is cancelled
+      // the optimizer stops and the legs' searches give up.  The StreetMap
+      // must outlive the future; this planner needn't.
+    std::future<PlanResult> generateDeliveryPlanAsync(
+        const GeoCoord& depot,
+        const std::vector<DeliveryRequest>& deliveries,
+        const CancellationToken& token = CancellationToken()) const;
       // We prevent a DeliveryPlanner object from being copied or assigned.
     DeliveryPlanner(const DeliveryPlanner&) = delete;
     DeliveryPlanner& operator=(const DeliveryPlanner&) = delete;
@@ -227,6 +669,133 @@ private:
     DeliveryPlannerImpl* m_impl;
 };
 
+struct Vehicle
+{
+    Vehicle(std::string n, double cap)
+     : name(n), capacity(cap)
+    {}
+    std::string name;
+    double capacity;    // in the same units as DeliveryRequest::quantity
+};
+
+class FleetPlannerImpl;
+
+class FleetPlanner
+{
+public:
+    FleetPlanner(const StreetMap* sm);
+    ~FleetPlanner();
+      // Splits the deliveries among the vehicles without going over any
+      // vehicle's capacity, then plans each vehicle's route.  commands and
+      // distances get one entry per vehicle, in the order the vehicles were
+      // given; a vehicle with nothing to deliver gets no commands.  Returns
+      // OVER_CAPACITY if the deliveries can't be fit into the vehicles.
+    DeliveryResult generateFleetPlan(
+        const GeoCoord& depot,
+        const std::vector<Vehicle>& vehicles,
+        const std::vector<DeliveryRequest>& deliveries,
+        std::vector<std::vector<DeliveryCommand>>& commands,
+        std::vector<double>& distances,
+        double& totalDistanceTravelled) const;
+      // We prevent a FleetPlanner object from being copied or assigned.
+    FleetPlanner(const FleetPlanner&) = delete;
+    FleetPlanner& operator=(const FleetPlanner&) = delete;
+private:
+    FleetPlannerImpl* m_impl;
+};
+
+  // A kitchen and the vehicles that set out from it.
+struct Depot
+{
+    Depot(const GeoCoord& loc, std::vector<Vehicle> v)
+     : location(loc), vehicles(std::move(v))
+    {}
+    GeoCoord location;
+    std::vector<Vehicle> vehicles;
+};
+
+  // What one depot sends out.  Each member has one entry per vehicle, in the
+  // order the depot's vehicles were given; a vehicle with nothing to deliver
+  // gets no deliveries and no commands.
+struct DepotPlan
+{
+    std::vector<std::vector<int>> deliveries;   // indexes into the deliveries planned
+    std::vector<std::vector<DeliveryCommand>> commands;
+    std::vector<double> distances;
+};
+
+class MultiDepotPlannerImpl;
+
+  // Plans a batch of deliveries across several depots.  Every delivery goes
+  // to the nearest depot by road that has room for it, then each depot's
+  // deliveries are clustered around one stop per vehicle, again by road and
+  // within each vehicle's capacity.  Each cluster is planned on its own by
+  // DeliveryPlanner, the clusters on separate threads.
+class MultiDepotPlanner
+{
+public:
+    MultiDepotPlanner(const StreetMap* sm);
+    ~MultiDepotPlanner();
+      // plans gets one entry per depot, in the order the depots were given.
+      // Returns NO_ROUTE if some delivery can't be reached from any depot,
+      // and OVER_CAPACITY if the deliveries can't be fit into the vehicles.
+    DeliveryResult generatePlan(
+        const std::vector<Depot>& depots,
+        const std::vector<DeliveryRequest>& deliveries,
+        std::vector<DepotPlan>& plans,
+        double& totalDistanceTravelled) const;
+      // We prevent a MultiDepotPlanner object from being copied or assigned.
+    MultiDepotPlanner(const MultiDepotPlanner&) = delete;
+    MultiDepotPlanner& operator=(const MultiDepotPlanner&) = delete;
+private:
+    MultiDepotPlannerImpl* m_impl;
+};
+
+class ShiftPlanImpl;
+
+  // A driver's plan for a shift, kept up to date as orders come in or are
+  // cancelled after the driver has set out.  A stop is put in where it adds
+  // least, the stops around a change are tidied up a little, and only the
+  // legs that change are routed again.  Distances are shortest-route miles.
+  // A plan started with a departure time also weighs the stops' time windows
+  // as DeliveryOptimizer does, driving the legs at 25 mph: each second a
+  // change makes the stops later costs kLatenessPenalty miles.
+class ShiftPlan
+{
+public:
+    ShiftPlan(const StreetMap* sm);
+    ~ShiftPlan();
+      // Plans the deliveries from the depot and back as DeliveryPlanner
+      // orders them, replacing any plan there was.
+    DeliveryResult start(const GeoCoord& depot, const std::vector<DeliveryRequest>& deliveries);
+      // The same, for a driver leaving the depot at departureTime (seconds
+      // since midnight), with the order chosen with the time windows in mind.
+    DeliveryResult start(const GeoCoord& depot, const std::vector<DeliveryRequest>& deliveries,
+        double departureTime);
+      // The driver has made the next count stops, which stay where they are.
+    void advance(int count = 1);
+      // Puts delivery in among the stops still to be made.
+    DeliveryResult insertStop(const DeliveryRequest& delivery);
+      // Takes out the stop at position in stops(); BAD_POSITION if there's
+      // no such stop still to be made.
+    DeliveryResult removeStop(int position);
+      // How many stops either side of a change are tidied up (8 by default);
+      // 0 leaves them as they are.
+    void setRepairWindow(int stops);
+      // every stop, made or not, in the order they are made
+    const std::vector<DeliveryRequest>& stops() const;
+    int stopsMade() const;
+      // from the depot and back, including what's been driven
+    double totalDistance() const;
+      // the commands from the last stop made (or the depot) to the end
+    void getCommands(std::vector<DeliveryCommand>& commands) const;
+      // We prevent a ShiftPlan object from being copied or assigned.
+    ShiftPlan(const ShiftPlan&) = delete;
+    ShiftPlan& operator=(const ShiftPlan&) = delete;
+private:
+    ShiftPlanImpl* m_impl;
+};
+
 // Tools for computing distance between GeoCoords, angle of a StreetSegment,
 // and angle between two StreetSegments 
 